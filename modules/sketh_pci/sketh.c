@@ -8,6 +8,7 @@
 #include <linux/interrupt.h>
 #include <linux/skbuff.h>
 #include <linux/pci.h>
+#include <linux/platform_device.h>
 #include <linux/dma-mapping.h>
 #include <linux/workqueue.h>
 #include <linux/netfilter.h>
@@ -21,22 +22,185 @@
 #include <linux/ipv6.h>
 #include <linux/filter.h>
 #include <linux/bpf.h>
+#include <linux/bpf_trace.h>
 #include <linux/limits.h>
 #include <linux/bitops.h>
 #include <linux/atomic.h>
 #include <linux/cpumask.h>
 #include <linux/version.h>
+#include <linux/prefetch.h>
+#include <linux/jhash.h>
+#include <linux/cpu_rmap.h>
+#include <net/checksum.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
+#include <net/tcp.h>
+#include <net/vxlan.h>
+#include <net/flow_dissector.h>
+#include <net/netfilter/nf_flow_table.h>
+#include <net/ip6_checksum.h>
+#include <net/xdp_sock_drv.h>
+#include <net/dcbnl.h>
+#include <net/devlink.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#include <net/page_pool/helpers.h>
+#else
+#include <net/page_pool.h>
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
 
 #include <uapi/linux/bpf_common.h>
 
 #include "sketh.h"
 
 #define SKETH_NAPI_WEIGHT 64
+#define SKETH_TX_WORK_LIMIT 256
 #define SKETH_MIN_MTU 68
 #define SKETH_MAX_MTU 9000
 #define SKETH_DEFAULT_MTU 1500
-#define SKETH_TX_DESC_CMD_EOP 0x01
-#define SKETH_TX_DESC_CMD_RS 0x02
+
+/*
+ * Worst case skb: context, a head of up to 32K and every frag, 16K per
+ * descriptor. Frags come from at most SKB_FRAG_PAGE_ORDER pages, 32K, so
+ * each splits at most once. A larger linear head is still counted exactly
+ * in sketh_start_xmit(), it may just bounce once.
+ */
+#define DESC_NEEDED (2 * MAX_SKB_FRAGS + 4)
+#define SKETH_TX_WAKE_THRESHOLD (DESC_NEEDED * 2)
+
+/* A stopped queue has to be able to reach the wake threshold again */
+#define SKETH_TX_MIN_DESC                                       \
+    ALIGN(max_t(u32, SKETH_MIN_DESC, SKETH_TX_WAKE_THRESHOLD + 1), \
+          SKETH_REQ_DESC_MULTIPLE)
+
+#define SKETH_RX_HEADROOM (NET_SKB_PAD + NET_IP_ALIGN)
+#define SKETH_RX_TRUESIZE SKETH_RX_BUF_SIZE
+
+/* XDP runs on a full 4K buffer so XDP_PACKET_HEADROOM still fits a 1500 MTU */
+#define SKETH_RX_XDP_TRUESIZE 4096
+
+/* Fragment allocation is implied by page_pool from 6.7 on */
+#ifndef PP_FLAG_PAGE_FRAG
+#define PP_FLAG_PAGE_FRAG 0
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+#define HAVE_XDP_FRAGS
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+#define HAVE_NAPI_THREADED
+#endif
+
+/* dev_set_threaded() takes a netdev_napi_threaded mode from 6.17 on */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+#define sketh_set_threaded(dev) \
+    dev_set_threaded(dev, NETDEV_NAPI_THREADED_ENABLED)
+#elif defined(HAVE_NAPI_THREADED)
+#define sketh_set_threaded(dev) dev_set_threaded(dev, true)
+#else
+#define sketh_set_threaded(dev) (-EOPNOTSUPP)
+#endif
+
+/* NAPI instances are linked to their IRQ and queues for netlink from 6.8 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define HAVE_NETIF_QUEUE_SET_NAPI
+#endif
+
+/* Renamed in 6.8 */
+#ifndef PCI_IRQ_INTX
+#define PCI_IRQ_INTX PCI_IRQ_LEGACY
+#endif
+
+/* Renamed from xdp_do_flush_map() in 5.6 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+#define xdp_do_flush xdp_do_flush_map
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+#define HAVE_XDP_FEATURES
+#endif
+
+/* The pool argument was dropped in 6.10 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define sketh_xsk_buff_dma_sync_for_cpu(xdp, pool) \
+    xsk_buff_dma_sync_for_cpu(xdp)
+#else
+#define sketh_xsk_buff_dma_sync_for_cpu(xdp, pool) \
+    xsk_buff_dma_sync_for_cpu(xdp, pool)
+#endif
+
+/* net_dim() takes the sample by pointer from 6.13 on */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+#define sketh_net_dim(dim, sample) net_dim(dim, &(sample))
+#else
+#define sketh_net_dim(dim, sample) net_dim(dim, sample)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+#define HAVE_ETHTOOL_COALESCE_EXTACK
+#endif
+
+/* get/set_rxfh take a parameter block from 6.8 on */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define HAVE_ETHTOOL_RXFH_PARAM
+#endif
+
+/* Hash field selection moved out of get/set_rxnfc in 6.17 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+#define HAVE_ETHTOOL_RXFH_FIELDS
+#endif
+
+/* A drops counter was added to flow_stats_update() in 5.9 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+#define sketh_flow_stats_update(stats, bytes, pkts, lastused) \
+    flow_stats_update(stats, bytes, pkts, 0, lastused, \
+                      FLOW_ACTION_HW_STATS_DELAYED)
+#else
+#define sketh_flow_stats_update(stats, bytes, pkts, lastused) \
+    flow_stats_update(stats, bytes, pkts, lastused, \
+                      FLOW_ACTION_HW_STATS_DELAYED)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+#define sketh_warn_invalid_xdp_action(dev, prog, act) \
+    bpf_warn_invalid_xdp_action(dev, prog, act)
+#else
+#define sketh_warn_invalid_xdp_action(dev, prog, act) \
+    bpf_warn_invalid_xdp_action(act)
+#endif
+
+/* Platform driver remove() returns void from 6.11 on */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+#define HAVE_PLATFORM_REMOVE_VOID
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0)
+#define eth_hw_addr_set(dev, addr) ether_addr_copy((dev)->dev_addr, addr)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+#define txq_trans_cond_update(txq) ((txq)->trans_start = jiffies)
+#endif
+
+/* devlink_alloc() takes the parent device from 5.15 on */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+#define HAVE_DEVLINK_HEALTH
+#endif
+
+/* The grace period moved into devlink_health_reporter_ops in 6.18 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 18, 0)
+#define HAVE_DEVLINK_REPORTER_OPS_GRACE
+#endif
+
+/* The host's LLDP agent owns DCB, the device runs no DCBX of its own */
+#define SKETH_DCBX_CAP (DCB_CAP_DCBX_HOST | DCB_CAP_DCBX_VER_IEEE)
 
 static int debug = -1;
 module_param(debug, int, 0);
@@ -50,17 +214,43 @@ static int mtu = SKETH_DEFAULT_MTU;
 module_param(mtu, int, 0);
 MODULE_PARM_DESC(mtu, "Maximum Transfer Unit");
 
+static bool napi_threaded;
+module_param(napi_threaded, bool, 0);
+MODULE_PARM_DESC(napi_threaded, "Poll each queue from a kthread pinned to its CPU");
+
 #define sketh_debug(d, level, fmt, args...)          \
     do {                                             \
         if ((d)->msg_enable & (level))               \
             netdev_info(d->netdev, fmt, ##args);    \
     } while (0)
 
+/*
+ * Built with SKETH_SIM=y the driver also binds to sketh-sim devices, whose
+ * registers are callbacks rather than a BAR. Without it the check is a
+ * constant and the accessors stay plain MMIO.
+ */
+#ifdef SKETH_SIM
+#define sketh_is_sim(a)           unlikely((a)->sim != NULL)
+#define sketh_wr32(a, reg, val)                                         \
+    (sketh_is_sim(a) ?                                                  \
+     (a)->sim->ops->wr32((a)->sim->priv, (reg), (val)) :                \
+     writel((val), (a)->hw_addr + (reg)))
+#define sketh_rd32(a, reg)                                              \
+    (sketh_is_sim(a) ?                                                  \
+     (a)->sim->ops->rd32((a)->sim->priv, (reg)) :                       \
+     readl((a)->hw_addr + (reg)))
+#else
+#define sketh_is_sim(a)           false
+#define sketh_wr32(a, reg, val)   writel((val), (a)->hw_addr + (reg))
+#define sketh_rd32(a, reg)        readl((a)->hw_addr + (reg))
+#endif
+
 #define sketh_err(d, fmt, args...)    netdev_err(d->netdev, fmt, ##args)
 #define sketh_warn(d, fmt, args...)   netdev_warn(d->netdev, fmt, ##args)
 #define sketh_info(d, fmt, args...)  netdev_info(d->netdev, fmt, ##args)
 
 static int sketh_alloc_queues(struct sketh_adapter *adapter);
+static int sketh_ft_rx(struct sketh_adapter *adapter, struct sk_buff *skb);
 static void sketh_free_queues(struct sketh_adapter *adapter);
 static int sketh_setup_rx_resources(struct sketh_ring *rx_ring);
 static int sketh_setup_tx_resources(struct sketh_ring *tx_ring);
@@ -72,79 +262,427 @@ static void sketh_configure(struct sketh_adapter *adapter);
 static void sketh_unmap_and_free_tx_buffer(struct sketh_ring *tx_ring,
                                            struct sketh_tx_buffer *tx_buffer);
 
+/* Counters with a single writer per ring, see struct sketh_ring */
+#define sketh_rx_stats_inc(R, field)                    \
+    do {                                                \
+        u64_stats_update_begin(&(R)->syncp);            \
+        (R)->rx_stats.field++;                          \
+        u64_stats_update_end(&(R)->syncp);              \
+    } while (0)
+
+#define sketh_xmit_stats_inc(R, field)                  \
+    do {                                                \
+        u64_stats_update_begin(&(R)->xmit_syncp);       \
+        (R)->xmit_stats.field++;                        \
+        u64_stats_update_end(&(R)->xmit_syncp);         \
+    } while (0)
+
+/* Each queue pair masks only its own cause, other vectors keep firing */
 static inline void sketh_enable_irq(struct sketh_ring *ring)
 {
-    if (ring->adapter->msix_entries)
-        enable_irq(ring->adapter->msix_entries[ring->queue_index].vector);
+    sketh_wr32(ring->adapter, SKETH_REG_EIMS,
+               SKETH_EICR_QUEUE(ring->queue_index));
 }
 
 static inline void sketh_disable_irq(struct sketh_ring *ring)
 {
-    if (ring->adapter->msix_entries)
-        disable_irq(ring->adapter->msix_entries[ring->queue_index].vector);
+    sketh_wr32(ring->adapter, SKETH_REG_EIMC,
+               SKETH_EICR_QUEUE(ring->queue_index));
+}
+
+static void
+sketh_write_itr(struct sketh_ring *ring)
+{
+    struct sketh_adapter *adapter = ring->adapter;
+    u32 val = ring->itr_usecs |
+              ((u32)ring->itr_frames << SKETH_ITR_FRAMES_SHIFT);
+
+    /* Both rings of a queue pair share the vector of the RX ring */
+    if (ring->is_tx)
+        sketh_wr32(adapter, SKETH_REG_TX_ITR(ring->queue_index), val);
+    else
+        sketh_wr32(adapter, SKETH_REG_RX_ITR(ring->queue_index), val);
+}
+
+static void
+sketh_rx_dim_work(struct work_struct *work)
+{
+    struct dim *dim = container_of(work, struct dim, work);
+    struct sketh_ring *rx_ring = container_of(dim, struct sketh_ring, dim);
+    struct dim_cq_moder moder;
+
+    moder = net_dim_get_rx_moderation(dim->mode, dim->profile_ix);
+
+    rx_ring->itr_usecs = moder.usec;
+    rx_ring->itr_frames = moder.pkts;
+    sketh_write_itr(rx_ring);
+
+    dim->state = DIM_START_MEASURE;
+}
+
+static void
+sketh_tx_dim_work(struct work_struct *work)
+{
+    struct dim *dim = container_of(work, struct dim, work);
+    struct sketh_ring *tx_ring = container_of(dim, struct sketh_ring, dim);
+    struct dim_cq_moder moder;
+
+    moder = net_dim_get_tx_moderation(dim->mode, dim->profile_ix);
+
+    tx_ring->itr_usecs = moder.usec;
+    tx_ring->itr_frames = moder.pkts;
+    sketh_write_itr(tx_ring);
+
+    dim->state = DIM_START_MEASURE;
+}
+
+static void
+sketh_update_dim(struct sketh_ring *rx_ring, struct sketh_ring *tx_ring)
+{
+    struct sketh_adapter *adapter = rx_ring->adapter;
+    struct dim_sample sample = {};
+    u16 events = rx_ring->irqs;
+
+    /* Fed once per completed poll, i.e. once per re-armed interrupt */
+    if (adapter->rx_dim_enabled) {
+        dim_update_sample(events, rx_ring->rx_stats.packets,
+                          rx_ring->rx_stats.bytes, &sample);
+        sketh_net_dim(&rx_ring->dim, sample);
+    }
+
+    if (adapter->tx_dim_enabled) {
+        dim_update_sample(events, tx_ring->tx_stats.packets,
+                          tx_ring->tx_stats.bytes, &sample);
+        sketh_net_dim(&tx_ring->dim, sample);
+    }
 }
 
-int sketh_xmit_desc(struct sketh_ring *tx_ring, dma_addr_t dma, unsigned int len, unsigned int tx_flags)
+int sketh_xmit_desc(struct sketh_ring *tx_ring, dma_addr_t dma, unsigned int len,
+                    unsigned int tx_flags, u8 cmd)
 {
     union sketh_tx_desc *desc;
-    unsigned int i;
 
-    i = tx_ring->next_to_use;
-    desc = &((union sketh_tx_desc *)tx_ring->desc)[i];
+    desc = SKETH_TX_DESC(tx_ring, tx_ring->next_to_use);
 
-    desc->read.pkt_addr = dma;
-    desc->read.length = len;
-    desc->read.cmd = SKETH_TX_DESC_CMD_EOP | SKETH_TX_DESC_CMD_RS;
+    desc->read.pkt_addr = cpu_to_le64(dma);
+    desc->read.length = cpu_to_le16(len);
+    desc->read.cmd = cmd;
+    desc->read.cso = 0;
+    desc->read.status = 0;
 
     if (tx_flags & SKETH_TX_FLAGS_CSUM)
-        desc->read.cso = 0;
+        desc->read.cso = tx_flags >> SKETH_TX_FLAGS_CSO_SHIFT;
 
     tx_ring->next_to_use = next_to_use(tx_ring->next_to_use, tx_ring->count);
 
     return 0;
 }
 
+/* The class of the ring is paused, PFC XON wakes it rather than completions */
+static inline bool
+sketh_tx_pfc_paused(struct sketh_ring *tx_ring)
+{
+    u8 xoff_tc = READ_ONCE(tx_ring->adapter->pfc_xoff_tc);
+    int tc;
+
+    if (likely(!xoff_tc))
+        return false;
+
+    tc = netdev_txq_to_tc(tx_ring->netdev, tx_ring->queue_index);
+
+    return tc >= 0 && (xoff_tc & BIT(tc));
+}
+
+static int
+__sketh_maybe_stop_tx(struct sketh_ring *tx_ring, u16 size)
+{
+    netif_stop_subqueue(tx_ring->netdev, tx_ring->queue_index);
+    sketh_xmit_stats_inc(tx_ring, stop_queue);
+
+    /* Pairs with the barrier in sketh_clean_tx_ring() before the wake */
+    smp_mb();
+
+    if (likely(sketh_desc_unused(tx_ring) < size) ||
+        sketh_tx_pfc_paused(tx_ring))
+        return -EBUSY;
+
+    /* Completion freed descriptors in the meantime */
+    netif_start_subqueue(tx_ring->netdev, tx_ring->queue_index);
+    sketh_xmit_stats_inc(tx_ring, restart_queue);
+
+    return 0;
+}
+
+static inline int
+sketh_maybe_stop_tx(struct sketh_ring *tx_ring, u16 size)
+{
+    if (likely(sketh_desc_unused(tx_ring) >= size))
+        return 0;
+
+    return __sketh_maybe_stop_tx(tx_ring, size);
+}
+
+static inline void
+sketh_write_tail(struct sketh_ring *ring, u32 reg, u32 val)
+{
+    /* Descriptor writes must be visible before the device sees the tail */
+    wmb();
+
+    if (sketh_is_sim(ring->adapter))
+        sketh_wr32(ring->adapter, reg, val);
+    else
+        writel(val, ring->tail);
+}
+
+static inline void
+sketh_tx_doorbell(struct sketh_ring *tx_ring)
+{
+    sketh_write_tail(tx_ring, SKETH_REG_TDT(tx_ring->reg_idx),
+                     tx_ring->next_to_use);
+    sketh_xmit_stats_inc(tx_ring, doorbell);
+}
+
 bool
 sketh_alloc_rx_buffers(struct sketh_ring *rx_ring, int cleaned_count)
 {
+    union sketh_rx_desc *rx_desc;
     struct sketh_rx_buffer *bi;
+    struct page *page;
+    unsigned int offset;
     unsigned int i;
-    unsigned int ntu;
 
     i = rx_ring->next_to_use;
-    bi = &rx_ring->rx_buffer[i];
 
     while (cleaned_count--) {
-        struct sk_buff *skb;
+        bi = &rx_ring->rx_buffer[i];
 
-        skb = __netdev_alloc_skb(rx_ring->netdev,
-                                  rx_ring->adapter->netdev->mtu + ETH_HLEN + VLAN_HLEN,
-                                  GFP_ATOMIC);
-        if (!skb) {
-            rx_ring->adapter->rx_drops++;
+        page = page_pool_dev_alloc_frag(rx_ring->page_pool, &offset,
+                                        rx_ring->rx_truesize);
+        if (!page) {
+            sketh_rx_stats_inc(rx_ring, alloc_failed);
             break;
         }
 
-        bi->skb = skb;
-        bi->dma = dma_map_single(rx_ring->adapter->pci_dev->dev.parent,
-                                  skb->data,
-                                  rx_ring->adapter->netdev->mtu + ETH_HLEN + VLAN_HLEN,
-                                  DMA_FROM_DEVICE);
+        bi->page = page;
+        bi->page_offset = offset;
+        bi->dma = page_pool_get_dma_addr(page) + offset;
 
-        if (dma_mapping_error(rx_ring->adapter->pci_dev->dev.parent, bi->dma)) {
-            dev_kfree_skb(skb);
-            bi->skb = NULL;
-            rx_ring->adapter->rx_drops++;
-            break;
+        /* The pool keeps the page mapped, only hand ownership back */
+        dma_sync_single_range_for_device(rx_ring->dev, bi->dma,
+                                         rx_ring->rx_headroom,
+                                         rx_ring->rx_buf_len,
+                                         page_pool_get_dma_dir(rx_ring->page_pool));
+
+        rx_desc = SKETH_RX_DESC(rx_ring, i);
+        rx_desc->read.pkt_addr = cpu_to_le64(bi->dma + rx_ring->rx_headroom);
+        /* Write-back overwrote it, every slot owns a fixed header buffer */
+        rx_desc->read.hdr_addr = rx_ring->hdr_split ?
+            cpu_to_le64(rx_ring->hdr_dma + i * SKETH_RX_HDR_SIZE) : 0;
+        rx_desc->read.status = 0;
+
+        i = next_to_use(i, rx_ring->count);
+    }
+
+    if (rx_ring->next_to_use != i) {
+        rx_ring->next_to_use = i;
+        sketh_write_tail(rx_ring, SKETH_REG_RDT(rx_ring->reg_idx), i);
+    }
+
+    return cleaned_count < 0;
+}
+
+static void
+sketh_free_rx_buffers(struct sketh_ring *rx_ring)
+{
+    unsigned int i;
+
+    if (!rx_ring->rx_buffer)
+        return;
+
+    for (i = 0; i < rx_ring->count; i++) {
+        struct sketh_rx_buffer *bi = &rx_ring->rx_buffer[i];
+
+        if (bi->xdp) {
+            xsk_buff_free(bi->xdp);
+            bi->xdp = NULL;
         }
 
-        ntu = next_to_use(i, rx_ring->count);
-        bi = &rx_ring->rx_buffer[ntu];
-        i = ntu;
+        if (!bi->page)
+            continue;
+
+        page_pool_put_full_page(rx_ring->page_pool, bi->page, false);
+        bi->page = NULL;
+    }
+
+    if (rx_ring->skb) {
+        dev_kfree_skb(rx_ring->skb);
+        rx_ring->skb = NULL;
+    }
+
+    if (rx_ring->xdp.data) {
+        xdp_return_buff(&rx_ring->xdp);
+        rx_ring->xdp.data = NULL;
+    }
+
+    rx_ring->rx_discard = false;
+
+    rx_ring->next_to_clean = 0;
+    rx_ring->next_to_use = 0;
+}
+
+static struct sk_buff *
+sketh_build_skb(struct sketh_ring *rx_ring, struct xdp_buff *xdp)
+{
+    unsigned int metasize = xdp->data - xdp->data_meta;
+#ifdef HAVE_XDP_FRAGS
+    struct skb_shared_info *sinfo = xdp_get_shared_info_from_buff(xdp);
+    u8 nr_frags = 0;
+#endif
+    struct sk_buff *skb;
+
+#ifdef HAVE_XDP_FRAGS
+    /* napi_build_skb() clears nr_frags in the shared info it reuses */
+    if (unlikely(xdp_buff_has_frags(xdp)))
+        nr_frags = sinfo->nr_frags;
+#endif
+
+    skb = napi_build_skb(xdp->data_hard_start, xdp->frame_sz);
+    if (unlikely(!skb))
+        return NULL;
+
+    skb_mark_for_recycle(skb);
+    skb_reserve(skb, xdp->data - xdp->data_hard_start);
+    __skb_put(skb, xdp->data_end - xdp->data);
+
+    if (metasize)
+        skb_metadata_set(skb, metasize);
+
+#ifdef HAVE_XDP_FRAGS
+    if (unlikely(nr_frags))
+        xdp_update_skb_shared_info(skb, nr_frags, sinfo->xdp_frags_size,
+                                   nr_frags * xdp->frame_sz,
+                                   xdp_buff_is_frag_pfmemalloc(xdp));
+#endif
+
+    return skb;
+}
+
+/*
+ * Header split receive: the linear part holds only the headers, copied out
+ * of the header buffer, the payload stays in its page as a fragment. Frames
+ * the device did not split get their headers pulled out of the page.
+ */
+static struct sk_buff *
+sketh_build_split_skb(struct sketh_ring *rx_ring, union sketh_rx_desc *rx_desc,
+                      struct sketh_rx_buffer *rx_buffer, u16 status,
+                      unsigned int size)
+{
+    void *va = page_address(rx_buffer->page) + rx_buffer->page_offset;
+    unsigned int offset = rx_buffer->page_offset;
+    bool split = status & SKETH_RXD_STAT_SPH;
+    struct sk_buff *skb;
+    unsigned int hlen;
+    void *hdr;
+
+    if (split) {
+        hdr = rx_ring->hdr_buf +
+              (rx_buffer - rx_ring->rx_buffer) * SKETH_RX_HDR_SIZE;
+        hlen = min_t(unsigned int, SKETH_RX_HDR_SIZE,
+                     le16_to_cpu(rx_desc->wb.hdr_len) & SKETH_RXD_HDR_LEN_MASK);
+    } else {
+        hdr = va;
+        hlen = size;
+        if (hlen > SKETH_RX_HDR_SIZE)
+            hlen = eth_get_headlen(rx_ring->netdev, va, SKETH_RX_HDR_SIZE);
+    }
+
+    net_prefetch(hdr);
+
+    skb = napi_alloc_skb(&rx_ring->napi, SKETH_RX_HDR_SIZE);
+    if (unlikely(!skb))
+        return NULL;
+
+    memcpy(__skb_put(skb, hlen), hdr, hlen);
+
+    if (!split) {
+        offset += hlen;
+        size -= hlen;
+    }
+
+    if (size)
+        skb_add_rx_frag(skb, 0, rx_buffer->page, offset, size,
+                        rx_ring->rx_truesize);
+    else
+        page_pool_put_full_page(rx_ring->page_pool, rx_buffer->page, true);
+
+    skb_mark_for_recycle(skb);
+
+    if (split)
+        sketh_rx_stats_inc(rx_ring, hdr_split);
+    else
+        sketh_rx_stats_inc(rx_ring, hdr_nosplit);
+
+    return skb;
+}
+
+static void
+sketh_add_rx_frag(struct sketh_ring *rx_ring,
+                  struct sketh_rx_buffer *rx_buffer,
+                  struct sk_buff *skb,
+                  unsigned int size)
+{
+    skb_add_rx_frag(skb, skb_shinfo(skb)->nr_frags, rx_buffer->page,
+                    rx_buffer->page_offset + rx_ring->rx_headroom,
+                    size, rx_ring->rx_truesize);
+}
+
+static int
+sketh_add_xdp_frag(struct sketh_ring *rx_ring, struct xdp_buff *xdp,
+                   struct sketh_rx_buffer *rx_buffer, unsigned int size)
+{
+#ifdef HAVE_XDP_FRAGS
+    struct skb_shared_info *sinfo = xdp_get_shared_info_from_buff(xdp);
+    skb_frag_t *frag;
+
+    if (!xdp_buff_has_frags(xdp)) {
+        sinfo->nr_frags = 0;
+        sinfo->xdp_frags_size = 0;
+        xdp_buff_set_frags_flag(xdp);
     }
 
-    rx_ring->next_to_use = i;
+    if (unlikely(sinfo->nr_frags == MAX_SKB_FRAGS))
+        return -ENOMEM;
+
+    frag = &sinfo->frags[sinfo->nr_frags++];
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    skb_frag_fill_page_desc(frag, rx_buffer->page,
+                            rx_buffer->page_offset + rx_ring->rx_headroom,
+                            size);
+#else
+    __skb_frag_set_page(frag, rx_buffer->page);
+    skb_frag_off_set(frag, rx_buffer->page_offset + rx_ring->rx_headroom);
+    skb_frag_size_set(frag, size);
+#endif
+    sinfo->xdp_frags_size += size;
+
+    if (page_is_pfmemalloc(rx_buffer->page))
+        xdp_buff_set_frag_pfmemalloc(xdp);
+
     return 0;
+#else
+    /* MTU is capped to one buffer while a program is attached */
+    return -EOPNOTSUPP;
+#endif
+}
+
+static unsigned int
+sketh_xdp_len(struct xdp_buff *xdp)
+{
+#ifdef HAVE_XDP_FRAGS
+    return xdp_get_buff_len(xdp);
+#else
+    return xdp->data_end - xdp->data;
+#endif
 }
 
 static bool
@@ -160,6 +698,7 @@ sketh_alloc_tx_buffers(struct sketh_ring *tx_ring)
         bi->skb = NULL;
         bi->dma = 0;
         bi->bytes = 0;
+        bi->len = 0;
         bi->mapped = 0;
 
         tx_ring->next_to_use = next_to_use(tx_ring->next_to_use, tx_ring->count);
@@ -169,865 +708,5921 @@ sketh_alloc_tx_buffers(struct sketh_ring *tx_ring)
     return true;
 }
 
+static void
+sketh_unmap_tx_buffer(struct sketh_ring *tx_ring,
+                      struct sketh_tx_buffer *tx_buffer)
+{
+    if (tx_buffer->mapped == SKETH_TX_MAPPED_SINGLE)
+        dma_unmap_single(tx_ring->dev, tx_buffer->dma,
+                         tx_buffer->len, DMA_TO_DEVICE);
+    else if (tx_buffer->mapped == SKETH_TX_MAPPED_PAGE)
+        dma_unmap_page(tx_ring->dev, tx_buffer->dma,
+                       tx_buffer->len, DMA_TO_DEVICE);
+
+    tx_buffer->dma = 0;
+    tx_buffer->len = 0;
+    tx_buffer->mapped = 0;
+}
+
 static void
 sketh_unmap_and_free_tx_buffer(struct sketh_ring *tx_ring,
                                 struct sketh_tx_buffer *tx_buffer)
 {
-    if (tx_buffer->mapped) {
-        dma_unmap_single(tx_ring->adapter->pci_dev->dev.parent,
-                         tx_buffer->dma,
-                         tx_buffer->bytes,
-                         DMA_TO_DEVICE);
-    }
+    sketh_unmap_tx_buffer(tx_ring, tx_buffer);
 
     if (tx_buffer->skb) {
         dev_kfree_skb_any(tx_buffer->skb);
     }
 
+    if (tx_buffer->xdpf)
+        xdp_return_frame(tx_buffer->xdpf);
+
+    tx_buffer->next_to_watch = NULL;
+    tx_buffer->xdpf = NULL;
     tx_buffer->skb = NULL;
-    tx_buffer->dma = 0;
     tx_buffer->bytes = 0;
-    tx_buffer->mapped = false;
+    tx_buffer->gso_segs = 0;
 }
 
-int
-sketh_clean_tx_ring(struct sketh_ring *tx_ring, int budget)
+bool
+sketh_clean_tx_ring(struct sketh_ring *tx_ring, int napi_budget)
 {
-    struct sketh_tx_buffer *tx_buffer;
+    unsigned int work_limit = napi_budget > 0 ? napi_budget : SKETH_TX_WORK_LIMIT;
     unsigned int total_bytes = 0;
     unsigned int total_packets = 0;
     unsigned int i;
 
     i = tx_ring->next_to_clean;
 
-    while (i != tx_ring->next_to_use) {
-        tx_buffer = &tx_ring->tx_buffer[i];
+    while (likely(work_limit)) {
+        struct sketh_tx_buffer *first = &tx_ring->tx_buffer[i];
+        union sketh_tx_desc *eop_desc, *tx_desc;
+        struct sk_buff *skb;
 
-        if (tx_buffer->skb) {
-            total_bytes += tx_buffer->bytes;
-            total_packets++;
-            sketh_unmap_and_free_tx_buffer(tx_ring, tx_buffer);
-        }
+        eop_desc = READ_ONCE(first->next_to_watch);
+        if (!eop_desc)
+            break;
 
-        i = next_to_use(i, tx_ring->count);
-    }
+        /* Don't look at the descriptor before next_to_watch was set */
+        smp_rmb();
 
-    if (total_packets) {
-        struct netdev_queue *txq = netdev_get_tx_queue(tx_ring->netdev,
-                                                        tx_ring->queue_index);
+        if (!(READ_ONCE(eop_desc->read.status) & cpu_to_le16(SKETH_TXD_STAT_DD)))
+            break;
 
-        tx_ring->netdev->stats.tx_packets += total_packets;
-        tx_ring->netdev->stats.tx_bytes += total_bytes;
-        netif_tx_wake_queue(txq);
-    }
+        first->next_to_watch = NULL;
 
-    tx_ring->next_to_clean = i;
+        skb = first->skb;
+        total_bytes += first->bytes;
+        total_packets += first->gso_segs;
 
-    return 0;
-}
+        first->skb = NULL;
+        first->bytes = 0;
+        first->gso_segs = 0;
 
-void
-sketh_receive_skb(struct sketh_ring *rx_ring, struct sk_buff *skb, unsigned int length)
-{
-    struct sketh_adapter *adapter = rx_ring->adapter;
-    struct net_device *netdev = rx_ring->netdev;
-    int ret;
+        /* Unmap the whole chain up to and including the EOP descriptor */
+        do {
+            tx_desc = SKETH_TX_DESC(tx_ring, i);
+            sketh_unmap_tx_buffer(tx_ring, &tx_ring->tx_buffer[i]);
+            i = next_to_use(i, tx_ring->count);
+        } while (tx_desc != eop_desc);
 
-    if (adapter->xdp_info.prog) {
-        struct xdp_buff xdp;
-        u32 act;
+        if (skb)
+            napi_consume_skb(skb, napi_budget);
+        else if (first->xdpf)
+            xdp_return_frame(first->xdpf);
 
-        xdp_init_buff(&xdp, SKETH_RX_BUF_SIZE, &rx_ring->xdp_rxq);
-        xdp_prepare_buff(&xdp, skb->data, 0, length, false);
+        first->xdpf = NULL;
+        work_limit--;
+    }
 
-        act = bpf_prog_run(adapter->xdp_info.prog, &xdp);
+    tx_ring->next_to_clean = i;
 
-        switch (act) {
-        case XDP_PASS:
-            break;
-        case XDP_TX:
-            sketh_xdp_tx(adapter, &xdp);
-            adapter->xdp_tx++;
-            dev_kfree_skb(skb);
-            return;
-        case XDP_REDIRECT:
-            if (xdp_do_redirect(adapter->netdev, &xdp, adapter->xdp_info.prog) == 0) {
-                adapter->xdp_redirect++;
-            } else {
-                adapter->xdp_drops++;
-            }
-            dev_kfree_skb(skb);
-            return;
-        case XDP_DROP:
-            adapter->xdp_drops++;
-            dev_kfree_skb(skb);
-            return;
-        default:
-            bpf_warn_invalid_xdp_action(act);
-            fallthrough;
-        case XDP_ABORTED:
-            adapter->xdp_drops++;
-            dev_kfree_skb(skb);
-            return;
+    u64_stats_update_begin(&tx_ring->syncp);
+    tx_ring->tx_stats.packets += total_packets;
+    tx_ring->tx_stats.bytes += total_bytes;
+    u64_stats_update_end(&tx_ring->syncp);
+
+    netdev_tx_completed_queue(txring_txq(tx_ring), total_packets, total_bytes);
+
+    if (unlikely(total_packets &&
+                 sketh_desc_unused(tx_ring) >= SKETH_TX_WAKE_THRESHOLD)) {
+        /* Make the new next_to_clean visible before checking the queue */
+        smp_mb();
+
+        if (__netif_subqueue_stopped(tx_ring->netdev, tx_ring->queue_index) &&
+            !test_bit(__SKETH_STATE_DOWN, &tx_ring->adapter->state) &&
+            !sketh_tx_pfc_paused(tx_ring)) {
+            netif_wake_subqueue(tx_ring->netdev, tx_ring->queue_index);
+            u64_stats_update_begin(&tx_ring->syncp);
+            tx_ring->tx_stats.restart_queue++;
+            u64_stats_update_end(&tx_ring->syncp);
         }
     }
 
-    skb_put(skb, length);
-    skb->protocol = eth_type_trans(skb, netdev);
-    skb->ip_summed = CHECKSUM_UNNECESSARY;
-
-    ret = netif_receive_skb(skb);
-    if (ret == NET_RX_DROP) {
-        adapter->rx_drops++;
-    }
+    return !!work_limit;
 }
 
-int
-sketh_clean_rx_ring(struct sketh_ring *rx_ring, int budget)
+static bool
+sketh_clean_xdp_ring(struct sketh_ring *xdp_ring, int napi_budget)
 {
-    struct sketh_adapter *adapter = rx_ring->adapter;
-    struct sketh_rx_buffer *rx_buffer;
-    struct sk_buff *skb;
-    unsigned int total_packets = 0;
+    unsigned int work_limit = napi_budget > 0 ? napi_budget : SKETH_TX_WORK_LIMIT;
     unsigned int total_bytes = 0;
-    int cleaned = 0;
-    unsigned int length;
+    unsigned int total_packets = 0;
+    unsigned int xsk_frames = 0;
+    struct xdp_frame_bulk bq;
+    unsigned int i;
 
-    while (total_packets < budget) {
-        rx_buffer = &rx_ring->rx_buffer[rx_ring->next_to_clean];
-        skb = rx_buffer->skb;
+    i = xdp_ring->next_to_clean;
 
-        if (!skb)
-            break;
+    xdp_frame_bulk_init(&bq);
 
-        dma_unmap_single(adapter->pci_dev->dev.parent,
-                         rx_buffer->dma,
-                         rx_ring->adapter->netdev->mtu + ETH_HLEN + VLAN_HLEN,
-                         DMA_FROM_DEVICE);
+    /* xdp_return_frame_bulk() */
+    rcu_read_lock();
 
-        length = rx_ring->adapter->netdev->mtu + ETH_HLEN;
+    while (likely(work_limit)) {
+        struct sketh_tx_buffer *first = &xdp_ring->tx_buffer[i];
+        union sketh_tx_desc *eop_desc, *tx_desc;
 
-        rx_buffer->skb = NULL;
-        rx_buffer->dma = 0;
+        /* ndo_xdp_xmit() fills this ring from other CPUs */
+        eop_desc = READ_ONCE(first->next_to_watch);
+        if (!eop_desc)
+            break;
 
-        sketh_receive_skb(rx_ring, skb, length);
+        /* Don't look at the descriptor before next_to_watch was set */
+        smp_rmb();
 
+        if (!(READ_ONCE(eop_desc->read.status) & cpu_to_le16(SKETH_TXD_STAT_DD)))
+            break;
+
+        first->next_to_watch = NULL;
+
+        total_bytes += first->bytes;
         total_packets++;
-        total_bytes += length;
-        cleaned++;
 
-        rx_ring->next_to_clean = next_to_use(rx_ring->next_to_clean,
-                                              rx_ring->count);
+        /* AF_XDP descriptors carry no frame, they go back to the socket */
+        if (first->xdpf)
+            xdp_return_frame_bulk(first->xdpf, &bq);
+        else
+            xsk_frames++;
+
+        first->xdpf = NULL;
+        first->bytes = 0;
+        first->gso_segs = 0;
+
+        do {
+            tx_desc = SKETH_TX_DESC(xdp_ring, i);
+            sketh_unmap_tx_buffer(xdp_ring, &xdp_ring->tx_buffer[i]);
+            i = next_to_use(i, xdp_ring->count);
+        } while (tx_desc != eop_desc);
+
+        work_limit--;
     }
 
-    if (cleaned) {
-        sketh_alloc_rx_buffers(rx_ring, cleaned);
-        rx_ring->netdev->stats.rx_packets += total_packets;
-        rx_ring->netdev->stats.rx_bytes += total_bytes;
+    xdp_flush_frame_bulk(&bq);
+    rcu_read_unlock();
+
+    xdp_ring->next_to_clean = i;
+
+    u64_stats_update_begin(&xdp_ring->syncp);
+    xdp_ring->tx_stats.packets += total_packets;
+    xdp_ring->tx_stats.bytes += total_bytes;
+    u64_stats_update_end(&xdp_ring->syncp);
+
+    if (xdp_ring->xsk_pool) {
+        if (xsk_frames)
+            xsk_tx_completed(xdp_ring->xsk_pool, xsk_frames);
+
+        if (xsk_uses_need_wakeup(xdp_ring->xsk_pool))
+            xsk_set_tx_need_wakeup(xdp_ring->xsk_pool);
     }
 
-    return total_packets;
+    return !!work_limit;
 }
 
-int
-sketh_napi_poll(struct napi_struct *napi, int budget)
+/*
+ * Returns true for a checksummed TCP data segment that may join an
+ * aggregate: no IP options or fragments, only ACK/PSH set, no link
+ * padding and all headers in the linear area.
+ */
+static bool
+sketh_hw_gro_parse(struct sk_buff *skb, unsigned int *hlen)
 {
-    struct sketh_ring *rx_ring = container_of(napi, struct sketh_ring, napi);
-    struct sketh_adapter *adapter = rx_ring->adapter;
-    int work_done = 0;
+    unsigned int thoff, len;
+    struct tcphdr *th;
 
-    adapter->rx_polls++;
+    if (skb->pkt_type != PACKET_HOST || skb_has_frag_list(skb))
+        return false;
 
-    work_done += sketh_clean_rx_ring(rx_ring, budget);
+    switch (skb->protocol) {
+    case htons(ETH_P_IP): {
+        struct iphdr *iph = (struct iphdr *)skb->data;
 
-    if (rx_ring->next_to_use != rx_ring->next_to_clean) {
-        if (work_done < budget) {
-            napi_complete_done(napi, work_done);
-            sketh_enable_irq(rx_ring);
-        }
-    } else {
-        if (work_done < budget) {
-            napi_complete_done(napi, work_done);
-        }
+        if (skb_headlen(skb) < sizeof(*iph) || iph->ihl != 5 ||
+            iph->protocol != IPPROTO_TCP || ip_is_fragment(iph))
+            return false;
+
+        thoff = sizeof(*iph);
+        len = ntohs(iph->tot_len);
+        break;
     }
+    case htons(ETH_P_IPV6): {
+        struct ipv6hdr *ip6h = (struct ipv6hdr *)skb->data;
 
-    if (budget > 0) {
-        sketh_clean_tx_ring(&adapter->tx_ring[rx_ring->queue_index], budget);
+        if (skb_headlen(skb) < sizeof(*ip6h) || ip6h->nexthdr != IPPROTO_TCP)
+            return false;
+
+        thoff = sizeof(*ip6h);
+        len = thoff + ntohs(ip6h->payload_len);
+        break;
+    }
+    default:
+        return false;
     }
 
-    return work_done;
-}
+    if (skb_headlen(skb) < thoff + sizeof(*th))
+        return false;
 
-static void
-sketh_set_rx_buffer_len(struct sketh_adapter *adapter)
-{
-    struct sketh_ring *rx_ring;
-    int i;
+    th = (struct tcphdr *)(skb->data + thoff);
+    if (!(tcp_flag_word(th) & TCP_FLAG_ACK) ||
+        (tcp_flag_word(th) & (TCP_FLAG_CWR | TCP_FLAG_ECE | TCP_FLAG_URG |
+                              TCP_FLAG_RST | TCP_FLAG_SYN | TCP_FLAG_FIN)))
+        return false;
 
-    for (i = 0; i < adapter->num_queues; i++) {
-        rx_ring = &adapter->rx_ring[i];
-        if (rx_ring->xdp_enabled)
-            rx_ring->rx_buffer[0].skb = NULL;
-    }
+    *hlen = thoff + th->doff * 4;
+    if (th->doff < 5 || len != skb->len || skb->len <= *hlen ||
+        skb_headlen(skb) < *hlen)
+        return false;
+
+    skb_reset_network_header(skb);
+    skb_set_transport_header(skb, thoff);
+
+    return true;
 }
 
-static void
-sketh_configure_rx(struct sketh_adapter *adapter)
+/* Same flow, same headers apart from lengths, next in sequence */
+static bool
+sketh_hw_gro_match(struct sketh_hw_gro *gro, struct sk_buff *skb,
+                   unsigned int hlen)
 {
-    int i;
+    struct sk_buff *head = gro->skb;
+    struct tcphdr *th, *th2;
+    unsigned int i;
 
-    sketh_set_rx_buffer_len(adapter);
+    if (head->protocol != skb->protocol || hlen != gro->hlen)
+        return false;
 
-    for (i = 0; i < adapter->num_queues; i++) {
-        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
+    if (skb->protocol == htons(ETH_P_IP)) {
+        struct iphdr *iph = ip_hdr(head), *iph2 = ip_hdr(skb);
 
-        sketh_alloc_rx_buffers(rx_ring, rx_ring->count);
+        if (iph->saddr != iph2->saddr || iph->daddr != iph2->daddr ||
+            iph->tos != iph2->tos || iph->ttl != iph2->ttl ||
+            ((iph->frag_off ^ iph2->frag_off) & htons(IP_DF)))
+            return false;
+    } else {
+        struct ipv6hdr *ip6h = ipv6_hdr(head), *ip6h2 = ipv6_hdr(skb);
+
+        /* Version, traffic class and flow label share the first word */
+        if (*(__be32 *)ip6h != *(__be32 *)ip6h2 ||
+            ip6h->hop_limit != ip6h2->hop_limit ||
+            !ipv6_addr_equal(&ip6h->saddr, &ip6h2->saddr) ||
+            !ipv6_addr_equal(&ip6h->daddr, &ip6h2->daddr))
+            return false;
     }
-}
 
-static void
-sketh_configure_tx(struct sketh_adapter *adapter)
-{
-    int i;
+    th = tcp_hdr(head);
+    th2 = tcp_hdr(skb);
 
-    for (i = 0; i < adapter->num_queues; i++) {
-        struct sketh_ring *tx_ring = &adapter->tx_ring[i];
-        sketh_alloc_tx_buffers(tx_ring);
+    if (th->source != th2->source || th->dest != th2->dest ||
+        th->ack_seq != th2->ack_seq || th->window != th2->window)
+        return false;
+
+    /* Options, timestamps included, must be byte for byte identical */
+    for (i = sizeof(*th); i < th->doff * 4; i += 4) {
+        if (*(u32 *)((u8 *)th + i) != *(u32 *)((u8 *)th2 + i))
+            return false;
     }
+
+    return ntohl(th2->seq) == gro->next_seq;
 }
 
 static void
-sketh_configure(struct sketh_adapter *adapter)
+sketh_hw_gro_merge(struct sketh_hw_gro *gro, struct sk_buff *skb,
+                   unsigned int payload)
 {
-    struct net_device *netdev = adapter->netdev;
+    struct sk_buff *head = gro->skb;
 
-    sketh_configure_tx(adapter);
-    sketh_configure_rx(adapter);
+    tcp_flag_word(tcp_hdr(head)) |= tcp_flag_word(tcp_hdr(skb)) &
+                                    TCP_FLAG_PSH;
+
+    /* Only the payload is chained, the head keeps the one set of headers */
+    __skb_pull(skb, gro->hlen);
+
+    if (gro->last)
+        gro->last->next = skb;
+    else
+        skb_shinfo(head)->frag_list = skb;
+    gro->last = skb;
 
-    netdev->features = NETIF_F_SG | NETIF_F_HW_CSUM |
-                       NETIF_F_NTUPLE | NETIF_F_RXCSUM |
-                       NETIF_F_HW_VLAN_CTAG_RX | NETIF_F_HW_VLAN_CTAG_TX |
-                       NETIF_F_TSO | NETIF_F_TSO6;
+    head->len += skb->len;
+    head->data_len += skb->len;
+    head->truesize += skb->truesize;
 
-    netdev->hw_features = netdev->features;
-    netdev->vlan_features = netdev->features & ~NETIF_F_HW_VLAN_CTAG_RX;
+    gro->next_seq += payload;
+    gro->segs++;
 }
 
-netdev_tx_t
-sketh_start_xmit(struct sk_buff *skb, struct net_device *netdev)
+/* Turn the pending aggregate into a GSO packet and hand it to GRO */
+static void
+sketh_hw_gro_flush(struct sketh_ring *rx_ring)
 {
-    struct sketh_adapter *adapter = netdev_priv(netdev);
-    struct sketh_ring *tx_ring;
-    struct sketh_tx_buffer *tx_buffer;
-    unsigned int tx_flags = 0;
-    unsigned int len;
-    dma_addr_t dma;
-    int ret;
+    struct sketh_hw_gro *gro = &rx_ring->hw_gro;
+    struct sk_buff *head = gro->skb;
 
-    if (skb->len == 0) {
-        dev_kfree_skb_any(skb);
-        return NETDEV_TX_OK;
-    }
+    if (!head)
+        return;
 
-    tx_ring = &adapter->tx_ring[skb->queue_mapping];
+    gro->skb = NULL;
+    gro->last = NULL;
 
-    if (unlikely(test_bit(__SKETH_STATE_DOWN, &adapter->state))) {
-        dev_kfree_skb_any(skb);
-        netdev->stats.tx_dropped++;
-        return NETDEV_TX_OK;
-    }
+    if (gro->segs > 1) {
+        unsigned int tcplen = head->len - skb_transport_offset(head);
+        struct tcphdr *th = tcp_hdr(head);
 
-    if (skb_is_gso(skb)) {
-        tx_flags |= SKETH_TX_FLAGS_TSO;
-    } else if (skb->ip_summed == CHECKSUM_PARTIAL) {
-        tx_flags |= SKETH_TX_FLAGS_CSUM;
-    }
+        if (head->protocol == htons(ETH_P_IP)) {
+            struct iphdr *iph = ip_hdr(head);
 
-    len = skb_headlen(skb);
-    dma = dma_map_single(adapter->pci_dev->dev.parent,
-                         skb->data, len, DMA_TO_DEVICE);
+            iph->tot_len = htons(head->len);
+            ip_send_check(iph);
+            th->check = ~tcp_v4_check(tcplen, iph->saddr, iph->daddr, 0);
+            skb_shinfo(head)->gso_type = SKB_GSO_TCPV4;
+        } else {
+            struct ipv6hdr *ip6h = ipv6_hdr(head);
 
-    if (dma_mapping_error(adapter->pci_dev->dev.parent, dma)) {
-        adapter->tx_dropped++;
-        dev_kfree_skb_any(skb);
-        return NETDEV_TX_OK;
-    }
+            ip6h->payload_len = htons(head->len - sizeof(*ip6h));
+            th->check = ~tcp_v6_check(tcplen, &ip6h->saddr, &ip6h->daddr, 0);
+            skb_shinfo(head)->gso_type = SKB_GSO_TCPV6;
+        }
 
-    tx_buffer = &tx_ring->tx_buffer[tx_ring->next_to_use];
-    tx_buffer->skb = skb;
-    tx_buffer->dma = dma;
-    tx_buffer->bytes = len;
-    tx_buffer->mapped = 1;
+        skb_shinfo(head)->gso_size = gro->mss;
+        skb_shinfo(head)->gso_segs = gro->segs;
 
-    tx_ring->next_to_use = next_to_use(tx_ring->next_to_use, tx_ring->count);
+        /* Segments were verified, the merged packet can be resegmented */
+        head->ip_summed = CHECKSUM_PARTIAL;
+        head->csum_start = skb_transport_header(head) - head->head;
+        head->csum_offset = offsetof(struct tcphdr, check);
 
-    ret = sketh_xmit_desc(tx_ring, dma, len, tx_flags);
-    if (ret) {
-        adapter->tx_dropped++;
-        sketh_unmap_and_free_tx_buffer(tx_ring, tx_buffer);
-        return NETDEV_TX_OK;
+        u64_stats_update_begin(&rx_ring->syncp);
+        rx_ring->rx_stats.hw_gro_packets++;
+        rx_ring->rx_stats.hw_gro_segs += gro->segs;
+        u64_stats_update_end(&rx_ring->syncp);
     }
 
-    netif_trans_update(netdev);
-
-    if (tx_ring->next_to_use == tx_ring->next_to_clean)
-        adapter->tx_restart++;
-
-    return NETDEV_TX_OK;
+    napi_gro_receive(&rx_ring->napi, head);
 }
 
 static void
-sketh_set_rx_mode(struct net_device *netdev)
+sketh_hw_gro_receive(struct sketh_ring *rx_ring, struct sk_buff *skb)
 {
-    if (netdev->flags & IFF_PROMISC) {
+    struct sketh_hw_gro *gro = &rx_ring->hw_gro;
+    unsigned int hlen, payload;
+    struct tcphdr *th;
+    bool push;
+
+    if (!sketh_hw_gro_parse(skb, &hlen)) {
+        /* Keep the receive order around frames that cannot be merged */
+        sketh_hw_gro_flush(rx_ring);
+        napi_gro_receive(&rx_ring->napi, skb);
+        return;
     }
 
-    if (netdev->flags & IFF_ALLMULTI) {
-    }
+    th = tcp_hdr(skb);
+    push = th->psh;
+    payload = skb->len - hlen;
 
-    if (netdev_mc_count(netdev) > 0) {
-    }
+    if (gro->skb && (payload > gro->mss ||
+                     gro->skb->len + payload > SKETH_HW_GRO_MAX_SIZE ||
+                     !sketh_hw_gro_match(gro, skb, hlen)))
+        sketh_hw_gro_flush(rx_ring);
 
-    if (netdev_uc_count(netdev) > 0) {
+    if (gro->skb) {
+        sketh_hw_gro_merge(gro, skb, payload);
+    } else {
+        gro->skb = skb;
+        gro->last = NULL;
+        gro->next_seq = ntohl(th->seq) + payload;
+        gro->hlen = hlen;
+        gro->mss = payload;
+        gro->segs = 1;
     }
+
+    /* A short or pushed segment ends the burst, as in software GRO */
+    if (push || payload < gro->mss)
+        sketh_hw_gro_flush(rx_ring);
 }
 
-static int
-sketh_set_mac_address(struct net_device *netdev, void *addr)
+void
+sketh_receive_skb(struct sketh_ring *rx_ring, struct sk_buff *skb)
 {
-    struct sockaddr *sa = addr;
+    struct sketh_adapter *adapter = rx_ring->adapter;
+    struct net_device *netdev = rx_ring->netdev;
 
-    if (!is_valid_ether_addr(sa->sa_data))
-        return -EADDRNOTAVAIL;
+    /* RPS/RFS pick the queue's map and flow table, aRFS needs it to steer */
+    skb_record_rx_queue(skb, rx_ring->queue_index);
 
-    memcpy(netdev->dev_addr, sa->sa_data, ETH_ALEN);
+    skb->protocol = eth_type_trans(skb, netdev);
+    skb->ip_summed = CHECKSUM_UNNECESSARY;
 
-    return 0;
+    /* Offloaded conntrack flows never enter the stack or its hooks */
+    if (atomic_read(&adapter->ft_count) && !sketh_ft_rx(adapter, skb)) {
+        sketh_rx_stats_inc(rx_ring, ft_forward);
+        return;
+    }
+
+    if (netdev->features & NETIF_F_GRO_HW)
+        sketh_hw_gro_receive(rx_ring, skb);
+    else
+        napi_gro_receive(&rx_ring->napi, skb);
 }
 
-static int
-sketh_change_mtu(struct net_device *netdev, int new_mtu)
+static const enum pkt_hash_types sketh_rss_hash_type[] = {
+    [SKETH_RXD_RSSTYPE_IPV4_TCP] = PKT_HASH_TYPE_L4,
+    [SKETH_RXD_RSSTYPE_IPV4]     = PKT_HASH_TYPE_L3,
+    [SKETH_RXD_RSSTYPE_IPV6_TCP] = PKT_HASH_TYPE_L4,
+    [SKETH_RXD_RSSTYPE_IPV6]     = PKT_HASH_TYPE_L3,
+    [SKETH_RXD_RSSTYPE_IPV4_UDP] = PKT_HASH_TYPE_L4,
+    [SKETH_RXD_RSSTYPE_IPV6_UDP] = PKT_HASH_TYPE_L4,
+};
+
+static void
+sketh_rx_hash(struct sketh_ring *rx_ring, union sketh_rx_desc *rx_desc,
+              struct sk_buff *skb)
 {
-    struct sketh_adapter *adapter = netdev_priv(netdev);
-    int max_frame = new_mtu + ETH_HLEN + ETH_FCS_LEN;
+    u16 rss_type;
 
-    if ((new_mtu < SKETH_MIN_MTU) || (max_frame > SKETH_MAX_MTU))
-        return -EINVAL;
+    if (!(rx_ring->netdev->features & NETIF_F_RXHASH))
+        return;
 
-    netdev->mtu = new_mtu;
+    rss_type = le16_to_cpu(rx_desc->wb.pkt_info) & SKETH_RXD_RSSTYPE_MASK;
+    if (rss_type >= ARRAY_SIZE(sketh_rss_hash_type) ||
+        !sketh_rss_hash_type[rss_type])
+        return;
 
-    return 0;
+    skb_set_hash(skb, le32_to_cpu(rx_desc->wb.rss),
+                 sketh_rss_hash_type[rss_type]);
 }
 
-void
-sketh_tx_timeout(struct net_device *netdev, unsigned int txqueue)
+static u32
+sketh_run_xdp(struct sketh_ring *rx_ring, struct bpf_prog *xdp_prog,
+              struct xdp_buff *xdp)
 {
-    struct sketh_adapter *adapter = netdev_priv(netdev);
-
-    adapter->tx_timeout_count++;
+    u32 act;
+
+    act = bpf_prog_run_xdp(xdp_prog, xdp);
+
+    switch (act) {
+    case XDP_PASS:
+        sketh_rx_stats_inc(rx_ring, xdp_pass);
+        break;
+    case XDP_TX:
+        /* No XDP ring yet while a program is being attached */
+        if (unlikely(!rx_ring->xdp_ring ||
+                     sketh_xdp_tx(rx_ring->xdp_ring, xdp)))
+            goto out_failure;
+        sketh_rx_stats_inc(rx_ring, xdp_tx);
+        break;
+    case XDP_REDIRECT:
+        if (unlikely(xdp_do_redirect(rx_ring->netdev, xdp, xdp_prog)))
+            goto out_failure;
+        sketh_rx_stats_inc(rx_ring, xdp_redirect);
+        break;
+    default:
+        sketh_warn_invalid_xdp_action(rx_ring->netdev, xdp_prog, act);
+        fallthrough;
+    case XDP_ABORTED:
+out_failure:
+        trace_xdp_exception(rx_ring->netdev, xdp_prog, act);
+        fallthrough;
+    case XDP_DROP:
+        sketh_rx_stats_inc(rx_ring, xdp_drops);
+        xdp_return_buff(xdp);
+        break;
+    }
 
-    schedule_work(&adapter->reset_task);
+    return act;
 }
 
 int
-sketh_open(struct net_device *netdev)
+sketh_clean_rx_ring(struct sketh_ring *rx_ring, int budget)
 {
-    struct sketh_adapter *adapter = netdev_priv(netdev);
-    int err;
-    int i;
+    struct sketh_adapter *adapter = rx_ring->adapter;
+    struct xdp_buff *xdp = &rx_ring->xdp;
+    struct sk_buff *skb = rx_ring->skb;
+    struct bpf_prog *xdp_prog;
+    unsigned int total_packets = 0;
+    unsigned int total_bytes = 0;
+    bool xdp_tx = false;
+    int cleaned = 0;
+    u32 act;
 
-    if (test_bit(__SKETH_STATE_DOWN, &adapter->state))
-        return -EBUSY;
+    xdp_prog = READ_ONCE(adapter->xdp_info.prog);
 
-    err = sketh_request_irqs(adapter);
-    if (err) {
-        sketh_err(adapter, "Unable to allocate interrupts\n");
-        return err;
-    }
+    while (likely(total_packets < budget)) {
+        union sketh_rx_desc *rx_desc;
+        struct sketh_rx_buffer *rx_buffer;
+        unsigned int size;
+        u16 status;
 
-    sketh_configure(adapter);
+        rx_desc = SKETH_RX_DESC(rx_ring, rx_ring->next_to_clean);
+        status = le16_to_cpu(rx_desc->read.status);
 
-    for (i = 0; i < adapter->num_queues; i++) {
-        napi_enable(&adapter->rx_ring[i].napi);
-    }
+        /* Hardware has not finished with this slot yet */
+        if (!(status & SKETH_RXD_STAT_DD))
+            break;
 
-    clear_bit(__SKETH_STATE_DOWN, &adapter->state);
+        /* Read length/errors only after DD has been observed */
+        dma_rmb();
 
-    netif_tx_start_all_queues(netdev);
+        size = min_t(unsigned int, le16_to_cpu(rx_desc->read.length),
+                     rx_ring->rx_buf_len);
+        rx_buffer = &rx_ring->rx_buffer[rx_ring->next_to_clean];
 
-    return 0;
-}
+        dma_sync_single_range_for_cpu(rx_ring->dev, rx_buffer->dma,
+                                      rx_ring->rx_headroom, size,
+                                      page_pool_get_dma_dir(rx_ring->page_pool));
+
+        if (skb) {
+            sketh_add_rx_frag(rx_ring, rx_buffer, skb, size);
+        } else if (xdp->data) {
+            if (sketh_add_xdp_frag(rx_ring, xdp, rx_buffer, size)) {
+                page_pool_put_full_page(rx_ring->page_pool,
+                                        rx_buffer->page, true);
+                rx_ring->rx_discard = true;
+            }
+        } else if (rx_ring->hdr_split) {
+            skb = sketh_build_split_skb(rx_ring, rx_desc, rx_buffer,
+                                        status, size);
+
+            /* Leave the buffer in place and retry on the next poll */
+            if (unlikely(!skb)) {
+                sketh_rx_stats_inc(rx_ring, alloc_failed);
+                break;
+            }
+        } else {
+            void *va = page_address(rx_buffer->page) + rx_buffer->page_offset;
 
-int
-sketh_stop(struct net_device *netdev)
-{
-    struct sketh_adapter *adapter = netdev_priv(netdev);
-    int i;
+            net_prefetch(va + rx_ring->rx_headroom);
 
-    set_bit(__SKETH_STATE_DOWN, &adapter->state);
-    netif_tx_stop_all_queues(netdev);
+            xdp_init_buff(xdp, rx_ring->rx_truesize, &rx_ring->xdp_rxq);
+            xdp_prepare_buff(xdp, va, rx_ring->rx_headroom, size, true);
 
-    for (i = 0; i < adapter->num_queues; i++) {
-        napi_disable(&adapter->rx_ring[i].napi);
+            /* Without a program there is nothing to run before the skb */
+            if (!xdp_prog) {
+                skb = sketh_build_skb(rx_ring, xdp);
+                xdp->data = NULL;
+
+                /* Leave the buffer in place and retry on the next poll */
+                if (unlikely(!skb)) {
+                    sketh_rx_stats_inc(rx_ring, alloc_failed);
+                    break;
+                }
+            }
+        }
+
+        rx_buffer->page = NULL;
+        rx_buffer->dma = 0;
+
+        rx_ring->next_to_clean = next_to_use(rx_ring->next_to_clean,
+                                              rx_ring->count);
+        cleaned++;
+
+        /* An error on any descriptor of the chain spoils the whole frame */
+        if (unlikely(rx_desc->read.errors))
+            rx_ring->rx_discard = true;
+
+        if (!(status & SKETH_RXD_STAT_EOP))
+            continue;
+
+        if (unlikely(rx_ring->rx_discard)) {
+            if (skb)
+                dev_kfree_skb_any(skb);
+            else
+                xdp_return_buff(xdp);
+
+            skb = NULL;
+            xdp->data = NULL;
+            rx_ring->rx_discard = false;
+            sketh_rx_stats_inc(rx_ring, drops);
+            continue;
+        }
+
+        if (!skb) {
+            size = sketh_xdp_len(xdp);
+
+            act = sketh_run_xdp(rx_ring, xdp_prog, xdp);
+            if (act != XDP_PASS) {
+                xdp_tx |= act == XDP_TX;
+                rx_ring->xdp_redirect |= act == XDP_REDIRECT;
+                xdp->data = NULL;
+                total_packets++;
+                total_bytes += size;
+                continue;
+            }
+
+            skb = sketh_build_skb(rx_ring, xdp);
+            if (unlikely(!skb)) {
+                xdp_return_buff(xdp);
+                xdp->data = NULL;
+                /* The frame itself is lost here, not just a refill */
+                sketh_rx_stats_inc(rx_ring, alloc_failed);
+                sketh_rx_stats_inc(rx_ring, drops);
+                continue;
+            }
+
+            xdp->data = NULL;
+        }
+
+        total_packets++;
+        total_bytes += skb->len;
+
+        sketh_rx_hash(rx_ring, rx_desc, skb);
+        sketh_receive_skb(rx_ring, skb);
+        skb = NULL;
     }
 
-    sketh_free_irqs(adapter);
+    /* A frame spanning descriptors not yet written back is kept for later */
+    rx_ring->skb = skb;
 
-    for (i = 0; i < adapter->num_queues; i++) {
-        struct sketh_ring *tx_ring = &adapter->tx_ring[i];
-        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
+    /* One doorbell for every XDP_TX frame queued during this poll */
+    if (xdp_tx && rx_ring->xdp_ring) {
+        spin_lock(&rx_ring->xdp_ring->tx_lock);
+        sketh_tx_doorbell(rx_ring->xdp_ring);
+        spin_unlock(&rx_ring->xdp_ring->tx_lock);
+    }
 
-        if (tx_ring->desc)
-            sketh_free_tx_resources(tx_ring);
+    if (cleaned) {
+        sketh_alloc_rx_buffers(rx_ring, cleaned);
 
-        if (rx_ring->desc)
-            sketh_free_rx_resources(rx_ring);
+        u64_stats_update_begin(&rx_ring->syncp);
+        rx_ring->rx_stats.packets += total_packets;
+        rx_ring->rx_stats.bytes += total_bytes;
+        u64_stats_update_end(&rx_ring->syncp);
     }
 
-    return 0;
+    return total_packets;
 }
 
-static int
-sketh_setup_rx_resources(struct sketh_ring *rx_ring)
+int
+sketh_napi_poll(struct napi_struct *napi, int budget)
 {
+    struct sketh_ring *rx_ring = container_of(napi, struct sketh_ring, napi);
     struct sketh_adapter *adapter = rx_ring->adapter;
-    int size;
+    struct sketh_ring *tx_ring = &adapter->tx_ring[rx_ring->queue_index];
+    bool busy_poll = test_bit(NAPI_STATE_IN_BUSY_POLL, &napi->state);
+    bool clean_complete;
+    int work_done;
 
-    size = sizeof(struct sketh_rx_buffer) * rx_ring->count;
-    rx_ring->rx_buffer = vzalloc(size);
+    sketh_rx_stats_inc(rx_ring, polls);
 
-    if (!rx_ring->rx_buffer)
-        return -ENOMEM;
+    clean_complete = sketh_clean_tx_ring(tx_ring, budget);
 
-    rx_ring->desc = dma_alloc_coherent(adapter->pci_dev->dev.parent,
-                                       rx_ring->size,
-                                       &rx_ring->desc_dma,
-                                       GFP_KERNEL);
+    if (rx_ring->xdp_ring) {
+        struct sketh_ring *xdp_ring = rx_ring->xdp_ring;
 
-    if (!rx_ring->desc) {
-        vfree(rx_ring->rx_buffer);
-        rx_ring->rx_buffer = NULL;
-        return -ENOMEM;
-    }
+        if (!sketh_clean_xdp_ring(xdp_ring, budget))
+            clean_complete = false;
 
-    rx_ring->next_to_clean = 0;
-    rx_ring->next_to_use = 0;
+        /* AF_XDP transmit is driven from here, on interrupt and on wakeup */
+        if (xdp_ring->xsk_pool && budget > 0 &&
+            !sketh_xmit_zc(xdp_ring, budget))
+            clean_complete = false;
+    }
 
-    return 0;
-}
+    /* netpoll only reaps TX */
+    if (budget <= 0)
+        return budget;
+
+    if (rx_ring->xsk_pool)
+        work_done = sketh_clean_rx_ring_zc(rx_ring, budget);
+    else
+        work_done = sketh_clean_rx_ring(rx_ring, budget);
+    if (work_done >= budget)
+        clean_complete = false;
+
+    /* Driven by a socket spinning in busy poll, not by the interrupt */
+    if (busy_poll) {
+        u64_stats_update_begin(&rx_ring->syncp);
+        rx_ring->rx_stats.busy_polls++;
+        rx_ring->rx_stats.busy_poll_packets += work_done;
+        u64_stats_update_end(&rx_ring->syncp);
+    }
 
-static int
-sketh_setup_tx_resources(struct sketh_ring *tx_ring)
-{
-    struct sketh_adapter *adapter = tx_ring->adapter;
-    int size;
+    /* Aggregates never outlive the poll that built them */
+    sketh_hw_gro_flush(rx_ring);
 
-    size = sizeof(struct sketh_tx_buffer) * tx_ring->count;
-    tx_ring->tx_buffer = vzalloc(size);
+    /* Push out frames redirected to other devices, maps and sockets */
+    if (rx_ring->xdp_redirect) {
+        rx_ring->xdp_redirect = false;
+        xdp_do_flush();
+    }
 
-    if (!tx_ring->tx_buffer)
-        return -ENOMEM;
+    if (!clean_complete)
+        return budget;
 
-    tx_ring->desc = dma_alloc_coherent(adapter->pci_dev->dev.parent,
-                                       tx_ring->size,
-                                       &tx_ring->desc_dma,
-                                       GFP_KERNEL);
+    /*
+     * False while busy polling or while napi_defer_hard_irqs and
+     * gro_flush_timeout keep the queue in polling mode, the cause then
+     * stays masked and the next poll comes from the socket or the timer.
+     */
+    if (likely(napi_complete_done(napi, work_done))) {
+        sketh_update_dim(rx_ring, tx_ring);
 
-    if (!tx_ring->desc) {
-        vfree(tx_ring->tx_buffer);
-        tx_ring->tx_buffer = NULL;
-        return -ENOMEM;
+        /* sketh_stop() masks every cause and must not be undone */
+        if (!test_bit(__SKETH_STATE_DOWN, &adapter->state))
+            sketh_enable_irq(rx_ring);
     }
 
-    tx_ring->next_to_clean = 0;
-    tx_ring->next_to_use = 0;
-
-    return 0;
+    return min(work_done, budget - 1);
 }
 
 static void
-sketh_free_rx_resources(struct sketh_ring *rx_ring)
+sketh_set_rx_buffer_len(struct sketh_adapter *adapter)
 {
-    if (rx_ring->rx_buffer) {
-        vfree(rx_ring->rx_buffer);
-        rx_ring->rx_buffer = NULL;
-    }
+    struct sketh_ring *rx_ring;
+    int i;
 
-    if (rx_ring->desc && rx_ring->desc_dma) {
-        dma_free_coherent(rx_ring->adapter->pci_dev->dev.parent,
-                          rx_ring->size,
-                          rx_ring->desc,
-                          rx_ring->desc_dma);
-        rx_ring->desc = NULL;
-        rx_ring->desc_dma = 0;
+    for (i = 0; i < adapter->num_queues; i++) {
+        rx_ring = &adapter->rx_ring[i];
+
+        rx_ring->xdp_enabled = !!adapter->xdp_info.prog;
+
+        /* XDP needs the whole frame in one buffer, its queues never split */
+        rx_ring->hdr_split = !rx_ring->xdp_enabled &&
+                             (adapter->priv_flags & SKETH_PRIV_FLAG_HDR_SPLIT);
+
+        if (rx_ring->xdp_enabled) {
+            rx_ring->rx_headroom = XDP_PACKET_HEADROOM;
+            rx_ring->rx_truesize = SKETH_RX_XDP_TRUESIZE;
+        } else if (rx_ring->hdr_split) {
+            /* Whole, page aligned payload pages can be mapped to user space */
+            rx_ring->rx_headroom = 0;
+            rx_ring->rx_truesize = PAGE_SIZE;
+        } else {
+            rx_ring->rx_headroom = SKETH_RX_HEADROOM;
+            rx_ring->rx_truesize = SKETH_RX_TRUESIZE;
+        }
+
+        /* Split payload pages never become an skb head */
+        if (rx_ring->hdr_split)
+            rx_ring->rx_buf_len = rx_ring->rx_truesize;
+        else
+            rx_ring->rx_buf_len = rx_ring->rx_truesize - rx_ring->rx_headroom -
+                                  SKB_DATA_ALIGN(sizeof(struct skb_shared_info));
+
+        /* Zero-copy queues receive straight into the socket's umem chunks */
+        rx_ring->xsk_pool = NULL;
+        if (rx_ring->xdp_enabled && test_bit(i, adapter->af_xdp_zc_qps))
+            rx_ring->xsk_pool = xsk_get_pool_from_qid(adapter->netdev, i);
+
+        if (rx_ring->xsk_pool) {
+            rx_ring->rx_headroom = 0;
+            rx_ring->rx_buf_len = xsk_pool_get_rx_frame_size(rx_ring->xsk_pool);
+        }
     }
 }
 
 static void
-sketh_free_tx_resources(struct sketh_ring *tx_ring)
+sketh_configure_rx_ring(struct sketh_adapter *adapter,
+                        struct sketh_ring *rx_ring)
 {
-    if (tx_ring->tx_buffer) {
-        vfree(tx_ring->tx_buffer);
-        tx_ring->tx_buffer = NULL;
-    }
+    u64 rdba = rx_ring->desc_dma;
+    u16 reg_idx = rx_ring->reg_idx;
+    u32 srrctl;
+
+    srrctl = min_t(u32, rx_ring->rx_buf_len, SKETH_SRRCTL_BSIZEPKT_MAX) <<
+             SKETH_SRRCTL_BSIZEPKT_SHIFT;
+    if (rx_ring->hdr_split)
+        srrctl |= SKETH_SRRCTL_HDR_SPLIT | SKETH_RX_HDR_SIZE;
+
+    sketh_wr32(adapter, SKETH_REG_RDBAL(reg_idx), rdba & DMA_BIT_MASK(32));
+    sketh_wr32(adapter, SKETH_REG_RDBAH(reg_idx), rdba >> 32);
+    sketh_wr32(adapter, SKETH_REG_RDLEN(reg_idx), rx_ring->size);
+    sketh_wr32(adapter, SKETH_REG_SRRCTL(reg_idx), srrctl);
+    sketh_wr32(adapter, SKETH_REG_RDH(reg_idx), 0);
+    sketh_wr32(adapter, SKETH_REG_RDT(reg_idx), 0);
+    sketh_wr32(adapter, SKETH_REG_RXDCTL(reg_idx), SKETH_RXDCTL_ENABLE);
+
+    rx_ring->tail = adapter->hw_addr + SKETH_REG_RDT(reg_idx);
+
+    /* Tail == head reads as empty, so one slot always stays unposted */
+    if (rx_ring->xsk_pool)
+        sketh_alloc_rx_buffers_zc(rx_ring, sketh_desc_unused(rx_ring));
+    else
+        sketh_alloc_rx_buffers(rx_ring, sketh_desc_unused(rx_ring));
+}
 
-    if (tx_ring->desc && tx_ring->desc_dma) {
-        dma_free_coherent(tx_ring->adapter->pci_dev->dev.parent,
-                          tx_ring->size,
-                          tx_ring->desc,
-                          tx_ring->desc_dma);
-        tx_ring->desc = NULL;
-        tx_ring->desc_dma = 0;
-    }
+static void
+sketh_configure_rx(struct sketh_adapter *adapter)
+{
+    int i;
+
+    for (i = 0; i < adapter->num_queues; i++)
+        sketh_configure_rx_ring(adapter, &adapter->rx_ring[i]);
 }
 
-static int
-sketh_alloc_queues(struct sketh_adapter *adapter)
+static void
+sketh_configure_tx_ring(struct sketh_adapter *adapter,
+                        struct sketh_ring *tx_ring)
+{
+    u64 tdba = tx_ring->desc_dma;
+    u16 reg_idx = tx_ring->reg_idx;
+    u32 txdctl = SKETH_TXDCTL_ENABLE;
+    int tc;
+
+    sketh_alloc_tx_buffers(tx_ring);
+
+    /* XDP rings and queues outside every class stay in class 0 */
+    tc = netdev_txq_to_tc(adapter->netdev, tx_ring->queue_index);
+    if (!tx_ring->is_xdp && tc > 0)
+        txdctl |= tc << SKETH_TXDCTL_TC_SHIFT;
+
+    sketh_wr32(adapter, SKETH_REG_TDBAL(reg_idx), tdba & DMA_BIT_MASK(32));
+    sketh_wr32(adapter, SKETH_REG_TDBAH(reg_idx), tdba >> 32);
+    sketh_wr32(adapter, SKETH_REG_TDLEN(reg_idx), tx_ring->size);
+    sketh_wr32(adapter, SKETH_REG_TDH(reg_idx), 0);
+    sketh_wr32(adapter, SKETH_REG_TDT(reg_idx), 0);
+    sketh_wr32(adapter, SKETH_REG_TXDCTL(reg_idx), txdctl);
+
+    tx_ring->tail = adapter->hw_addr + SKETH_REG_TDT(reg_idx);
+}
+
+static void
+sketh_configure_tx(struct sketh_adapter *adapter)
 {
     int i;
 
-    adapter->rx_ring = vzalloc(sizeof(struct sketh_ring) * adapter->num_queues);
-    adapter->tx_ring = vzalloc(sizeof(struct sketh_ring) * adapter->num_queues);
+    for (i = 0; i < adapter->num_queues; i++) {
+        sketh_configure_tx_ring(adapter, &adapter->tx_ring[i]);
+
+        if (adapter->xdp_ring[i].desc)
+            sketh_configure_tx_ring(adapter, &adapter->xdp_ring[i]);
+    }
+}
 
-    if (!adapter->rx_ring || !adapter->tx_ring)
-        return -ENOMEM;
+/* Adaptive moderation on both directions until ethtool -C says otherwise */
+static void
+sketh_init_coalesce(struct sketh_adapter *adapter)
+{
+    adapter->rx_itr_usecs = SKETH_ITR_USECS_DEFAULT;
+    adapter->rx_itr_frames = SKETH_ITR_FRAMES_DEFAULT;
+    adapter->tx_itr_usecs = SKETH_ITR_USECS_DEFAULT;
+    adapter->tx_itr_frames = SKETH_ITR_FRAMES_DEFAULT;
+    adapter->rx_dim_enabled = true;
+    adapter->tx_dim_enabled = true;
+}
+
+static void
+sketh_configure_itr(struct sketh_adapter *adapter)
+{
+    int i;
 
+    /* Adaptive rings start from the static setting until DIM moves them */
     for (i = 0; i < adapter->num_queues; i++) {
         struct sketh_ring *rx_ring = &adapter->rx_ring[i];
         struct sketh_ring *tx_ring = &adapter->tx_ring[i];
 
-        rx_ring->adapter = adapter;
-        tx_ring->adapter = adapter;
+        rx_ring->itr_usecs = adapter->rx_itr_usecs;
+        rx_ring->itr_frames = adapter->rx_itr_frames;
+        tx_ring->itr_usecs = adapter->tx_itr_usecs;
+        tx_ring->itr_frames = adapter->tx_itr_frames;
 
-        rx_ring->queue_index = i;
-        tx_ring->queue_index = i;
+        sketh_write_itr(rx_ring);
+        sketh_write_itr(tx_ring);
+    }
+}
+
+static void
+sketh_configure_rss(struct sketh_adapter *adapter)
+{
+    const u8 *key = adapter->rss_key;
+    u32 mrqc = adapter->rss_mrqc;
+    u32 reta = 0;
+    int i;
 
-        rx_ring->count = SKETH_RX_MAX_DESC;
-        tx_ring->count = SKETH_TX_MAX_DESC;
+    for (i = 0; i < SKETH_RSS_KEY_SIZE / 4; i++, key += 4)
+        sketh_wr32(adapter, SKETH_REG_RSSRK(i),
+                   key[0] | (key[1] << 8) | (key[2] << 16) |
+                   ((u32)key[3] << 24));
 
-        rx_ring->size = rx_ring->count * sizeof(union sketh_rx_desc);
-        tx_ring->size = tx_ring->count * sizeof(union sketh_tx_desc);
+    /* Four 8-bit queue indices per register */
+    for (i = 0; i < SKETH_RSS_INDIR_SIZE; i++) {
+        reta |= (u32)adapter->rss_indir[i] << ((i & 3) * 8);
 
-        rx_ring->netdev = adapter->netdev;
-        tx_ring->netdev = adapter->netdev;
+        if ((i & 3) == 3) {
+            sketh_wr32(adapter, SKETH_REG_RETA(i >> 2), reta);
+            reta = 0;
+        }
     }
 
-    return 0;
+    if (adapter->num_queues > 1)
+        mrqc |= SKETH_MRQC_RSS_EN;
+
+    sketh_wr32(adapter, SKETH_REG_MRQC, mrqc);
+}
+
+static void
+sketh_init_rss_indir(struct sketh_adapter *adapter)
+{
+    int i;
+
+    for (i = 0; i < SKETH_RSS_INDIR_SIZE; i++)
+        adapter->rss_indir[i] = ethtool_rxfh_indir_default(i,
+                                                           adapter->num_queues);
+}
+
+static void
+sketh_init_rss(struct sketh_adapter *adapter)
+{
+    netdev_rss_key_fill(adapter->rss_key, SKETH_RSS_KEY_SIZE);
+
+    sketh_init_rss_indir(adapter);
+
+    /* UDP ports are left out by default, fragments would hash elsewhere */
+    adapter->rss_mrqc = SKETH_MRQC_IPV4 | SKETH_MRQC_IPV4_TCP |
+                        SKETH_MRQC_IPV6 | SKETH_MRQC_IPV6_TCP;
+}
+
+/* Every priority in class 0 with the whole link, PFC off */
+static void
+sketh_init_dcb(struct sketh_adapter *adapter)
+{
+    int i;
+
+    for (i = 0; i < SKETH_MAX_TC; i++)
+        adapter->tc_tsa[i] = IEEE_8021QAZ_TSA_ETS;
+
+    adapter->tc_bw[0] = 100;
+
+    spin_lock_init(&adapter->pfc_stats_lock);
+}
+
+/* Routes causes to vectors, everything stays masked until sketh_open() */
+static void
+sketh_configure_irqs(struct sketh_adapter *adapter)
+{
+    int i;
+
+    sketh_wr32(adapter, SKETH_REG_EIMC, SKETH_EIMC_ALL);
+    sketh_rd32(adapter, SKETH_REG_EICR);
+
+    if (!adapter->msix_enabled) {
+        sketh_wr32(adapter, SKETH_REG_GPIE, 0);
+        return;
+    }
+
+    sketh_wr32(adapter, SKETH_REG_GPIE, SKETH_GPIE_MSIX_MODE);
+
+    for (i = 0; i < adapter->max_queues; i++)
+        sketh_wr32(adapter, SKETH_REG_IVAR(i),
+                   i < adapter->num_queues ? i | SKETH_IVAR_VALID : 0);
+
+    sketh_wr32(adapter, SKETH_REG_IVAR_MISC,
+               adapter->max_queues | SKETH_IVAR_VALID);
+}
+
+/* Priority classes, ETS shares and PFC, from the DCB and mqprio settings */
+static void
+sketh_configure_dcb(struct sketh_adapter *adapter)
+{
+    u32 up2tc = 0, tsa = 0;
+    int i;
+
+    for (i = 0; i < SKETH_MAX_TC; i++) {
+        up2tc |= (u32)adapter->prio_tc[i] << SKETH_UP2TC_SHIFT(i);
+
+        if (adapter->tc_tsa[i] == IEEE_8021QAZ_TSA_ETS)
+            tsa |= BIT(i);
+
+        sketh_wr32(adapter, SKETH_REG_ETS_BW(i), adapter->tc_bw[i]);
+    }
+
+    sketh_wr32(adapter, SKETH_REG_UP2TC, up2tc);
+    sketh_wr32(adapter, SKETH_REG_ETS_TSA, tsa);
+    sketh_wr32(adapter, SKETH_REG_PFC_CTRL, adapter->pfc_en);
+}
+
+/*
+ * Stop the TX queues of every class with a priority the link partner
+ * paused and wake those released since, so one congested class does not
+ * hold back the others. Called from the mailbox vector on SKETH_EICR_PFC.
+ */
+static void
+sketh_update_pfc_xoff(struct sketh_adapter *adapter)
+{
+    struct net_device *netdev = adapter->netdev;
+    unsigned long xoff;
+    u8 xoff_tc = 0;
+    int i, tc;
+
+    xoff = sketh_rd32(adapter, SKETH_REG_PFC_STATUS) & adapter->pfc_en;
+
+    for_each_set_bit(i, &xoff, SKETH_MAX_TC)
+        xoff_tc |= BIT(netdev_get_prio_tc_map(netdev, i));
+
+    WRITE_ONCE(adapter->pfc_xoff_tc, xoff_tc);
+
+    if (test_bit(__SKETH_STATE_DOWN, &adapter->state))
+        return;
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        struct netdev_queue *txq = netdev_get_tx_queue(netdev, i);
+
+        tc = netdev_txq_to_tc(netdev, i);
+
+        if (tc >= 0 && (xoff_tc & BIT(tc))) {
+            netif_tx_stop_queue(txq);
+            /* A paused queue is not a hung one */
+            txq_trans_cond_update(txq);
+        } else if (netif_tx_queue_stopped(txq) &&
+                   sketh_desc_unused(&adapter->tx_ring[i]) >=
+                   SKETH_TX_WAKE_THRESHOLD) {
+            netif_tx_wake_queue(txq);
+        }
+    }
+}
+
+/* Fold the clear-on-read pause counters in before they wrap */
+static void
+sketh_update_pfc_stats(struct sketh_adapter *adapter)
+{
+    struct sketh_pfc_stats *stats = &adapter->pfc_stats;
+    int p;
+
+    spin_lock_bh(&adapter->pfc_stats_lock);
+
+    for (p = 0; p < SKETH_MAX_TC; p++) {
+        stats->rx_xoff[p] += sketh_rd32(adapter, SKETH_REG_PXOFFRXC(p));
+        stats->rx_xon[p] += sketh_rd32(adapter, SKETH_REG_PXONRXC(p));
+        stats->tx_xoff[p] += sketh_rd32(adapter, SKETH_REG_PXOFFTXC(p));
+        stats->tx_xon[p] += sketh_rd32(adapter, SKETH_REG_PXONTXC(p));
+    }
+
+    spin_unlock_bh(&adapter->pfc_stats_lock);
+}
+
+static void
+sketh_irq_enable(struct sketh_adapter *adapter)
+{
+    u32 mask = SKETH_EICR_MBX | SKETH_EICR_PFC;
+    int i;
+
+    for (i = 0; i < adapter->num_queues; i++)
+        mask |= SKETH_EICR_QUEUE(i);
+
+    sketh_wr32(adapter, SKETH_REG_EIMS, mask);
+}
+
+static void
+sketh_irq_disable(struct sketh_adapter *adapter)
+{
+    int i;
+
+    sketh_wr32(adapter, SKETH_REG_EIMC, SKETH_EIMC_ALL);
+    sketh_rd32(adapter, SKETH_REG_EICR);
+
+    /* Sim vectors are no IRQs, detaching the callback waits for them */
+    if (sketh_is_sim(adapter))
+        return;
+
+    for (i = 0; i < adapter->num_queues; i++)
+        synchronize_irq(adapter->msix_entries[i].vector);
+
+    if (adapter->msix_enabled)
+        synchronize_irq(adapter->mbx_vector);
+}
+
+/* The device stops fetching and writing descriptors, rings can be freed */
+static void
+sketh_disable_rings(struct sketh_adapter *adapter)
+{
+    int i;
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        sketh_wr32(adapter, SKETH_REG_RXDCTL(adapter->rx_ring[i].reg_idx), 0);
+        sketh_wr32(adapter, SKETH_REG_TXDCTL(adapter->tx_ring[i].reg_idx), 0);
+
+        if (adapter->xdp_ring[i].desc)
+            sketh_wr32(adapter,
+                       SKETH_REG_TXDCTL(adapter->xdp_ring[i].reg_idx), 0);
+    }
+}
+
+static void
+sketh_configure(struct sketh_adapter *adapter)
+{
+    sketh_configure_irqs(adapter);
+    sketh_configure_tx(adapter);
+    sketh_configure_rx(adapter);
+    sketh_configure_itr(adapter);
+    sketh_configure_rss(adapter);
+    sketh_configure_fltrs(adapter);
+    sketh_configure_dcb(adapter);
+}
+
+static union sketh_tx_desc *
+sketh_tx_ctxtdesc(struct sketh_ring *tx_ring, u16 type)
+{
+    union sketh_tx_desc *ctx;
+
+    ctx = SKETH_TX_DESC(tx_ring, tx_ring->next_to_use);
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->ctx.cmd = SKETH_TX_DESC_CMD_CTX;
+    ctx->ctx.type = cpu_to_le16(type);
+
+    tx_ring->next_to_use = next_to_use(tx_ring->next_to_use, tx_ring->count);
+
+    return ctx;
+}
+
+static int
+sketh_tso(struct sketh_ring *tx_ring, struct sketh_tx_buffer *first,
+          unsigned int *tx_flags)
+{
+    struct sk_buff *skb = first->skb;
+    union sketh_tx_desc *ctx;
+    union {
+        struct iphdr *v4;
+        struct ipv6hdr *v6;
+        unsigned char *hdr;
+    } ip;
+    union {
+        struct tcphdr *tcp;
+        struct udphdr *udp;
+        unsigned char *hdr;
+    } l4;
+    unsigned int l4_offset, l4_len, paylen;
+    u16 outer_l3 = 0, outer_l4 = 0;
+    u16 type = SKETH_TX_CTX_TSO;
+    int err;
+
+    if (skb->ip_summed != CHECKSUM_PARTIAL)
+        return 0;
+
+    if (!skb_is_gso(skb))
+        return 0;
+
+    err = skb_cow_head(skb, 0);
+    if (err < 0)
+        return err;
+
+    /* VXLAN/GENEVE: segment on the inner headers, fix up the outer ones */
+    if (skb->encapsulation) {
+        type |= SKETH_TX_CTX_TUNNEL;
+        outer_l3 = skb_network_offset(skb);
+        outer_l4 = skb_transport_offset(skb);
+
+        /* The device writes the outer lengths of every segment as well */
+        ip.hdr = skb_network_header(skb);
+        if (ip.v4->version == 4) {
+            ip.v4->tot_len = 0;
+            ip.v4->check = 0;
+        } else {
+            ip.v6->payload_len = 0;
+            type |= SKETH_TX_CTX_OUTER_IPV6;
+        }
+
+        l4.udp = udp_hdr(skb);
+        paylen = skb->len - outer_l4;
+        l4.udp->len = 0;
+
+        /* Same pseudo header as the inner one, the device adds the length */
+        if (skb_shinfo(skb)->gso_type & SKB_GSO_UDP_TUNNEL_CSUM) {
+            type |= SKETH_TX_CTX_OUTER_CSUM;
+            csum_replace_by_diff(&l4.udp->check,
+                                 (__force __wsum)htonl(paylen));
+        }
+
+        ip.hdr = skb_inner_network_header(skb);
+        l4.hdr = skb_inner_transport_header(skb);
+    } else {
+        ip.hdr = skb_network_header(skb);
+        l4.hdr = skb_transport_header(skb);
+    }
+
+    /* The device writes per-segment IP lengths and header checksums */
+    if (ip.v4->version == 4) {
+        ip.v4->tot_len = 0;
+        ip.v4->check = 0;
+    } else {
+        ip.v6->payload_len = 0;
+        type |= SKETH_TX_CTX_IPV6;
+    }
+
+    l4_offset = l4.hdr - skb->data;
+    paylen = skb->len - l4_offset;
+
+    /* Leave a pseudo header checksum without the length in the L4 header */
+    if (skb_shinfo(skb)->gso_type & SKB_GSO_UDP_L4) {
+        type |= SKETH_TX_CTX_UDP;
+        l4_len = sizeof(struct udphdr);
+        csum_replace_by_diff(&l4.udp->check, (__force __wsum)htonl(paylen));
+    } else {
+        l4_len = l4.tcp->doff * 4;
+        csum_replace_by_diff(&l4.tcp->check, (__force __wsum)htonl(paylen));
+    }
+
+    first->gso_segs = skb_shinfo(skb)->gso_segs;
+    first->bytes += (first->gso_segs - 1) * (l4_offset + l4_len);
+
+    ctx = sketh_tx_ctxtdesc(tx_ring, type);
+    ctx->ctx.mss = cpu_to_le16(skb_shinfo(skb)->gso_size);
+    ctx->ctx.hdr_len = cpu_to_le16(l4_offset + l4_len);
+    ctx->ctx.l3_offset = cpu_to_le16(ip.hdr - skb->data);
+    ctx->ctx.l4_offset = cpu_to_le16(l4_offset);
+    ctx->ctx.l4_len = l4_len;
+    ctx->ctx.outer_l3_offset = cpu_to_le16(outer_l3);
+    ctx->ctx.outer_l4_offset = cpu_to_le16(outer_l4);
+
+    *tx_flags |= SKETH_TX_FLAGS_TSO;
+
+    return 1;
+}
+
+static void
+sketh_tx_csum(struct sketh_ring *tx_ring, struct sketh_tx_buffer *first,
+              unsigned int *tx_flags)
+{
+    struct sk_buff *skb = first->skb;
+    union sketh_tx_desc *ctx;
+
+    if (skb->ip_summed != CHECKSUM_PARTIAL)
+        return;
+
+    /* NETIF_F_HW_CSUM: checksum from csum_start, stored at csum_offset */
+    ctx = sketh_tx_ctxtdesc(tx_ring, SKETH_TX_CTX_CSUM);
+    ctx->ctx.l4_offset = cpu_to_le16(skb_checksum_start_offset(skb));
+
+    *tx_flags |= SKETH_TX_FLAGS_CSUM |
+                 (skb->csum_offset << SKETH_TX_FLAGS_CSO_SHIFT);
+}
+
+static int
+sketh_tx_map(struct sketh_ring *tx_ring, struct sketh_tx_buffer *first,
+             unsigned int tx_flags)
+{
+    struct sk_buff *skb = first->skb;
+    struct sketh_tx_buffer *tx_buffer;
+    union sketh_tx_desc *eop_desc;
+    unsigned int data_len = skb->data_len;
+    unsigned int size = skb_headlen(skb);
+    unsigned int mapped = SKETH_TX_MAPPED_SINGLE;
+    u16 first_index = first - tx_ring->tx_buffer;
+    u16 i;
+    skb_frag_t *frag;
+    dma_addr_t dma;
+
+    dma = dma_map_single(tx_ring->dev, skb->data, size, DMA_TO_DEVICE);
+
+    /* A context descriptor may already sit in the first slot */
+    tx_buffer = &tx_ring->tx_buffer[tx_ring->next_to_use];
+
+    for (frag = &skb_shinfo(skb)->frags[0];; frag++) {
+        if (dma_mapping_error(tx_ring->dev, dma))
+            goto dma_error;
+
+        tx_buffer->dma = dma;
+        tx_buffer->len = size;
+        tx_buffer->mapped = mapped;
+
+        while (unlikely(size > SKETH_MAX_DATA_PER_TXD)) {
+            sketh_xmit_desc(tx_ring, dma, SKETH_MAX_DATA_PER_TXD, tx_flags, 0);
+
+            dma += SKETH_MAX_DATA_PER_TXD;
+            size -= SKETH_MAX_DATA_PER_TXD;
+        }
+
+        if (likely(!data_len))
+            break;
+
+        sketh_xmit_desc(tx_ring, dma, size, tx_flags, 0);
+
+        size = skb_frag_size(frag);
+        data_len -= size;
+
+        dma = skb_frag_dma_map(tx_ring->dev, frag, 0, size, DMA_TO_DEVICE);
+        mapped = SKETH_TX_MAPPED_PAGE;
+
+        tx_buffer = &tx_ring->tx_buffer[tx_ring->next_to_use];
+    }
+
+    /* Only the last descriptor of the chain ends the frame */
+    eop_desc = SKETH_TX_DESC(tx_ring, tx_ring->next_to_use);
+    sketh_xmit_desc(tx_ring, dma, size, tx_flags,
+                    SKETH_TX_DESC_CMD_EOP | SKETH_TX_DESC_CMD_RS);
+
+    /* Completion may look at the chain as soon as next_to_watch is set */
+    smp_wmb();
+    first->next_to_watch = eop_desc;
+
+    return 0;
+
+dma_error:
+    /* Unwind everything mapped so far, the caller frees the skb */
+    for (i = tx_ring->next_to_use;; i = next_to_clean(i, tx_ring->count)) {
+        sketh_unmap_tx_buffer(tx_ring, &tx_ring->tx_buffer[i]);
+
+        if (i == first_index)
+            break;
+    }
+
+    tx_ring->next_to_use = first_index;
+
+    return -ENOMEM;
+}
+
+netdev_tx_t
+sketh_start_xmit(struct sk_buff *skb, struct net_device *netdev)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    struct sketh_ring *tx_ring;
+    struct sketh_tx_buffer *first;
+    unsigned int tx_flags = 0;
+    unsigned int count;
+    unsigned short f;
+    int tso;
+
+    if (skb->len == 0) {
+        dev_kfree_skb_any(skb);
+        return NETDEV_TX_OK;
+    }
+
+    tx_ring = &adapter->tx_ring[skb->queue_mapping];
+
+    if (unlikely(test_bit(__SKETH_STATE_DOWN, &adapter->state))) {
+        dev_kfree_skb_any(skb);
+        sketh_xmit_stats_inc(tx_ring, dropped);
+        return NETDEV_TX_OK;
+    }
+
+    /* One descriptor per 16K of head and of every fragment */
+    count = TXD_USE_COUNT(skb_headlen(skb));
+    for (f = 0; f < skb_shinfo(skb)->nr_frags; f++)
+        count += TXD_USE_COUNT(skb_frag_size(&skb_shinfo(skb)->frags[f]));
+
+    /* Plus one for a context descriptor */
+    if (sketh_maybe_stop_tx(tx_ring, count + 1)) {
+        sketh_xmit_stats_inc(tx_ring, tx_busy);
+
+        /* Flush whatever earlier xmit_more calls left behind */
+        sketh_tx_doorbell(tx_ring);
+        return NETDEV_TX_BUSY;
+    }
+
+    first = &tx_ring->tx_buffer[tx_ring->next_to_use];
+    first->skb = skb;
+    first->bytes = skb->len;
+    first->gso_segs = 1;
+
+    tso = sketh_tso(tx_ring, first, &tx_flags);
+    if (tso < 0)
+        goto out_drop;
+    else if (!tso)
+        sketh_tx_csum(tx_ring, first, &tx_flags);
+
+    if (sketh_tx_map(tx_ring, first, tx_flags))
+        goto out_drop;
+
+    netdev_tx_sent_queue(txring_txq(tx_ring), first->bytes);
+
+    netif_trans_update(netdev);
+
+    /* Stop now rather than bounce the next skb with NETDEV_TX_BUSY */
+    sketh_maybe_stop_tx(tx_ring, DESC_NEEDED);
+
+    /* Ring the doorbell once per qdisc batch */
+    if (netif_xmit_stopped(txring_txq(tx_ring)) || !netdev_xmit_more())
+        sketh_tx_doorbell(tx_ring);
+    else
+        sketh_xmit_stats_inc(tx_ring, xmit_more);
+
+    return NETDEV_TX_OK;
+
+out_drop:
+    sketh_xmit_stats_inc(tx_ring, dropped);
+    first->skb = NULL;
+    first->bytes = 0;
+    first->gso_segs = 0;
+    dev_kfree_skb_any(skb);
+
+    if (!netdev_xmit_more())
+        sketh_tx_doorbell(tx_ring);
+
+    return NETDEV_TX_OK;
+}
+
+static void
+sketh_set_rx_mode(struct net_device *netdev)
+{
+    if (netdev->flags & IFF_PROMISC) {
+    }
+
+    if (netdev->flags & IFF_ALLMULTI) {
+    }
+
+    if (netdev_mc_count(netdev) > 0) {
+    }
+
+    if (netdev_uc_count(netdev) > 0) {
+    }
+}
+
+static int
+sketh_set_mac_address(struct net_device *netdev, void *addr)
+{
+    struct sockaddr *sa = addr;
+
+    if (!is_valid_ether_addr(sa->sa_data))
+        return -EADDRNOTAVAIL;
+
+    memcpy(netdev->dev_addr, sa->sa_data, ETH_ALEN);
+
+    return 0;
+}
+
+static bool
+sketh_xdp_mtu_ok(struct bpf_prog *prog, int new_mtu)
+{
+    unsigned int frame = new_mtu + ETH_HLEN + VLAN_HLEN;
+
+#ifdef HAVE_XDP_FRAGS
+    if (prog->aux->xdp_has_frags)
+        return true;
+#endif
+
+    return frame <= SKETH_RX_XDP_TRUESIZE - XDP_PACKET_HEADROOM -
+                    SKB_DATA_ALIGN(sizeof(struct skb_shared_info));
+}
+
+static int
+sketh_change_mtu(struct net_device *netdev, int new_mtu)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    int max_frame = new_mtu + ETH_HLEN + ETH_FCS_LEN;
+
+    if ((new_mtu < SKETH_MIN_MTU) || (max_frame > SKETH_MAX_MTU))
+        return -EINVAL;
+
+    if (adapter->xdp_info.prog &&
+        !sketh_xdp_mtu_ok(adapter->xdp_info.prog, new_mtu))
+        return -EINVAL;
+
+    netdev->mtu = new_mtu;
+
+    return 0;
+}
+
+void
+sketh_tx_timeout(struct net_device *netdev, unsigned int txqueue)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+
+    adapter->tx_timeout_count++;
+
+    set_bit(txqueue, adapter->tx_hung_qps);
+    schedule_work(&adapter->reset_task);
+}
+
+static void
+sketh_free_resources(struct sketh_adapter *adapter)
+{
+    int i;
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        struct sketh_ring *tx_ring = &adapter->tx_ring[i];
+        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
+        struct sketh_ring *xdp_ring = &adapter->xdp_ring[i];
+
+        if (tx_ring->desc)
+            sketh_free_tx_resources(tx_ring);
+
+        if (xdp_ring->desc)
+            sketh_free_tx_resources(xdp_ring);
+
+        if (rx_ring->desc)
+            sketh_free_rx_resources(rx_ring);
+
+        rx_ring->xdp_ring = NULL;
+        rx_ring->xsk_pool = NULL;
+        xdp_ring->xsk_pool = NULL;
+    }
+}
+
+/*
+ * Queue i goes to the i-th CPU nearest the device, local cores first, and
+ * its rings are allocated on that CPU's node.
+ */
+static void
+sketh_set_queue_affinity(struct sketh_adapter *adapter)
+{
+    int node = dev_to_node(adapter->dev);
+    int i;
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        unsigned int cpu = cpumask_local_spread(i, node);
+        int cpu_node = cpu_to_node(cpu);
+
+        cpumask_clear(&adapter->rx_ring[i].affinity_mask);
+        cpumask_set_cpu(cpu, &adapter->rx_ring[i].affinity_mask);
+
+        adapter->rx_ring[i].numa_node = cpu_node;
+        adapter->tx_ring[i].numa_node = cpu_node;
+        adapter->xdp_ring[i].numa_node = cpu_node;
+    }
+}
+
+/*
+ * TX queue i completes on the CPU that services vector i, so that CPU
+ * sends on it. Done once per queue, a map the user wrote stays.
+ */
+static void
+sketh_set_xps(struct sketh_adapter *adapter)
+{
+    int i;
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        struct sketh_ring *tx_ring = &adapter->tx_ring[i];
+
+        if (tx_ring->xps_set)
+            continue;
+
+        if (!netif_set_xps_queue(adapter->netdev,
+                                 &adapter->rx_ring[i].affinity_mask, i))
+            tx_ring->xps_set = true;
+    }
+}
+
+/*
+ * Exposes which NAPI serves which queue and IRQ, so busy polling sockets
+ * and netlink users find it, and keeps a threaded poller on its queue CPU.
+ */
+static void
+sketh_napi_link(struct sketh_adapter *adapter, struct sketh_ring *rx_ring,
+                bool link)
+{
+    struct napi_struct *napi = link ? &rx_ring->napi : NULL;
+    u16 i = rx_ring->queue_index;
+
+    /* The ID is only assigned by napi_enable() on recent kernels */
+    if (link)
+        rx_ring->xdp_rxq.napi_id = rx_ring->napi.napi_id;
+
+#ifdef HAVE_NETIF_QUEUE_SET_NAPI
+    netif_napi_set_irq(&rx_ring->napi,
+                       link && !sketh_is_sim(adapter) ?
+                       (int)adapter->msix_entries[i].vector : -1);
+    netif_queue_set_napi(adapter->netdev, i, NETDEV_QUEUE_TYPE_RX, napi);
+    netif_queue_set_napi(adapter->netdev, i, NETDEV_QUEUE_TYPE_TX, napi);
+#endif
+
+#ifdef HAVE_NAPI_THREADED
+    if (link && rx_ring->napi.thread)
+        set_cpus_allowed_ptr(rx_ring->napi.thread, &rx_ring->affinity_mask);
+#endif
+}
+
+static int
+sketh_setup_resources(struct sketh_adapter *adapter)
+{
+    int err;
+    int i;
+
+    sketh_set_rx_buffer_len(adapter);
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        err = sketh_setup_tx_resources(&adapter->tx_ring[i]);
+        if (err)
+            goto err_setup;
+
+        err = sketh_setup_rx_resources(&adapter->rx_ring[i]);
+        if (err)
+            goto err_setup;
+
+        /* A dedicated XDP_TX ring per RX queue, only while a program runs */
+        if (adapter->xdp_info.prog) {
+            adapter->xdp_ring[i].xsk_pool = adapter->rx_ring[i].xsk_pool;
+
+            err = sketh_setup_tx_resources(&adapter->xdp_ring[i]);
+            if (err)
+                goto err_setup;
+
+            adapter->rx_ring[i].xdp_ring = &adapter->xdp_ring[i];
+        }
+    }
+
+    return 0;
+
+err_setup:
+    sketh_err(adapter, "Unable to allocate resources for queue %d\n", i);
+    sketh_free_resources(adapter);
+    return err;
+}
+
+int
+sketh_open(struct net_device *netdev)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    int err;
+    int i;
+
+    sketh_set_queue_affinity(adapter);
+
+    err = sketh_setup_resources(adapter);
+    if (err)
+        return err;
+
+    err = sketh_request_irqs(adapter);
+    if (err) {
+        sketh_err(adapter, "Unable to allocate interrupts\n");
+        sketh_free_resources(adapter);
+        return err;
+    }
+
+    sketh_configure(adapter);
+    sketh_set_xps(adapter);
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
+
+        napi_enable(&rx_ring->napi);
+        sketh_napi_link(adapter, rx_ring, true);
+    }
+
+    clear_bit(__SKETH_STATE_DOWN, &adapter->state);
+
+    sketh_irq_enable(adapter);
+
+    netif_tx_start_all_queues(netdev);
+
+    /* The link partner may have paused a class while we were down */
+    sketh_update_pfc_xoff(adapter);
+
+    schedule_delayed_work(&adapter->service_task, HZ);
+
+    return 0;
+}
+
+int
+sketh_stop(struct net_device *netdev)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    int i;
+
+    set_bit(__SKETH_STATE_DOWN, &adapter->state);
+    netif_tx_stop_all_queues(netdev);
+
+    /* Wait for ndo_xdp_xmit callers that missed the DOWN bit */
+    synchronize_net();
+
+    sketh_disable_rings(adapter);
+
+    cancel_delayed_work_sync(&adapter->service_task);
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        sketh_napi_link(adapter, &adapter->rx_ring[i], false);
+        napi_disable(&adapter->rx_ring[i].napi);
+
+        /* No poll is left to queue DIM work behind these */
+        cancel_work_sync(&adapter->rx_ring[i].dim.work);
+        cancel_work_sync(&adapter->tx_ring[i].dim.work);
+    }
+
+    sketh_irq_disable(adapter);
+    sketh_free_irqs(adapter);
+    sketh_free_resources(adapter);
+
+    return 0;
+}
+
+/* Start the ring over on the memory it already has */
+static void
+sketh_reinit_tx_ring(struct sketh_ring *tx_ring)
+{
+    sketh_clean_tx_buffers(tx_ring);
+    memset(tx_ring->desc, 0, tx_ring->size);
+
+    tx_ring->next_to_clean = 0;
+    tx_ring->next_to_use = 0;
+}
+
+/*
+ * Quiesce one queue pair, drop everything it holds and bring it back up.
+ * Only this pair's cause is masked, the other vectors keep forwarding.
+ * Called under RTNL with the interface up.
+ */
+static void
+sketh_reset_queue_pair(struct sketh_adapter *adapter, int q)
+{
+    struct netdev_queue *txq = netdev_get_tx_queue(adapter->netdev, q);
+    struct sketh_ring *rx_ring = &adapter->rx_ring[q];
+    struct sketh_ring *tx_ring = &adapter->tx_ring[q];
+    struct sketh_ring *xdp_ring = &adapter->xdp_ring[q];
+
+    sketh_disable_irq(rx_ring);
+    sketh_napi_link(adapter, rx_ring, false);
+    napi_disable(&rx_ring->napi);
+
+    cancel_work_sync(&rx_ring->dim.work);
+    cancel_work_sync(&tx_ring->dim.work);
+
+    sketh_wr32(adapter, SKETH_REG_RXDCTL(rx_ring->reg_idx), 0);
+
+    /*
+     * The PFC handler may wake the queue at any time, holding the xmit
+     * lock is what keeps ndo_start_xmit() off the ring meanwhile.
+     */
+    __netif_tx_lock_bh(txq);
+    netif_tx_stop_queue(txq);
+    sketh_wr32(adapter, SKETH_REG_TXDCTL(tx_ring->reg_idx), 0);
+    sketh_reinit_tx_ring(tx_ring);
+    sketh_configure_tx_ring(adapter, tx_ring);
+    __netif_tx_unlock_bh(txq);
+
+    /* Other CPUs' ndo_xdp_xmit() still picks this ring, under tx_lock */
+    if (xdp_ring->desc) {
+        spin_lock_bh(&xdp_ring->tx_lock);
+        sketh_wr32(adapter, SKETH_REG_TXDCTL(xdp_ring->reg_idx), 0);
+        sketh_reinit_tx_ring(xdp_ring);
+        sketh_configure_tx_ring(adapter, xdp_ring);
+        spin_unlock_bh(&xdp_ring->tx_lock);
+    }
+
+    sketh_free_rx_buffers(rx_ring);
+    memset(rx_ring->desc, 0, rx_ring->size);
+    rx_ring->rx_starved = false;
+    sketh_configure_rx_ring(adapter, rx_ring);
+
+    napi_enable(&rx_ring->napi);
+    sketh_napi_link(adapter, rx_ring, true);
+    sketh_enable_irq(rx_ring);
+
+    /* A paused class is woken by XON, not by the reset */
+    if (!sketh_tx_pfc_paused(tx_ring)) {
+        txq_trans_cond_update(txq);
+        netif_tx_wake_queue(txq);
+    }
+}
+
+/* Reset queue pair q, or every pair for q < 0, and time it */
+static int
+sketh_recover_queues(struct sketh_adapter *adapter, int q)
+{
+    ktime_t start;
+    u64 usecs;
+    int i;
+
+    rtnl_lock();
+
+    /* A closed interface has nothing left to reset, sketh_open() starts over */
+    if (!netif_running(adapter->netdev) ||
+        test_bit(__SKETH_STATE_DOWN, &adapter->state) ||
+        q >= adapter->num_queues) {
+        rtnl_unlock();
+        return 0;
+    }
+
+    start = ktime_get();
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        if (q < 0 || q == i)
+            sketh_reset_queue_pair(adapter, i);
+    }
+
+    usecs = ktime_us_delta(ktime_get(), start);
+    adapter->last_recovery_us = usecs;
+    adapter->queue_resets++;
+
+    rtnl_unlock();
+
+    if (q < 0)
+        sketh_info(adapter, "All queues reset in %llu us\n", usecs);
+    else
+        sketh_info(adapter, "Queue %d reset in %llu us\n", q, usecs);
+
+    return 0;
+}
+
+static int
+sketh_create_page_pool(struct sketh_ring *rx_ring)
+{
+    struct page_pool_params pp_params = {
+        .flags     = PP_FLAG_DMA_MAP | PP_FLAG_PAGE_FRAG,
+        .order     = 0,
+        .pool_size = rx_ring->count,
+        .nid       = rx_ring->numa_node,
+        .dev       = rx_ring->dev,
+        .dma_dir   = DMA_FROM_DEVICE,
+    };
+    struct page_pool *pool;
+
+    /* XDP_TX sends straight out of the pool mapping */
+    if (rx_ring->xdp_enabled)
+        pp_params.dma_dir = DMA_BIDIRECTIONAL;
+
+    pool = page_pool_create(&pp_params);
+    if (IS_ERR(pool))
+        return PTR_ERR(pool);
+
+    rx_ring->page_pool = pool;
+
+    return 0;
+}
+
+/* The queue's node is preferred for ring memory, not required */
+static void *
+sketh_alloc_coherent(struct sketh_ring *ring, size_t size, dma_addr_t *dma)
+{
+    int orig_node = dev_to_node(ring->dev);
+    void *va;
+
+    set_dev_node(ring->dev, ring->numa_node);
+    va = dma_alloc_coherent(ring->dev, size, dma, GFP_KERNEL);
+    set_dev_node(ring->dev, orig_node);
+
+    if (!va)
+        va = dma_alloc_coherent(ring->dev, size, dma, GFP_KERNEL);
+
+    return va;
+}
+
+static void
+sketh_free_hdr_buf(struct sketh_ring *rx_ring)
+{
+    if (!rx_ring->hdr_buf)
+        return;
+
+    dma_free_coherent(rx_ring->dev, rx_ring->count * SKETH_RX_HDR_SIZE,
+                      rx_ring->hdr_buf, rx_ring->hdr_dma);
+    rx_ring->hdr_buf = NULL;
+    rx_ring->hdr_dma = 0;
+}
+
+static int
+sketh_setup_rx_resources(struct sketh_ring *rx_ring)
+{
+    int size;
+    int err;
+
+    size = sizeof(struct sketh_rx_buffer) * rx_ring->count;
+    rx_ring->rx_buffer = vzalloc_node(size, rx_ring->numa_node);
+    if (!rx_ring->rx_buffer)
+        rx_ring->rx_buffer = vzalloc(size);
+
+    if (!rx_ring->rx_buffer)
+        return -ENOMEM;
+
+    rx_ring->desc = sketh_alloc_coherent(rx_ring, rx_ring->size,
+                                         &rx_ring->desc_dma);
+
+    if (!rx_ring->desc) {
+        vfree(rx_ring->rx_buffer);
+        rx_ring->rx_buffer = NULL;
+        return -ENOMEM;
+    }
+
+    if (rx_ring->hdr_split) {
+        rx_ring->hdr_buf = sketh_alloc_coherent(rx_ring,
+                                                rx_ring->count * SKETH_RX_HDR_SIZE,
+                                                &rx_ring->hdr_dma);
+        if (!rx_ring->hdr_buf) {
+            err = -ENOMEM;
+            goto err_page_pool;
+        }
+    }
+
+    /* Zero-copy queues take their buffers from the XSK pool instead */
+    if (!rx_ring->xsk_pool) {
+        err = sketh_create_page_pool(rx_ring);
+        if (err)
+            goto err_page_pool;
+    }
+
+    err = xdp_rxq_info_reg(&rx_ring->xdp_rxq, rx_ring->netdev,
+                           rx_ring->queue_index, rx_ring->napi.napi_id);
+    if (err)
+        goto err_rxq_reg;
+
+    if (rx_ring->xsk_pool) {
+        err = xdp_rxq_info_reg_mem_model(&rx_ring->xdp_rxq,
+                                         MEM_TYPE_XSK_BUFF_POOL, NULL);
+        if (err)
+            goto err_mem_model;
+
+        xsk_pool_set_rxq_info(rx_ring->xsk_pool, &rx_ring->xdp_rxq);
+    } else {
+        err = xdp_rxq_info_reg_mem_model(&rx_ring->xdp_rxq, MEM_TYPE_PAGE_POOL,
+                                         rx_ring->page_pool);
+        if (err)
+            goto err_mem_model;
+    }
+
+    rx_ring->next_to_clean = 0;
+    rx_ring->next_to_use = 0;
+
+    return 0;
+
+err_mem_model:
+    xdp_rxq_info_unreg(&rx_ring->xdp_rxq);
+err_rxq_reg:
+    if (rx_ring->page_pool) {
+        page_pool_destroy(rx_ring->page_pool);
+        rx_ring->page_pool = NULL;
+    }
+err_page_pool:
+    sketh_free_hdr_buf(rx_ring);
+    dma_free_coherent(rx_ring->dev, rx_ring->size,
+                      rx_ring->desc, rx_ring->desc_dma);
+    rx_ring->desc = NULL;
+    rx_ring->desc_dma = 0;
+    vfree(rx_ring->rx_buffer);
+    rx_ring->rx_buffer = NULL;
+    return err;
+}
+
+static int
+sketh_setup_tx_resources(struct sketh_ring *tx_ring)
+{
+    int size;
+
+    size = sizeof(struct sketh_tx_buffer) * tx_ring->count;
+    tx_ring->tx_buffer = vzalloc_node(size, tx_ring->numa_node);
+    if (!tx_ring->tx_buffer)
+        tx_ring->tx_buffer = vzalloc(size);
+
+    if (!tx_ring->tx_buffer)
+        return -ENOMEM;
+
+    tx_ring->desc = sketh_alloc_coherent(tx_ring, tx_ring->size,
+                                         &tx_ring->desc_dma);
+
+    if (!tx_ring->desc) {
+        vfree(tx_ring->tx_buffer);
+        tx_ring->tx_buffer = NULL;
+        return -ENOMEM;
+    }
+
+    tx_ring->next_to_clean = 0;
+    tx_ring->next_to_use = 0;
+
+    return 0;
+}
+
+static void
+sketh_free_rx_resources(struct sketh_ring *rx_ring)
+{
+    sketh_free_rx_buffers(rx_ring);
+
+    if (xdp_rxq_info_is_reg(&rx_ring->xdp_rxq))
+        xdp_rxq_info_unreg(&rx_ring->xdp_rxq);
+
+    if (rx_ring->page_pool) {
+        page_pool_destroy(rx_ring->page_pool);
+        rx_ring->page_pool = NULL;
+    }
+
+    if (rx_ring->rx_buffer) {
+        vfree(rx_ring->rx_buffer);
+        rx_ring->rx_buffer = NULL;
+    }
+
+    sketh_free_hdr_buf(rx_ring);
+
+    if (rx_ring->desc && rx_ring->desc_dma) {
+        dma_free_coherent(rx_ring->dev,
+                          rx_ring->size,
+                          rx_ring->desc,
+                          rx_ring->desc_dma);
+        rx_ring->desc = NULL;
+        rx_ring->desc_dma = 0;
+    }
+}
+
+static void
+sketh_clean_tx_buffers(struct sketh_ring *tx_ring)
+{
+    unsigned int xsk_frames = 0;
+    unsigned int i;
+
+    for (i = 0; i < tx_ring->count; i++) {
+        struct sketh_tx_buffer *tx_buffer = &tx_ring->tx_buffer[i];
+
+        if (tx_ring->xsk_pool && tx_buffer->next_to_watch &&
+            !tx_buffer->xdpf)
+            xsk_frames++;
+
+        sketh_unmap_and_free_tx_buffer(tx_ring, tx_buffer);
+    }
+
+    /* Hand descriptors still in flight back to the socket */
+    if (xsk_frames)
+        xsk_tx_completed(tx_ring->xsk_pool, xsk_frames);
+
+    if (!tx_ring->is_xdp)
+        netdev_tx_reset_queue(txring_txq(tx_ring));
+}
+
+static void
+sketh_free_tx_resources(struct sketh_ring *tx_ring)
+{
+    if (tx_ring->tx_buffer) {
+        sketh_clean_tx_buffers(tx_ring);
+
+        vfree(tx_ring->tx_buffer);
+        tx_ring->tx_buffer = NULL;
+    }
+
+    if (tx_ring->desc && tx_ring->desc_dma) {
+        dma_free_coherent(tx_ring->dev,
+                          tx_ring->size,
+                          tx_ring->desc,
+                          tx_ring->desc_dma);
+        tx_ring->desc = NULL;
+        tx_ring->desc_dma = 0;
+    }
+}
+
+/* Takes effect on the next sketh_setup_resources() */
+static void
+sketh_set_ring_counts(struct sketh_adapter *adapter)
+{
+    int i;
+
+    for (i = 0; i < adapter->max_queues; i++) {
+        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
+        struct sketh_ring *tx_ring = &adapter->tx_ring[i];
+        struct sketh_ring *xdp_ring = &adapter->xdp_ring[i];
+
+        rx_ring->count = adapter->rx_ring_count;
+        tx_ring->count = adapter->tx_ring_count;
+        xdp_ring->count = adapter->tx_ring_count;
+
+        rx_ring->size = rx_ring->count * sizeof(union sketh_rx_desc);
+        tx_ring->size = tx_ring->count * sizeof(union sketh_tx_desc);
+        xdp_ring->size = xdp_ring->count * sizeof(union sketh_tx_desc);
+    }
+}
+
+/*
+ * Every possible queue gets its rings and NAPI up front, so ethtool -L
+ * only changes how many of them sketh_open() brings up.
+ */
+static int
+sketh_alloc_queues(struct sketh_adapter *adapter)
+{
+    int i;
+
+    adapter->rx_ring = vzalloc(sizeof(struct sketh_ring) * adapter->max_queues);
+    adapter->tx_ring = vzalloc(sizeof(struct sketh_ring) * adapter->max_queues);
+    adapter->xdp_ring = vzalloc(sizeof(struct sketh_ring) * adapter->max_queues);
+
+    adapter->af_xdp_zc_qps = bitmap_zalloc(adapter->max_queues, GFP_KERNEL);
+
+    if (!adapter->rx_ring || !adapter->tx_ring || !adapter->xdp_ring ||
+        !adapter->af_xdp_zc_qps)
+        return -ENOMEM;
+
+    for (i = 0; i < adapter->max_queues; i++) {
+        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
+        struct sketh_ring *tx_ring = &adapter->tx_ring[i];
+        struct sketh_ring *xdp_ring = &adapter->xdp_ring[i];
+
+        rx_ring->adapter = adapter;
+        tx_ring->adapter = adapter;
+
+        rx_ring->queue_index = i;
+        tx_ring->queue_index = i;
+
+        rx_ring->netdev = adapter->netdev;
+        tx_ring->netdev = adapter->netdev;
+
+        rx_ring->dev = adapter->dev;
+        tx_ring->dev = adapter->dev;
+
+        rx_ring->reg_idx = i;
+        tx_ring->reg_idx = i;
+
+        tx_ring->is_tx = true;
+
+        rx_ring->numa_node = NUMA_NO_NODE;
+        tx_ring->numa_node = NUMA_NO_NODE;
+        xdp_ring->numa_node = NUMA_NO_NODE;
+
+        u64_stats_init(&rx_ring->syncp);
+        u64_stats_init(&tx_ring->syncp);
+        u64_stats_init(&tx_ring->xmit_syncp);
+        u64_stats_init(&xdp_ring->syncp);
+        u64_stats_init(&xdp_ring->xmit_syncp);
+
+        INIT_WORK(&rx_ring->dim.work, sketh_rx_dim_work);
+        INIT_WORK(&tx_ring->dim.work, sketh_tx_dim_work);
+        rx_ring->dim.mode = DIM_CQ_PERIOD_MODE_START_FROM_EQE;
+        tx_ring->dim.mode = DIM_CQ_PERIOD_MODE_START_FROM_EQE;
+        rx_ring->irq_stamp = jiffies;
+
+        /* XDP TX rings use the hardware queues after the stack's ones */
+        xdp_ring->adapter = adapter;
+        xdp_ring->queue_index = i;
+        xdp_ring->reg_idx = adapter->max_queues + i;
+        xdp_ring->netdev = adapter->netdev;
+        xdp_ring->dev = adapter->dev;
+        xdp_ring->is_xdp = true;
+        xdp_ring->is_tx = true;
+        spin_lock_init(&xdp_ring->tx_lock);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+        netif_napi_add_weight(adapter->netdev, &rx_ring->napi,
+                              sketh_napi_poll, SKETH_NAPI_WEIGHT);
+#else
+        netif_napi_add(adapter->netdev, &rx_ring->napi,
+                       sketh_napi_poll, SKETH_NAPI_WEIGHT);
+#endif
+    }
+
+    sketh_set_ring_counts(adapter);
+
+    return 0;
 }
 
 static void
 sketh_free_queues(struct sketh_adapter *adapter)
 {
-    if (adapter->rx_ring) {
-        vfree(adapter->rx_ring);
-        adapter->rx_ring = NULL;
+    int i;
+
+    if (adapter->rx_ring) {
+        for (i = 0; i < adapter->max_queues; i++)
+            netif_napi_del(&adapter->rx_ring[i].napi);
+
+        vfree(adapter->rx_ring);
+        adapter->rx_ring = NULL;
+    }
+
+    if (adapter->tx_ring) {
+        vfree(adapter->tx_ring);
+        adapter->tx_ring = NULL;
+    }
+
+    if (adapter->xdp_ring) {
+        vfree(adapter->xdp_ring);
+        adapter->xdp_ring = NULL;
+    }
+
+    bitmap_free(adapter->af_xdp_zc_qps);
+    adapter->af_xdp_zc_qps = NULL;
+}
+
+int
+sketh_xdp_setup_prog(struct sketh_adapter *adapter, struct bpf_prog *prog,
+                     struct netlink_ext_ack *extack)
+{
+    struct net_device *netdev = adapter->netdev;
+    struct bpf_prog *old_prog;
+    bool need_reset, running;
+    int err = 0;
+
+    if (prog && !sketh_xdp_mtu_ok(prog, netdev->mtu)) {
+        NL_SET_ERR_MSG_MOD(extack, "MTU too large for a single XDP buffer");
+        return -EINVAL;
+    }
+
+    /* Attaching or detaching changes RX headroom and buffer size */
+    need_reset = !adapter->xdp_info.prog != !prog;
+    running = need_reset && netif_running(netdev);
+
+    /* NAPI must not run the new program on buffers laid out for the old */
+    if (running)
+        sketh_stop(netdev);
+
+    old_prog = xchg(&adapter->xdp_info.prog, prog);
+
+    if (running) {
+        err = sketh_open(netdev);
+        if (err) {
+            /* The caller still owns prog, run on the old setup again */
+            NL_SET_ERR_MSG_MOD(extack, "Unable to reopen with the program");
+            xchg(&adapter->xdp_info.prog, old_prog);
+
+            if (sketh_open(netdev))
+                sketh_err(adapter, "Unable to reopen the interface\n");
+
+            return err;
+        }
+    }
+
+#ifdef HAVE_XDP_FEATURES
+    /* ndo_xdp_xmit needs the XDP rings that come with a program */
+    if (need_reset) {
+        if (prog)
+            xdp_features_set_redirect_target(netdev, true);
+        else
+            xdp_features_clear_redirect_target(netdev);
+    }
+#endif
+
+    if (old_prog)
+        bpf_prog_put(old_prog);
+
+    return err;
+}
+
+int
+sketh_bpf(struct net_device *netdev, struct netdev_bpf *bpf)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+
+    switch (bpf->command) {
+    case XDP_SETUP_PROG:
+        return sketh_xdp_setup_prog(adapter, bpf->prog, bpf->extack);
+    case XDP_SETUP_XSK_POOL:
+        return sketh_xsk_pool_setup(adapter, bpf->xsk.pool,
+                                    bpf->xsk.queue_id);
+    default:
+        return -EINVAL;
+    }
+}
+
+static int
+sketh_xmit_xdp_ring(struct sketh_ring *xdp_ring, struct xdp_frame *xdpf,
+                    bool dma_map)
+{
+    struct skb_shared_info *sinfo = NULL;
+    struct sketh_tx_buffer *first, *tx_buffer;
+    union sketh_tx_desc *eop_desc;
+    u16 first_index = xdp_ring->next_to_use;
+    u32 nr_frags = 0;
+    u32 size = xdpf->len;
+    void *data = xdpf->data;
+    dma_addr_t dma;
+    u32 i;
+
+#ifdef HAVE_XDP_FRAGS
+    if (unlikely(xdp_frame_has_frags(xdpf))) {
+        sinfo = xdp_get_shared_info_from_frame(xdpf);
+        nr_frags = sinfo->nr_frags;
+    }
+#endif
+
+    if (unlikely(sketh_desc_unused(xdp_ring) < nr_frags + 1))
+        return -EBUSY;
+
+    first = &xdp_ring->tx_buffer[first_index];
+    first->bytes = xdpf->len;
+    tx_buffer = first;
+
+    for (i = 0;; i++) {
+        if (dma_map) {
+            dma = dma_map_single(xdp_ring->dev, data, size, DMA_TO_DEVICE);
+            if (dma_mapping_error(xdp_ring->dev, dma))
+                goto unmap;
+
+            tx_buffer->dma = dma;
+            tx_buffer->len = size;
+            tx_buffer->mapped = SKETH_TX_MAPPED_SINGLE;
+        } else {
+            /* Our own page_pool page, already mapped bidirectionally */
+            struct page *page = virt_to_page(data);
+
+            dma = page_pool_get_dma_addr(page) + (data - page_address(page));
+            dma_sync_single_for_device(xdp_ring->dev, dma, size,
+                                       DMA_BIDIRECTIONAL);
+        }
+
+        if (i == nr_frags)
+            break;
+
+        sketh_xmit_desc(xdp_ring, dma, size, 0, 0);
+
+        data = skb_frag_address(&sinfo->frags[i]);
+        size = skb_frag_size(&sinfo->frags[i]);
+        first->bytes += size;
+
+        tx_buffer = &xdp_ring->tx_buffer[xdp_ring->next_to_use];
+    }
+
+    eop_desc = SKETH_TX_DESC(xdp_ring, xdp_ring->next_to_use);
+    sketh_xmit_desc(xdp_ring, dma, size, 0,
+                    SKETH_TX_DESC_CMD_EOP | SKETH_TX_DESC_CMD_RS);
+
+    first->xdpf = xdpf;
+    first->gso_segs = 1;
+
+    /* The buffer must be complete before completion can see it */
+    smp_wmb();
+    first->next_to_watch = eop_desc;
+
+    return 0;
+
+unmap:
+    for (i = xdp_ring->next_to_use;; i = next_to_clean(i, xdp_ring->count)) {
+        sketh_unmap_tx_buffer(xdp_ring, &xdp_ring->tx_buffer[i]);
+
+        if (i == first_index)
+            break;
+    }
+
+    first->bytes = 0;
+    xdp_ring->next_to_use = first_index;
+
+    return -ENOMEM;
+}
+
+int
+sketh_xdp_tx(struct sketh_ring *xdp_ring, struct xdp_buff *xdp)
+{
+    struct xdp_frame *xdpf;
+    int err;
+
+    xdpf = xdp_convert_buff_to_frame(xdp);
+    if (unlikely(!xdpf))
+        return -EOVERFLOW;
+
+    /* The doorbell is rung once at the end of the RX poll */
+    spin_lock(&xdp_ring->tx_lock);
+    err = sketh_xmit_xdp_ring(xdp_ring, xdpf, false);
+    spin_unlock(&xdp_ring->tx_lock);
+
+    return err;
+}
+
+int
+sketh_xdp_xmit(struct net_device *netdev, int n, struct xdp_frame **frames,
+               u32 flags)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    struct sketh_ring *xdp_ring;
+    int nxmit = 0;
+    int i;
+
+    if (unlikely(test_bit(__SKETH_STATE_DOWN, &adapter->state)))
+        return -ENETDOWN;
+
+    if (unlikely(flags & ~XDP_XMIT_FLAGS_MASK))
+        return -EINVAL;
+
+    /* XDP rings only exist while a program is attached */
+    xdp_ring = &adapter->xdp_ring[smp_processor_id() % adapter->num_queues];
+    if (unlikely(!xdp_ring->desc))
+        return -ENXIO;
+
+    spin_lock(&xdp_ring->tx_lock);
+
+    for (i = 0; i < n; i++) {
+        if (sketh_xmit_xdp_ring(xdp_ring, frames[i], true))
+            break;
+        nxmit++;
+    }
+
+    if (flags & XDP_XMIT_FLUSH)
+        sketh_tx_doorbell(xdp_ring);
+
+    spin_unlock(&xdp_ring->tx_lock);
+
+    /* The core returns the frames that were not sent */
+    return nxmit;
+}
+
+static struct sk_buff *
+sketh_construct_skb_zc(struct sketh_ring *rx_ring, struct xdp_buff *xdp)
+{
+    unsigned int size = xdp->data_end - xdp->data;
+    struct sk_buff *skb;
+
+    /* The umem chunk goes back to the socket, XDP_PASS pays for a copy */
+    skb = napi_alloc_skb(&rx_ring->napi, size);
+    if (unlikely(!skb))
+        return NULL;
+
+    memcpy(__skb_put(skb, size), xdp->data, size);
+    xsk_buff_free(xdp);
+
+    return skb;
+}
+
+static u32
+sketh_run_xdp_zc(struct sketh_ring *rx_ring, struct bpf_prog *xdp_prog,
+                 struct xdp_buff *xdp)
+{
+    struct xdp_frame *xdpf;
+    u32 act;
+    int err;
+
+    act = bpf_prog_run_xdp(xdp_prog, xdp);
+
+    /* Redirect into the bound socket is the common case */
+    if (likely(act == XDP_REDIRECT)) {
+        if (unlikely(xdp_do_redirect(rx_ring->netdev, xdp, xdp_prog)))
+            goto out_failure;
+        sketh_rx_stats_inc(rx_ring, xdp_redirect);
+        return act;
+    }
+
+    switch (act) {
+    case XDP_PASS:
+        sketh_rx_stats_inc(rx_ring, xdp_pass);
+        break;
+    case XDP_TX:
+        if (unlikely(!rx_ring->xdp_ring))
+            goto out_failure;
+
+        /* Copies out of the umem and releases the XSK buffer */
+        xdpf = xdp_convert_buff_to_frame(xdp);
+        if (unlikely(!xdpf))
+            goto out_failure;
+
+        spin_lock(&rx_ring->xdp_ring->tx_lock);
+        err = sketh_xmit_xdp_ring(rx_ring->xdp_ring, xdpf, true);
+        spin_unlock(&rx_ring->xdp_ring->tx_lock);
+
+        if (unlikely(err)) {
+            trace_xdp_exception(rx_ring->netdev, xdp_prog, act);
+            xdp_return_frame(xdpf);
+            sketh_rx_stats_inc(rx_ring, xdp_drops);
+            return XDP_DROP;
+        }
+        sketh_rx_stats_inc(rx_ring, xdp_tx);
+        break;
+    default:
+        sketh_warn_invalid_xdp_action(rx_ring->netdev, xdp_prog, act);
+        fallthrough;
+    case XDP_ABORTED:
+out_failure:
+        trace_xdp_exception(rx_ring->netdev, xdp_prog, act);
+        fallthrough;
+    case XDP_DROP:
+        sketh_rx_stats_inc(rx_ring, xdp_drops);
+        xsk_buff_free(xdp);
+        break;
+    }
+
+    return act;
+}
+
+bool
+sketh_alloc_rx_buffers_zc(struct sketh_ring *rx_ring, int cleaned_count)
+{
+    union sketh_rx_desc *rx_desc;
+    struct sketh_rx_buffer *bi;
+    unsigned int i;
+
+    i = rx_ring->next_to_use;
+
+    while (cleaned_count--) {
+        bi = &rx_ring->rx_buffer[i];
+
+        bi->xdp = xsk_buff_alloc(rx_ring->xsk_pool);
+        if (!bi->xdp) {
+            sketh_rx_stats_inc(rx_ring, alloc_failed);
+            break;
+        }
+
+        rx_desc = SKETH_RX_DESC(rx_ring, i);
+        rx_desc->read.pkt_addr = cpu_to_le64(xsk_buff_xdp_get_dma(bi->xdp));
+        rx_desc->read.hdr_addr = 0;
+        rx_desc->read.status = 0;
+
+        i = next_to_use(i, rx_ring->count);
+    }
+
+    if (rx_ring->next_to_use != i) {
+        rx_ring->next_to_use = i;
+        sketh_write_tail(rx_ring, SKETH_REG_RDT(rx_ring->reg_idx), i);
+    }
+
+    return cleaned_count < 0;
+}
+
+int
+sketh_clean_rx_ring_zc(struct sketh_ring *rx_ring, int budget)
+{
+    struct sketh_adapter *adapter = rx_ring->adapter;
+    struct bpf_prog *xdp_prog;
+    unsigned int total_packets = 0;
+    unsigned int total_bytes = 0;
+    bool failure = false;
+    bool xdp_tx = false;
+    int cleaned = 0;
+    u32 act;
+
+    xdp_prog = READ_ONCE(adapter->xdp_info.prog);
+
+    while (likely(total_packets < budget)) {
+        union sketh_rx_desc *rx_desc;
+        struct sketh_rx_buffer *rx_buffer;
+        struct xdp_buff *xdp;
+        struct sk_buff *skb;
+        unsigned int size;
+        u16 status;
+
+        rx_desc = SKETH_RX_DESC(rx_ring, rx_ring->next_to_clean);
+        status = le16_to_cpu(rx_desc->read.status);
+
+        if (!(status & SKETH_RXD_STAT_DD))
+            break;
+
+        dma_rmb();
+
+        rx_buffer = &rx_ring->rx_buffer[rx_ring->next_to_clean];
+        xdp = rx_buffer->xdp;
+        rx_buffer->xdp = NULL;
+
+        rx_ring->next_to_clean = next_to_use(rx_ring->next_to_clean,
+                                              rx_ring->count);
+        cleaned++;
+
+        /* A frame must fit one umem chunk, drop anything spanning more */
+        if (unlikely(!(status & SKETH_RXD_STAT_EOP))) {
+            xsk_buff_free(xdp);
+            rx_ring->rx_discard = true;
+            continue;
+        }
+
+        if (unlikely(rx_desc->read.errors || rx_ring->rx_discard)) {
+            xsk_buff_free(xdp);
+            rx_ring->rx_discard = false;
+            sketh_rx_stats_inc(rx_ring, drops);
+            continue;
+        }
+
+        size = min_t(unsigned int, le16_to_cpu(rx_desc->read.length),
+                     rx_ring->rx_buf_len);
+        xdp->data_end = xdp->data + size;
+        sketh_xsk_buff_dma_sync_for_cpu(xdp, rx_ring->xsk_pool);
+
+        /* The program can be gone briefly while it is being detached */
+        act = xdp_prog ? sketh_run_xdp_zc(rx_ring, xdp_prog, xdp) : XDP_PASS;
+        if (act != XDP_PASS) {
+            xdp_tx |= act == XDP_TX;
+            rx_ring->xdp_redirect |= act == XDP_REDIRECT;
+            total_packets++;
+            total_bytes += size;
+            continue;
+        }
+
+        skb = sketh_construct_skb_zc(rx_ring, xdp);
+        if (unlikely(!skb)) {
+            xsk_buff_free(xdp);
+            sketh_rx_stats_inc(rx_ring, alloc_failed);
+            sketh_rx_stats_inc(rx_ring, drops);
+            continue;
+        }
+
+        total_packets++;
+        total_bytes += skb->len;
+
+        sketh_rx_hash(rx_ring, rx_desc, skb);
+        sketh_receive_skb(rx_ring, skb);
+    }
+
+    if (xdp_tx && rx_ring->xdp_ring) {
+        spin_lock(&rx_ring->xdp_ring->tx_lock);
+        sketh_tx_doorbell(rx_ring->xdp_ring);
+        spin_unlock(&rx_ring->xdp_ring->tx_lock);
+    }
+
+    if (cleaned) {
+        failure = !sketh_alloc_rx_buffers_zc(rx_ring, cleaned);
+
+        u64_stats_update_begin(&rx_ring->syncp);
+        rx_ring->rx_stats.packets += total_packets;
+        rx_ring->rx_stats.bytes += total_bytes;
+        u64_stats_update_end(&rx_ring->syncp);
+    }
+
+    /* An empty fill ring is refilled by userspace, which then wakes us */
+    if (xsk_uses_need_wakeup(rx_ring->xsk_pool)) {
+        if (failure)
+            xsk_set_rx_need_wakeup(rx_ring->xsk_pool);
+        else
+            xsk_clear_rx_need_wakeup(rx_ring->xsk_pool);
+
+        return total_packets;
+    }
+
+    return failure ? budget : total_packets;
+}
+
+bool
+sketh_xmit_zc(struct sketh_ring *xdp_ring, unsigned int budget)
+{
+    struct xsk_buff_pool *pool = xdp_ring->xsk_pool;
+    struct sketh_tx_buffer *tx_buffer;
+    union sketh_tx_desc *tx_desc;
+    unsigned int sent = 0;
+    struct xdp_desc desc;
+    dma_addr_t dma;
+
+    spin_lock(&xdp_ring->tx_lock);
+
+    while (sent < budget && sketh_desc_unused(xdp_ring)) {
+        if (!xsk_tx_peek_desc(pool, &desc))
+            break;
+
+        dma = xsk_buff_raw_get_dma(pool, desc.addr);
+        xsk_buff_raw_dma_sync_for_device(pool, dma, desc.len);
+
+        tx_buffer = &xdp_ring->tx_buffer[xdp_ring->next_to_use];
+        tx_buffer->bytes = desc.len;
+        tx_buffer->gso_segs = 1;
+
+        tx_desc = SKETH_TX_DESC(xdp_ring, xdp_ring->next_to_use);
+        sketh_xmit_desc(xdp_ring, dma, desc.len, 0,
+                        SKETH_TX_DESC_CMD_EOP | SKETH_TX_DESC_CMD_RS);
+
+        smp_wmb();
+        tx_buffer->next_to_watch = tx_desc;
+
+        sent++;
+    }
+
+    if (sent) {
+        sketh_tx_doorbell(xdp_ring);
+        xsk_tx_release(pool);
+    }
+
+    spin_unlock(&xdp_ring->tx_lock);
+
+    return sent < budget;
+}
+
+/* Only queues already running XDP have to be rebuilt */
+static bool
+sketh_xsk_needs_reopen(struct sketh_adapter *adapter)
+{
+    return netif_running(adapter->netdev) && adapter->xdp_info.prog;
+}
+
+static int
+sketh_xsk_pool_enable(struct sketh_adapter *adapter,
+                      struct xsk_buff_pool *pool, u16 qid)
+{
+    struct net_device *netdev = adapter->netdev;
+    bool running;
+    int err;
+
+    if (test_bit(qid, adapter->af_xdp_zc_qps))
+        return -EBUSY;
+
+    err = xsk_pool_dma_map(pool, adapter->dev, 0);
+    if (err)
+        return err;
+
+    running = sketh_xsk_needs_reopen(adapter);
+    if (running)
+        sketh_stop(netdev);
+
+    set_bit(qid, adapter->af_xdp_zc_qps);
+
+    if (!running)
+        return 0;
+
+    err = sketh_open(netdev);
+    if (!err)
+        return 0;
+
+    /* Bring the queue back on its copy mode buffers */
+    clear_bit(qid, adapter->af_xdp_zc_qps);
+    xsk_pool_dma_unmap(pool, 0);
+
+    if (sketh_open(netdev))
+        sketh_err(adapter, "Unable to reopen the interface\n");
+
+    return err;
+}
+
+static int
+sketh_xsk_pool_disable(struct sketh_adapter *adapter, u16 qid)
+{
+    struct net_device *netdev = adapter->netdev;
+    struct xsk_buff_pool *pool;
+    bool running;
+    int err = 0;
+
+    pool = xsk_get_pool_from_qid(netdev, qid);
+    if (!pool || !test_bit(qid, adapter->af_xdp_zc_qps))
+        return -EINVAL;
+
+    running = sketh_xsk_needs_reopen(adapter);
+    if (running)
+        sketh_stop(netdev);
+
+    clear_bit(qid, adapter->af_xdp_zc_qps);
+    xsk_pool_dma_unmap(pool, 0);
+
+    if (running)
+        err = sketh_open(netdev);
+
+    return err;
+}
+
+int
+sketh_xsk_pool_setup(struct sketh_adapter *adapter,
+                     struct xsk_buff_pool *pool, u16 qid)
+{
+    if (qid >= adapter->num_queues)
+        return -EINVAL;
+
+    return pool ? sketh_xsk_pool_enable(adapter, pool, qid) :
+                  sketh_xsk_pool_disable(adapter, qid);
+}
+
+int
+sketh_xsk_wakeup(struct net_device *netdev, u32 qid, u32 flags)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    struct sketh_ring *rx_ring;
+
+    if (test_bit(__SKETH_STATE_DOWN, &adapter->state))
+        return -ENETDOWN;
+
+    if (!READ_ONCE(adapter->xdp_info.prog))
+        return -EINVAL;
+
+    if (qid >= adapter->num_queues)
+        return -EINVAL;
+
+    rx_ring = &adapter->rx_ring[qid];
+    if (!rx_ring->xsk_pool)
+        return -EINVAL;
+
+    /* A poll already running picks the new descriptors up before it ends */
+    if (!napi_if_scheduled_mark_missed(&rx_ring->napi)) {
+        local_bh_disable();
+        napi_schedule(&rx_ring->napi);
+        local_bh_enable();
+    }
+
+    return 0;
+}
+
+static u32
+sketh_fltr_hash(const struct sketh_flow_key *key)
+{
+    return jhash(key, sizeof(*key), 0);
+}
+
+static struct sketh_flow_rule *
+sketh_fltr_find(struct sketh_adapter *adapter,
+                const struct sketh_flow_key *key)
+{
+    struct sketh_flow_rule *rule;
+
+    hash_for_each_possible(adapter->fltr_hash, rule, hnode,
+                           sketh_fltr_hash(key)) {
+        if (!memcmp(&rule->key, key, sizeof(*key)))
+            return rule;
+    }
+
+    return NULL;
+}
+
+static int
+sketh_fltr_find_free(struct sketh_adapter *adapter)
+{
+    int loc;
+
+    for (loc = 0; loc < SKETH_FLT_MAX; loc++) {
+        if (!adapter->fltr_rules[loc])
+            return loc;
+    }
+
+    return -ENOSPC;
+}
+
+static void
+sketh_fltr_write(struct sketh_adapter *adapter, struct sketh_flow_rule *rule)
+{
+    const struct sketh_flow_key *key = &rule->key;
+    u16 loc = rule->loc;
+    u32 ctrl;
+    int i;
+
+    /* Disarm the slot while its match fields are rewritten */
+    sketh_wr32(adapter, SKETH_REG_FLT_CTRL(loc), 0);
+
+    for (i = 0; i < 4; i++) {
+        sketh_wr32(adapter, SKETH_REG_FLT_SRC(loc, i),
+                   (__force u32)key->src_ip[i]);
+        sketh_wr32(adapter, SKETH_REG_FLT_DST(loc, i),
+                   (__force u32)key->dst_ip[i]);
+    }
+
+    sketh_wr32(adapter, SKETH_REG_FLT_PORTS(loc),
+               (__force u16)key->src_port |
+               ((u32)(__force u16)key->dst_port << 16));
+
+    ctrl = SKETH_FLT_CTRL_VALID | key->ip_proto |
+           ((u32)key->ignore << SKETH_FLT_CTRL_MASK_SHIFT);
+
+    if (key->ipv6)
+        ctrl |= SKETH_FLT_CTRL_IPV6;
+
+    if (rule->drop)
+        ctrl |= SKETH_FLT_CTRL_DROP;
+    else
+        ctrl |= (u32)rule->queue << SKETH_FLT_CTRL_QUEUE_SHIFT;
+
+    sketh_wr32(adapter, SKETH_REG_FLT_CTRL(loc), ctrl);
+}
+
+static void
+sketh_fltr_insert(struct sketh_adapter *adapter, struct sketh_flow_rule *rule)
+{
+    adapter->fltr_rules[rule->loc] = rule;
+    hash_add(adapter->fltr_hash, &rule->hnode, sketh_fltr_hash(&rule->key));
+
+    if (!rule->arfs)
+        adapter->fltr_ethtool_count++;
+
+    sketh_fltr_write(adapter, rule);
+}
+
+static void
+sketh_fltr_remove(struct sketh_adapter *adapter, struct sketh_flow_rule *rule)
+{
+    sketh_wr32(adapter, SKETH_REG_FLT_CTRL(rule->loc), 0);
+
+    adapter->fltr_rules[rule->loc] = NULL;
+    hash_del(&rule->hnode);
+
+    if (!rule->arfs)
+        adapter->fltr_ethtool_count--;
+
+    kfree(rule);
+}
+
+static void
+sketh_fltr_flush(struct sketh_adapter *adapter)
+{
+    int loc;
+
+    spin_lock_bh(&adapter->fltr_lock);
+
+    for (loc = 0; loc < SKETH_FLT_MAX; loc++) {
+        if (adapter->fltr_rules[loc])
+            sketh_fltr_remove(adapter, adapter->fltr_rules[loc]);
+    }
+
+    spin_unlock_bh(&adapter->fltr_lock);
+}
+
+/*
+ * Makes every filter fit in the first count queues: aRFS entries are
+ * dropped and relearnt, ethtool -N rules must be moved by the user first.
+ */
+static int
+sketh_fltr_trim_queues(struct sketh_adapter *adapter, u16 count)
+{
+    struct sketh_flow_rule *rule;
+    int loc;
+
+    spin_lock_bh(&adapter->fltr_lock);
+
+    for (loc = 0; loc < SKETH_FLT_MAX; loc++) {
+        rule = adapter->fltr_rules[loc];
+
+        if (rule && !rule->arfs && !rule->drop && rule->queue >= count) {
+            spin_unlock_bh(&adapter->fltr_lock);
+            sketh_err(adapter, "Filter %d steers to queue %u\n",
+                      loc, rule->queue);
+            return -EINVAL;
+        }
+    }
+
+    for (loc = 0; loc < SKETH_FLT_MAX; loc++) {
+        rule = adapter->fltr_rules[loc];
+
+        if (rule && rule->arfs && rule->queue >= count)
+            sketh_fltr_remove(adapter, rule);
+    }
+
+    spin_unlock_bh(&adapter->fltr_lock);
+
+    return 0;
+}
+
+static void
+sketh_configure_fltrs(struct sketh_adapter *adapter)
+{
+    int loc;
+
+    spin_lock_bh(&adapter->fltr_lock);
+
+    for (loc = 0; loc < SKETH_FLT_MAX; loc++) {
+        if (adapter->fltr_rules[loc])
+            sketh_fltr_write(adapter, adapter->fltr_rules[loc]);
+        else
+            sketh_wr32(adapter, SKETH_REG_FLT_CTRL(loc), 0);
+    }
+
+    spin_unlock_bh(&adapter->fltr_lock);
+}
+
+#ifdef CONFIG_RFS_ACCEL
+int
+sketh_rx_flow_steer(struct net_device *netdev, const struct sk_buff *skb,
+                    u16 rxq_index, u32 flow_id)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    struct sketh_flow_rule *rule;
+    struct sketh_flow_key key;
+    struct flow_keys fk;
+    int loc;
+
+    if (!skb_flow_dissect_flow_keys(skb, &fk, 0))
+        return -EPROTONOSUPPORT;
+
+    if (fk.control.flags & FLOW_DIS_IS_FRAGMENT)
+        return -EPROTONOSUPPORT;
+
+    if (fk.basic.ip_proto != IPPROTO_TCP && fk.basic.ip_proto != IPPROTO_UDP)
+        return -EPROTONOSUPPORT;
+
+    /* Padding takes part in the hash and the compare */
+    memset(&key, 0, sizeof(key));
+    key.ip_proto = fk.basic.ip_proto;
+    key.src_port = fk.ports.src;
+    key.dst_port = fk.ports.dst;
+
+    if (fk.basic.n_proto == htons(ETH_P_IP)) {
+        key.src_ip[0] = fk.addrs.v4addrs.src;
+        key.dst_ip[0] = fk.addrs.v4addrs.dst;
+    } else if (fk.basic.n_proto == htons(ETH_P_IPV6)) {
+        memcpy(key.src_ip, &fk.addrs.v6addrs.src, sizeof(key.src_ip));
+        memcpy(key.dst_ip, &fk.addrs.v6addrs.dst, sizeof(key.dst_ip));
+        key.ipv6 = 1;
+    } else {
+        return -EPROTONOSUPPORT;
+    }
+
+    spin_lock_bh(&adapter->fltr_lock);
+
+    rule = sketh_fltr_find(adapter, &key);
+    if (rule) {
+        /* An ethtool rule for the same flow takes precedence */
+        if (!rule->arfs) {
+            loc = -EEXIST;
+            goto out;
+        }
+
+        /* The consuming thread moved, follow it */
+        if (rule->queue != rxq_index) {
+            rule->queue = rxq_index;
+            rule->flow_id = flow_id;
+            sketh_fltr_write(adapter, rule);
+        }
+
+        loc = rule->loc;
+        goto out;
+    }
+
+    loc = sketh_fltr_find_free(adapter);
+    if (loc < 0)
+        goto out;
+
+    rule = kzalloc(sizeof(*rule), GFP_ATOMIC);
+    if (!rule) {
+        loc = -ENOMEM;
+        goto out;
+    }
+
+    rule->key = key;
+    rule->loc = loc;
+    rule->queue = rxq_index;
+    rule->flow_id = flow_id;
+    rule->arfs = true;
+
+    sketh_fltr_insert(adapter, rule);
+
+out:
+    spin_unlock_bh(&adapter->fltr_lock);
+
+    return loc;
+}
+#endif
+
+static void
+sketh_arfs_expire(struct sketh_adapter *adapter)
+{
+#ifdef CONFIG_RFS_ACCEL
+    struct sketh_flow_rule *rule;
+    int loc;
+
+    spin_lock_bh(&adapter->fltr_lock);
+
+    for (loc = 0; loc < SKETH_FLT_MAX; loc++) {
+        rule = adapter->fltr_rules[loc];
+
+        if (rule && rule->arfs &&
+            rps_may_expire_flow(adapter->netdev, rule->queue,
+                                rule->flow_id, rule->loc))
+            sketh_fltr_remove(adapter, rule);
+    }
+
+    spin_unlock_bh(&adapter->fltr_lock);
+#endif
+}
+
+/*
+ * An RX ring with no buffers posted drops everything and never interrupts
+ * again. The next poll normally refills it, one still empty a tick later
+ * is reported. Zero-copy rings wait on the socket's fill queue instead.
+ */
+static void
+sketh_check_rx_stall(struct sketh_adapter *adapter)
+{
+    bool stalled = false;
+    int i;
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
+        bool empty;
+
+        if (rx_ring->xsk_pool)
+            continue;
+
+        empty = sketh_desc_unused(rx_ring) == rx_ring->count - 1;
+        if (empty && rx_ring->rx_starved) {
+            set_bit(i, adapter->rx_stall_qps);
+            stalled = true;
+        }
+
+        rx_ring->rx_starved = empty;
+    }
+
+    if (stalled)
+        schedule_work(&adapter->reset_task);
+}
+
+static void
+sketh_service_task(struct work_struct *work)
+{
+    struct sketh_adapter *adapter = container_of(work, struct sketh_adapter,
+                                                 service_task.work);
+
+    if (test_bit(__SKETH_STATE_DOWN, &adapter->state))
+        return;
+
+    sketh_arfs_expire(adapter);
+    sketh_update_pfc_stats(adapter);
+    sketh_check_rx_stall(adapter);
+
+    schedule_delayed_work(&adapter->service_task, HZ);
+}
+
+static int
+sketh_set_features(struct net_device *netdev, netdev_features_t features)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    netdev_features_t changed = netdev->features ^ features;
+
+    if (changed & NETIF_F_HW_TC) {
+        int err;
+
+        if (features & NETIF_F_HW_TC)
+            err = sketh_hw_offload_enable(adapter);
+        else
+            err = sketh_hw_offload_disable(adapter);
+        if (err)
+            return err;
+    }
+
+    if (changed & NETIF_F_NTUPLE) {
+        /* Both ethtool and aRFS filters go away with the feature */
+        if (!(features & NETIF_F_NTUPLE))
+            sketh_fltr_flush(adapter);
+    }
+
+    return 0;
+}
+
+static const struct rhashtable_params sketh_ft_tuple_params = {
+    .head_offset         = offsetof(struct sketh_ft_flow, tuple_node),
+    .key_offset          = offsetof(struct sketh_ft_flow, key),
+    .key_len             = sizeof(struct sketh_flow_key),
+    .automatic_shrinking = true,
+};
+
+static const struct rhashtable_params sketh_ft_cookie_params = {
+    .head_offset         = offsetof(struct sketh_ft_flow, cookie_node),
+    .key_offset          = offsetof(struct sketh_ft_flow, cookie),
+    .key_len             = sizeof(unsigned long),
+    .automatic_shrinking = true,
+};
+
+static LIST_HEAD(sketh_block_cb_list);
+
+static void
+sketh_ft_l4_csum(struct sk_buff *skb, u8 ip_proto, __be32 old, __be32 new,
+                 bool pseudohdr)
+{
+    if (ip_proto == IPPROTO_TCP) {
+        inet_proto_csum_replace4(&tcp_hdr(skb)->check, skb, old, new,
+                                 pseudohdr);
+        return;
+    }
+
+    /* A zero UDP checksum means none was computed */
+    if (!udp_hdr(skb)->check)
+        return;
+
+    inet_proto_csum_replace4(&udp_hdr(skb)->check, skb, old, new, pseudohdr);
+    if (!udp_hdr(skb)->check)
+        udp_hdr(skb)->check = CSUM_MANGLED_0;
+}
+
+/* pedit semantics: the masked bits are kept, val is applied on top */
+static void
+sketh_ft_mangle(struct sk_buff *skb, const struct sketh_ft_flow *flow,
+                const struct sketh_ft_mangle *m)
+{
+    __be32 *ptr, old, new;
+
+    switch (m->htype) {
+    case FLOW_ACT_MANGLE_HDR_TYPE_IP4:
+    case FLOW_ACT_MANGLE_HDR_TYPE_IP6:
+        ptr = (__be32 *)(skb_network_header(skb) + m->offset);
+        break;
+    case FLOW_ACT_MANGLE_HDR_TYPE_TCP:
+    case FLOW_ACT_MANGLE_HDR_TYPE_UDP:
+        ptr = (__be32 *)(skb_transport_header(skb) + m->offset);
+        break;
+    default:
+        return;
+    }
+
+    old = get_unaligned(ptr);
+    new = (old & m->mask) ^ m->val;
+    put_unaligned(new, ptr);
+
+    switch (m->htype) {
+    case FLOW_ACT_MANGLE_HDR_TYPE_IP4:
+        csum_replace4(&ip_hdr(skb)->check, old, new);
+
+        /* Addresses are part of the L4 pseudo header */
+        if (m->offset >= offsetof(struct iphdr, saddr))
+            sketh_ft_l4_csum(skb, flow->key.ip_proto, old, new, true);
+        break;
+    case FLOW_ACT_MANGLE_HDR_TYPE_IP6:
+        if (m->offset >= offsetof(struct ipv6hdr, saddr))
+            sketh_ft_l4_csum(skb, flow->key.ip_proto, old, new, true);
+        break;
+    default:
+        sketh_ft_l4_csum(skb, flow->key.ip_proto, old, new, false);
+        break;
+    }
+}
+
+/*
+ * Rewrite and transmit one packet of an offloaded flow. skb->data is at
+ * the network header. A non-zero return leaves the skb to the stack.
+ */
+static int
+sketh_ft_forward(struct sk_buff *skb, struct sketh_ft_flow *flow, bool routed)
+{
+    struct net_device *out_dev = flow->out_dev;
+    unsigned int thoff, hdrlen;
+    struct ethhdr *eth;
+    unsigned int len;
+    int i;
+
+    skb_reset_network_header(skb);
+
+    if (flow->key.ipv6) {
+        thoff = sizeof(struct ipv6hdr);
+
+        if (!routed && ipv6_hdr(skb)->hop_limit <= 1)
+            return -ETIMEDOUT;
+    } else {
+        thoff = ip_hdr(skb)->ihl * 4;
+
+        if (!routed && ip_hdr(skb)->ttl <= 1)
+            return -ETIMEDOUT;
+    }
+
+    hdrlen = thoff + (flow->key.ip_proto == IPPROTO_TCP ?
+                      sizeof(struct tcphdr) : sizeof(struct udphdr));
+
+    /* Fragmenting and PMTU errors are left to the stack */
+    if (skb->len > out_dev->mtu)
+        return -E2BIG;
+
+    if (skb_ensure_writable(skb, hdrlen) || skb_cow_head(skb, ETH_HLEN))
+        return -ENOMEM;
+
+    skb_set_transport_header(skb, thoff);
+
+    /* Conntrack has to see the teardown to retire the flow */
+    if (flow->key.ip_proto == IPPROTO_TCP &&
+        (tcp_hdr(skb)->fin || tcp_hdr(skb)->rst))
+        return -EAGAIN;
+
+    if (!routed) {
+        if (flow->key.ipv6)
+            ipv6_hdr(skb)->hop_limit--;
+        else
+            ip_decrease_ttl(ip_hdr(skb));
+    }
+
+    for (i = 0; i < flow->nr_mangles; i++) {
+        if (flow->mangles[i].htype != FLOW_ACT_MANGLE_HDR_TYPE_ETH)
+            sketh_ft_mangle(skb, flow, &flow->mangles[i]);
+    }
+
+    len = skb->len;
+
+    __skb_push(skb, ETH_HLEN);
+    skb_reset_mac_header(skb);
+
+    eth = eth_hdr(skb);
+    eth->h_proto = skb->protocol;
+
+    for (i = 0; i < flow->nr_mangles; i++) {
+        const struct sketh_ft_mangle *m = &flow->mangles[i];
+        __be32 *ptr;
+
+        if (m->htype != FLOW_ACT_MANGLE_HDR_TYPE_ETH)
+            continue;
+
+        ptr = (__be32 *)((u8 *)eth + m->offset);
+        put_unaligned((get_unaligned(ptr) & m->mask) ^ m->val, ptr);
+    }
+
+    atomic64_inc(&flow->packets);
+    atomic64_add(len, &flow->bytes);
+    WRITE_ONCE(flow->lastused, jiffies);
+
+    skb->dev = out_dev;
+    dev_queue_xmit(skb);
+
+    return 0;
+}
+
+/* Called from NAPI with skb->data at the network header */
+static int
+sketh_ft_rx(struct sketh_adapter *adapter, struct sk_buff *skb)
+{
+    struct sketh_ft_flow *flow;
+    struct sketh_flow_key key;
+    unsigned int thoff;
+    __be16 *ports;
+    int err = -ENOENT;
+
+    if (skb->pkt_type != PACKET_HOST)
+        return -ENOENT;
+
+    memset(&key, 0, sizeof(key));
+
+    switch (skb->protocol) {
+    case htons(ETH_P_IP): {
+        struct iphdr *iph;
+
+        if (!pskb_may_pull(skb, sizeof(*iph)))
+            return -ENOENT;
+
+        iph = (struct iphdr *)skb->data;
+        if (iph->ihl < 5 || ip_is_fragment(iph))
+            return -ENOENT;
+
+        thoff = iph->ihl * 4;
+        key.ip_proto = iph->protocol;
+        key.src_ip[0] = iph->saddr;
+        key.dst_ip[0] = iph->daddr;
+        break;
+    }
+    case htons(ETH_P_IPV6): {
+        struct ipv6hdr *ip6h;
+
+        if (!pskb_may_pull(skb, sizeof(*ip6h)))
+            return -ENOENT;
+
+        /* Extension headers are not parsed, those take the slow path */
+        ip6h = (struct ipv6hdr *)skb->data;
+        thoff = sizeof(*ip6h);
+        key.ip_proto = ip6h->nexthdr;
+        memcpy(key.src_ip, &ip6h->saddr, sizeof(key.src_ip));
+        memcpy(key.dst_ip, &ip6h->daddr, sizeof(key.dst_ip));
+        key.ipv6 = 1;
+        break;
+    }
+    default:
+        return -ENOENT;
+    }
+
+    if (key.ip_proto != IPPROTO_TCP && key.ip_proto != IPPROTO_UDP)
+        return -ENOENT;
+
+    if (!pskb_may_pull(skb, thoff + 2 * sizeof(__be16)))
+        return -ENOENT;
+
+    ports = (__be16 *)(skb->data + thoff);
+    key.src_port = ports[0];
+    key.dst_port = ports[1];
+
+    rcu_read_lock();
+
+    flow = rhashtable_lookup(&adapter->ft_tuples, &key, sketh_ft_tuple_params);
+    if (flow)
+        err = sketh_ft_forward(skb, flow, false);
+
+    rcu_read_unlock();
+
+    return err;
+}
+
+int
+sketh_netfilter_offload(struct sketh_adapter *adapter,
+                        struct sk_buff *skb,
+                        struct sketh_offload_info *info)
+{
+    const struct nf_conntrack_tuple *tuple;
+    struct sketh_ft_flow *flow;
+    struct sketh_flow_key key;
+    int err = -ENOENT;
+
+    if (!info->conn)
+        return -EINVAL;
+
+    if (!adapter->hw_accel)
+        return -EOPNOTSUPP;
+
+    if (info->indev != adapter->netdev)
+        return -ENOENT;
+
+    /* Already DNATed by PREROUTING, so look up the original tuple */
+    tuple = &info->conn->tuplehash[CTINFO2DIR(info->ctinfo)].tuple;
+
+    memset(&key, 0, sizeof(key));
+    key.ip_proto = tuple->dst.protonum;
+    key.src_port = tuple->src.u.all;
+    key.dst_port = tuple->dst.u.all;
+
+    if (tuple->src.l3num == NFPROTO_IPV6) {
+        memcpy(key.src_ip, &tuple->src.u3.in6, sizeof(key.src_ip));
+        memcpy(key.dst_ip, &tuple->dst.u3.in6, sizeof(key.dst_ip));
+        key.ipv6 = 1;
+    } else {
+        key.src_ip[0] = tuple->src.u3.ip;
+        key.dst_ip[0] = tuple->dst.u3.ip;
+    }
+
+    rcu_read_lock();
+
+    /* The mangles are absolute, so DNAT applied twice is a no-op */
+    flow = rhashtable_lookup(&adapter->ft_tuples, &key, sketh_ft_tuple_params);
+    if (flow)
+        err = sketh_ft_forward(skb, flow, true);
+
+    rcu_read_unlock();
+
+    return err;
+}
+
+#define SKETH_FT_USED_KEYS                              \
+    (BIT_ULL(FLOW_DISSECTOR_KEY_META) |                 \
+     BIT_ULL(FLOW_DISSECTOR_KEY_CONTROL) |              \
+     BIT_ULL(FLOW_DISSECTOR_KEY_BASIC) |                \
+     BIT_ULL(FLOW_DISSECTOR_KEY_IPV4_ADDRS) |           \
+     BIT_ULL(FLOW_DISSECTOR_KEY_IPV6_ADDRS) |           \
+     BIT_ULL(FLOW_DISSECTOR_KEY_PORTS) |                \
+     BIT_ULL(FLOW_DISSECTOR_KEY_TCP))
+
+static int
+sketh_ft_parse_mangle(struct sketh_ft_flow *flow,
+                      const struct flow_action_entry *act)
+{
+    struct sketh_ft_mangle *m;
+    unsigned int hdr_size;
+
+    switch (act->mangle.htype) {
+    case FLOW_ACT_MANGLE_HDR_TYPE_ETH:
+        hdr_size = 2 * ETH_ALEN;
+        break;
+    case FLOW_ACT_MANGLE_HDR_TYPE_IP4:
+        hdr_size = sizeof(struct iphdr);
+        break;
+    case FLOW_ACT_MANGLE_HDR_TYPE_IP6:
+        hdr_size = sizeof(struct ipv6hdr);
+        break;
+    case FLOW_ACT_MANGLE_HDR_TYPE_TCP:
+        hdr_size = sizeof(struct tcphdr);
+        break;
+    case FLOW_ACT_MANGLE_HDR_TYPE_UDP:
+        hdr_size = sizeof(struct udphdr);
+        break;
+    default:
+        return -EOPNOTSUPP;
+    }
+
+    if (act->mangle.offset + sizeof(u32) > hdr_size)
+        return -EOPNOTSUPP;
+
+    if (flow->nr_mangles == SKETH_FT_MAX_MANGLES)
+        return -EOPNOTSUPP;
+
+    m = &flow->mangles[flow->nr_mangles++];
+    m->htype = act->mangle.htype;
+    m->offset = act->mangle.offset;
+    m->mask = (__force __be32)act->mangle.mask;
+    m->val = (__force __be32)act->mangle.val;
+
+    return 0;
+}
+
+static int
+sketh_ft_parse(struct sketh_adapter *adapter, struct flow_cls_offload *f,
+               struct sketh_ft_flow *flow)
+{
+    struct flow_rule *rule = flow_cls_offload_flow_rule(f);
+    struct sketh_flow_key *key = &flow->key;
+    const struct flow_action_entry *act;
+    struct flow_match_basic basic;
+    struct flow_match_ports ports;
+    struct flow_match_meta meta;
+    int err;
+    int i;
+
+    if (rule->match.dissector->used_keys & ~SKETH_FT_USED_KEYS)
+        return -EOPNOTSUPP;
+
+    /* Every bound port sees every rule, keep the ones that ingress here */
+    if (!flow_rule_match_key(rule, FLOW_DISSECTOR_KEY_META))
+        return -EOPNOTSUPP;
+
+    flow_rule_match_meta(rule, &meta);
+    if (meta.key->ingress_ifindex != adapter->netdev->ifindex)
+        return -EOPNOTSUPP;
+
+    if (!flow_rule_match_key(rule, FLOW_DISSECTOR_KEY_BASIC) ||
+        !flow_rule_match_key(rule, FLOW_DISSECTOR_KEY_PORTS))
+        return -EOPNOTSUPP;
+
+    flow_rule_match_basic(rule, &basic);
+    if (basic.key->ip_proto != IPPROTO_TCP &&
+        basic.key->ip_proto != IPPROTO_UDP)
+        return -EOPNOTSUPP;
+
+    key->ip_proto = basic.key->ip_proto;
+
+    if (basic.key->n_proto == htons(ETH_P_IP) &&
+        flow_rule_match_key(rule, FLOW_DISSECTOR_KEY_IPV4_ADDRS)) {
+        struct flow_match_ipv4_addrs addrs;
+
+        flow_rule_match_ipv4_addrs(rule, &addrs);
+        key->src_ip[0] = addrs.key->src;
+        key->dst_ip[0] = addrs.key->dst;
+    } else if (basic.key->n_proto == htons(ETH_P_IPV6) &&
+               flow_rule_match_key(rule, FLOW_DISSECTOR_KEY_IPV6_ADDRS)) {
+        struct flow_match_ipv6_addrs addrs;
+
+        flow_rule_match_ipv6_addrs(rule, &addrs);
+        memcpy(key->src_ip, &addrs.key->src, sizeof(key->src_ip));
+        memcpy(key->dst_ip, &addrs.key->dst, sizeof(key->dst_ip));
+        key->ipv6 = 1;
+    } else {
+        return -EOPNOTSUPP;
+    }
+
+    flow_rule_match_ports(rule, &ports);
+    key->src_port = ports.key->src;
+    key->dst_port = ports.key->dst;
+
+    flow_action_for_each(i, act, &rule->action) {
+        switch (act->id) {
+        case FLOW_ACTION_MANGLE:
+            err = sketh_ft_parse_mangle(flow, act);
+            if (err)
+                return err;
+            break;
+        case FLOW_ACTION_CSUM:
+            /* Checksums are always fixed up incrementally per mangle */
+            break;
+        case FLOW_ACTION_REDIRECT:
+            flow->out_dev = act->dev;
+            break;
+        default:
+            /* VLAN and tunnel encapsulation stay in software */
+            return -EOPNOTSUPP;
+        }
+    }
+
+    if (!flow->out_dev)
+        return -EOPNOTSUPP;
+
+    return 0;
+}
+
+static int
+sketh_ft_add(struct sketh_adapter *adapter, struct flow_cls_offload *f)
+{
+    struct sketh_ft_flow *flow;
+    int err;
+
+    flow = kzalloc(sizeof(*flow), GFP_KERNEL);
+    if (!flow)
+        return -ENOMEM;
+
+    err = sketh_ft_parse(adapter, f, flow);
+    if (err)
+        goto err_free;
+
+    if (atomic_inc_return(&adapter->ft_count) > adapter->ft_max) {
+        err = -ENOSPC;
+        goto err_count;
+    }
+
+    flow->cookie = f->cookie;
+    flow->lastused = jiffies;
+    atomic64_set(&flow->packets, 0);
+    atomic64_set(&flow->bytes, 0);
+
+    err = rhashtable_lookup_insert_fast(&adapter->ft_cookies,
+                                        &flow->cookie_node,
+                                        sketh_ft_cookie_params);
+    if (err)
+        goto err_count;
+
+    err = rhashtable_lookup_insert_fast(&adapter->ft_tuples,
+                                        &flow->tuple_node,
+                                        sketh_ft_tuple_params);
+    if (err)
+        goto err_cookie;
+
+    dev_hold(flow->out_dev);
+
+    return 0;
+
+err_cookie:
+    rhashtable_remove_fast(&adapter->ft_cookies, &flow->cookie_node,
+                           sketh_ft_cookie_params);
+err_count:
+    atomic_dec(&adapter->ft_count);
+err_free:
+    kfree(flow);
+    return err;
+}
+
+static void
+sketh_ft_free(struct sketh_adapter *adapter, struct sketh_ft_flow *flow)
+{
+    rhashtable_remove_fast(&adapter->ft_tuples, &flow->tuple_node,
+                           sketh_ft_tuple_params);
+    atomic_dec(&adapter->ft_count);
+
+    dev_put(flow->out_dev);
+    kfree_rcu(flow, rcu);
+}
+
+static int
+sketh_ft_del(struct sketh_adapter *adapter, struct flow_cls_offload *f)
+{
+    struct sketh_ft_flow *flow;
+
+    flow = rhashtable_lookup_fast(&adapter->ft_cookies, &f->cookie,
+                                  sketh_ft_cookie_params);
+    if (!flow)
+        return -ENOENT;
+
+    rhashtable_remove_fast(&adapter->ft_cookies, &flow->cookie_node,
+                           sketh_ft_cookie_params);
+    sketh_ft_free(adapter, flow);
+
+    return 0;
+}
+
+static int
+sketh_ft_stats(struct sketh_adapter *adapter, struct flow_cls_offload *f)
+{
+    struct sketh_ft_flow *flow;
+    u64 packets, bytes;
+
+    rcu_read_lock();
+
+    flow = rhashtable_lookup(&adapter->ft_cookies, &f->cookie,
+                             sketh_ft_cookie_params);
+    if (!flow) {
+        rcu_read_unlock();
+        return -ENOENT;
+    }
+
+    /* Report deltas, nf_flow_table refreshes the timeout from lastused */
+    packets = atomic64_xchg(&flow->packets, 0);
+    bytes = atomic64_xchg(&flow->bytes, 0);
+
+    sketh_flow_stats_update(&f->stats, bytes, packets,
+                            READ_ONCE(flow->lastused));
+
+    rcu_read_unlock();
+
+    return 0;
+}
+
+static int
+sketh_setup_ft_cb(enum tc_setup_type type, void *type_data, void *cb_priv)
+{
+    struct sketh_adapter *adapter = cb_priv;
+    struct flow_cls_offload *f = type_data;
+
+    if (type != TC_SETUP_CLSFLOWER)
+        return -EOPNOTSUPP;
+
+    switch (f->command) {
+    case FLOW_CLS_REPLACE:
+        return sketh_ft_add(adapter, f);
+    case FLOW_CLS_DESTROY:
+        return sketh_ft_del(adapter, f);
+    case FLOW_CLS_STATS:
+        return sketh_ft_stats(adapter, f);
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+/* Queue pairs are split evenly between the classes, the rest go unused */
+static void
+sketh_set_tc_queues(struct sketh_adapter *adapter)
+{
+    struct net_device *netdev = adapter->netdev;
+    int num_tc = netdev_get_num_tc(netdev);
+    int per_tc, tc, p;
+
+    if (!num_tc)
+        return;
+
+    per_tc = adapter->num_queues / num_tc;
+
+    for (tc = 0; tc < num_tc; tc++)
+        netdev_set_tc_queue(netdev, tc, per_tc, tc * per_tc);
+
+    for (p = 0; p < SKETH_MAX_TC; p++)
+        netdev_set_prio_tc_map(netdev, p, adapter->prio_tc[p]);
+}
+
+static void
+sketh_apply_num_tc(struct sketh_adapter *adapter, u8 num_tc, const u8 *prio_tc)
+{
+    struct net_device *netdev = adapter->netdev;
+
+    memcpy(adapter->prio_tc, prio_tc, sizeof(adapter->prio_tc));
+
+    if (num_tc) {
+        netdev_set_num_tc(netdev, num_tc);
+        sketh_set_tc_queues(adapter);
+    } else {
+        netdev_reset_tc(netdev);
+    }
+}
+
+/* prio_tc must already be checked against num_tc */
+static int
+sketh_setup_num_tc(struct sketh_adapter *adapter, u8 num_tc, const u8 *prio_tc)
+{
+    struct net_device *netdev = adapter->netdev;
+    u8 old_num_tc = netdev_get_num_tc(netdev);
+    u8 old_prio_tc[SKETH_MAX_TC];
+    int err;
+
+    if (num_tc > SKETH_MAX_TC || num_tc > adapter->num_queues)
+        return -EINVAL;
+
+    if (!netif_running(netdev)) {
+        sketh_apply_num_tc(adapter, num_tc, prio_tc);
+        return 0;
+    }
+
+    memcpy(old_prio_tc, adapter->prio_tc, sizeof(old_prio_tc));
+
+    /* TXDCTL carries the class, rings pick up the new one on open */
+    sketh_stop(netdev);
+    sketh_apply_num_tc(adapter, num_tc, prio_tc);
+
+    err = sketh_open(netdev);
+    if (!err)
+        return 0;
+
+    sketh_err(adapter, "Unable to set up %u traffic classes, keeping %u\n",
+              num_tc, old_num_tc);
+    sketh_apply_num_tc(adapter, old_num_tc, old_prio_tc);
+
+    if (sketh_open(netdev))
+        sketh_err(adapter, "Unable to reopen the interface\n");
+
+    return err;
+}
+
+/* mqprio "hw 1": the driver lays out the queues, the qdisc sets the map */
+static int
+sketh_setup_mqprio(struct sketh_adapter *adapter, struct tc_mqprio_qopt *mqprio)
+{
+    u8 prio_tc[SKETH_MAX_TC] = {};
+    int err, i;
+
+    for (i = 0; mqprio->num_tc && i < SKETH_MAX_TC; i++) {
+        if (mqprio->prio_tc_map[i] >= mqprio->num_tc)
+            return -EINVAL;
+
+        prio_tc[i] = mqprio->prio_tc_map[i];
+    }
+
+    err = sketh_setup_num_tc(adapter, mqprio->num_tc, prio_tc);
+    if (err)
+        return err;
+
+    mqprio->hw = TC_MQPRIO_HW_OFFLOAD_TCS;
+
+    return 0;
+}
+
+int
+sketh_setup_tc(struct net_device *netdev, enum tc_setup_type type,
+               void *type_data)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+
+    switch (type) {
+    case TC_SETUP_QDISC_MQPRIO:
+        return sketh_setup_mqprio(adapter, type_data);
+    case TC_SETUP_FT:
+        if (!adapter->hw_accel)
+            return -EOPNOTSUPP;
+
+        return flow_block_cb_setup_simple(type_data, &sketh_block_cb_list,
+                                          sketh_setup_ft_cb, adapter,
+                                          adapter, false);
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+int
+sketh_hw_offload_enable(struct sketh_adapter *adapter)
+{
+    adapter->hw_accel = 1;
+    return 0;
+}
+
+int
+sketh_hw_offload_disable(struct sketh_adapter *adapter)
+{
+    /* Flows belong to nf_flow_table, it has to take them down first */
+    if (atomic_read(&adapter->ft_count))
+        return -EBUSY;
+
+    adapter->hw_accel = 0;
+    return 0;
+}
+
+int
+sketh_hw_flow_table_create(struct sketh_adapter *adapter, unsigned int size)
+{
+    int err;
+
+    err = rhashtable_init(&adapter->ft_tuples, &sketh_ft_tuple_params);
+    if (err)
+        return err;
+
+    err = rhashtable_init(&adapter->ft_cookies, &sketh_ft_cookie_params);
+    if (err) {
+        rhashtable_destroy(&adapter->ft_tuples);
+        return err;
+    }
+
+    atomic_set(&adapter->ft_count, 0);
+    adapter->ft_max = size;
+    adapter->ft_created = true;
+
+    return 0;
+}
+
+static void
+sketh_ft_free_fn(void *ptr, void *arg)
+{
+    struct sketh_ft_flow *flow = ptr;
+
+    dev_put(flow->out_dev);
+    kfree(flow);
+}
+
+int
+sketh_hw_flow_table_destroy(struct sketh_adapter *adapter)
+{
+    if (!adapter->ft_created)
+        return 0;
+
+    /* Both tables index the same flows, free them through one */
+    rhashtable_destroy(&adapter->ft_tuples);
+    rhashtable_free_and_destroy(&adapter->ft_cookies, sketh_ft_free_fn, NULL);
+
+    atomic_set(&adapter->ft_count, 0);
+    adapter->ft_created = false;
+
+    return 0;
+}
+
+static unsigned int
+sketh_nf_in(void *priv,
+            struct sk_buff *skb,
+            const struct nf_hook_state *state)
+{
+    struct sketh_adapter *adapter;
+    struct sketh_offload_info offload_info;
+    struct nf_conn *ct;
+    enum ip_conntrack_info ctinfo;
+    int ret;
+
+    if (!priv)
+        return NF_ACCEPT;
+
+    adapter = (struct sketh_adapter *)priv;
+
+    ct = nf_ct_get(skb, &ctinfo);
+    if (!ct)
+        return NF_ACCEPT;
+
+    if (!test_bit(IPS_OFFLOAD_BIT, &ct->status))
+        return NF_ACCEPT;
+
+    memset(&offload_info, 0, sizeof(offload_info));
+    offload_info.conn = ct;
+    offload_info.ctinfo = ctinfo;
+    offload_info.indev = state->in;
+    offload_info.outdev = state->out;
+
+    /* Only a packet the fast path has transmitted may be stolen */
+    ret = sketh_netfilter_offload(adapter, skb, &offload_info);
+
+    return ret == 0 ? NF_STOLEN : NF_ACCEPT;
+}
+
+/* One hook per adapter, priv tells the fast path whose flow table to use */
+int
+sketh_register_netfilter(struct sketh_adapter *adapter)
+{
+    struct nf_hook_ops *ops = &adapter->nf_hook_ops;
+    int err;
+
+    ops->hook     = sketh_nf_in;
+    ops->pf       = NFPROTO_INET;
+    ops->hooknum  = NF_INET_FORWARD;
+    ops->priority = NF_IP_PRI_FIRST;
+    ops->priv     = adapter;
+
+    err = nf_register_net_hook(&init_net, ops);
+    if (err)
+        ops->priv = NULL;
+
+    return err;
+}
+
+void
+sketh_unregister_netfilter(struct sketh_adapter *adapter)
+{
+    /* Registration may have failed, the probe only warned about it */
+    if (!adapter->nf_hook_ops.priv)
+        return;
+
+    nf_unregister_net_hook(&init_net, &adapter->nf_hook_ops);
+    adapter->nf_hook_ops.priv = NULL;
+}
+
+irqreturn_t
+sketh_msix_ring(int irq, void *data)
+{
+    struct sketh_ring *ring = (struct sketh_ring *)data;
+
+    ring->irqs++;
+
+    /* Unmasked again by the poll once it has caught up */
+    sketh_disable_irq(ring);
+    napi_schedule(&ring->napi);
+
+    return IRQ_HANDLED;
+}
+
+static void
+sketh_handle_mbx(struct sketh_adapter *adapter)
+{
+    adapter->mbx_irqs++;
+}
+
+irqreturn_t
+sketh_msix_mbx(int irq, void *data)
+{
+    struct sketh_adapter *adapter = (struct sketh_adapter *)data;
+    u32 eicr;
+
+    /*
+     * Reading EICR would also clear queue causes latched while NAPI has
+     * them masked, and their EIMS unmask would then find nothing pending.
+     * Acknowledge only the causes routed to this vector.
+     */
+    eicr = sketh_rd32(adapter, SKETH_REG_EICS) &
+           (SKETH_EICR_MBX | SKETH_EICR_PFC);
+    sketh_wr32(adapter, SKETH_REG_EICR, eicr);
+
+    if (eicr & SKETH_EICR_MBX)
+        sketh_handle_mbx(adapter);
+
+    if (eicr & SKETH_EICR_PFC)
+        sketh_update_pfc_xoff(adapter);
+
+    return IRQ_HANDLED;
+}
+
+/* MSI and INTx: queue pair 0 and the mailbox share one, maybe shared, line */
+irqreturn_t
+sketh_intr(int irq, void *data)
+{
+    struct sketh_adapter *adapter = (struct sketh_adapter *)data;
+    struct sketh_ring *rx_ring = &adapter->rx_ring[0];
+    u32 eicr = sketh_rd32(adapter, SKETH_REG_EICR);
+
+    if (!eicr)
+        return IRQ_NONE;
+
+    if (eicr & SKETH_EICR_MBX)
+        sketh_handle_mbx(adapter);
+
+    if (eicr & SKETH_EICR_PFC)
+        sketh_update_pfc_xoff(adapter);
+
+    if (eicr & SKETH_EICR_QUEUE(0)) {
+        rx_ring->irqs++;
+        sketh_disable_irq(rx_ring);
+        napi_schedule(&rx_ring->napi);
+    }
+
+    return IRQ_HANDLED;
+}
+
+/* The sim calls in from hard IRQ context with a vector index, not an IRQ */
+static void
+sketh_sim_irq(void *ctx, unsigned int vector)
+{
+    struct sketh_adapter *adapter = (struct sketh_adapter *)ctx;
+
+    if (vector == adapter->mbx_vector)
+        sketh_msix_mbx(0, adapter);
+    else if (vector < adapter->num_queues)
+        sketh_msix_ring(0, &adapter->rx_ring[vector]);
+}
+
+static int
+sketh_request_single_irq(struct sketh_adapter *adapter)
+{
+    struct net_device *netdev = adapter->netdev;
+    int err;
+
+    irq_set_affinity_hint(adapter->msix_entries[0].vector,
+                          &adapter->rx_ring[0].affinity_mask);
+
+    err = request_irq(adapter->msix_entries[0].vector, sketh_intr,
+                      adapter->pci_dev->msi_enabled ? 0 : IRQF_SHARED,
+                      netdev->name, adapter);
+    if (err) {
+        irq_set_affinity_hint(adapter->msix_entries[0].vector, NULL);
+        sketh_err(adapter, "Request_irq failed for the %s interrupt\n",
+                  adapter->pci_dev->msi_enabled ? "MSI" : "INTx");
+    }
+
+    return err;
+}
+
+#ifdef CONFIG_RFS_ACCEL
+/*
+ * Sim vectors are no IRQs and have no affinity notifier to keep a map
+ * current, build it once from the affinity sketh_open() gave the queues.
+ */
+static void
+sketh_sim_alloc_rmap(struct sketh_adapter *adapter)
+{
+    struct cpu_rmap *rmap;
+    int i;
+
+    rmap = alloc_cpu_rmap(adapter->num_queues, GFP_KERNEL);
+    if (!rmap)
+        return;
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
+
+        cpu_rmap_update(rmap, cpu_rmap_add(rmap, rx_ring),
+                        &rx_ring->affinity_mask);
+    }
+
+    adapter->netdev->rx_cpu_rmap = rmap;
+}
+#endif
+
+int
+sketh_request_irqs(struct sketh_adapter *adapter)
+{
+    struct net_device *netdev = adapter->netdev;
+    int i, err;
+
+    if (sketh_is_sim(adapter)) {
+#ifdef CONFIG_RFS_ACCEL
+        sketh_sim_alloc_rmap(adapter);
+#endif
+        adapter->sim->ops->set_irq(adapter->sim->priv, sketh_sim_irq, adapter);
+        return 0;
+    }
+
+    /*
+     * MSI/INTx leaves a single queue pair, there is nothing to steer to,
+     * and without rx_cpu_rmap set_rps_cpu() never calls ndo_rx_flow_steer.
+     */
+    if (!adapter->msix_enabled)
+        return sketh_request_single_irq(adapter);
+
+#ifdef CONFIG_RFS_ACCEL
+    /* aRFS is off without the map, ntuple filters still work */
+    netdev->rx_cpu_rmap = alloc_irq_cpu_rmap(adapter->num_queues);
+#endif
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
+        struct msix_entry *entry = &adapter->msix_entries[i];
+
+        snprintf(rx_ring->irq_name, sizeof(rx_ring->irq_name),
+                 "%s-TxRx-%d", netdev->name, i);
+
+        err = request_irq(entry->vector,
+                         sketh_msix_ring,
+                         0,
+                         rx_ring->irq_name,
+                         rx_ring);
+
+        if (err) {
+            sketh_err(adapter, "Request_irq failed for vector %d\n", i);
+            goto err_free_irq;
+        }
+
+        irq_set_affinity_hint(entry->vector, &rx_ring->affinity_mask);
+
+#ifdef CONFIG_RFS_ACCEL
+        if (netdev->rx_cpu_rmap)
+            irq_cpu_rmap_add(netdev->rx_cpu_rmap, entry->vector);
+#endif
+    }
+
+    err = request_irq(adapter->mbx_vector, sketh_msix_mbx, 0,
+                      netdev->name, adapter);
+    if (err) {
+        sketh_err(adapter, "Request_irq failed for the mailbox vector\n");
+        goto err_free_irq;
+    }
+
+    return 0;
+
+err_free_irq:
+#ifdef CONFIG_RFS_ACCEL
+    free_irq_cpu_rmap(netdev->rx_cpu_rmap);
+    netdev->rx_cpu_rmap = NULL;
+#endif
+
+    while (i--) {
+        struct msix_entry *entry = &adapter->msix_entries[i];
+        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
+
+        irq_set_affinity_hint(entry->vector, NULL);
+        free_irq(entry->vector, rx_ring);
+    }
+
+    return err;
+}
+
+void
+sketh_free_irqs(struct sketh_adapter *adapter)
+{
+    int i;
+
+    if (sketh_is_sim(adapter)) {
+        adapter->sim->ops->set_irq(adapter->sim->priv, NULL, NULL);
+#ifdef CONFIG_RFS_ACCEL
+        if (adapter->netdev->rx_cpu_rmap)
+            cpu_rmap_put(adapter->netdev->rx_cpu_rmap);
+        adapter->netdev->rx_cpu_rmap = NULL;
+#endif
+        return;
+    }
+
+    if (!adapter->msix_enabled) {
+        irq_set_affinity_hint(adapter->msix_entries[0].vector, NULL);
+        free_irq(adapter->msix_entries[0].vector, adapter);
+        return;
+    }
+
+#ifdef CONFIG_RFS_ACCEL
+    /* Drops the affinity notifiers, which must happen before free_irq() */
+    free_irq_cpu_rmap(adapter->netdev->rx_cpu_rmap);
+    adapter->netdev->rx_cpu_rmap = NULL;
+#endif
+
+    free_irq(adapter->mbx_vector, adapter);
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        struct msix_entry *entry = &adapter->msix_entries[i];
+
+        irq_set_affinity_hint(entry->vector, NULL);
+        free_irq(entry->vector, &adapter->rx_ring[i]);
+    }
+}
+
+/*
+ * One vector per queue pair plus the mailbox. A device granting fewer
+ * MSI-X vectors gets fewer queue pairs, one without MSI-X falls back to a
+ * single queue pair on MSI or INTx.
+ */
+static int
+sketh_init_interrupts(struct sketh_adapter *adapter)
+{
+    struct pci_dev *pdev = adapter->pci_dev;
+    int nvec, i;
+
+    adapter->msix_entries = vzalloc(sizeof(struct msix_entry) *
+                                    SKETH_MAX_NUM_QUEUES);
+    if (!adapter->msix_entries)
+        return -ENOMEM;
+
+    nvec = pci_alloc_irq_vectors(pdev, 1 + SKETH_NON_Q_VECTORS,
+                                 SKETH_MAX_NUM_QUEUES + SKETH_NON_Q_VECTORS,
+                                 PCI_IRQ_MSIX);
+    if (nvec > 0) {
+        adapter->msix_enabled = true;
+        adapter->max_queues = nvec - SKETH_NON_Q_VECTORS;
+
+        for (i = 0; i < adapter->max_queues; i++) {
+            adapter->msix_entries[i].entry = i;
+            adapter->msix_entries[i].vector = pci_irq_vector(pdev, i);
+        }
+
+        adapter->mbx_vector = pci_irq_vector(pdev, adapter->max_queues);
+    } else {
+        nvec = pci_alloc_irq_vectors(pdev, 1, 1, PCI_IRQ_MSI | PCI_IRQ_INTX);
+        if (nvec < 0) {
+            vfree(adapter->msix_entries);
+            adapter->msix_entries = NULL;
+            return nvec;
+        }
+
+        adapter->msix_enabled = false;
+        adapter->max_queues = 1;
+        adapter->msix_entries[0].vector = pci_irq_vector(pdev, 0);
+    }
+
+    adapter->num_queues = clamp_t(int, num_queues, 1, adapter->max_queues);
+    if (adapter->num_queues < num_queues)
+        sketh_info(adapter, "%s: using %d queue pairs\n",
+                   adapter->msix_enabled ? "MSI-X" :
+                   pdev->msi_enabled ? "MSI" : "INTx",
+                   adapter->num_queues);
+
+    return 0;
+}
+
+static void
+sketh_clear_interrupts(struct sketh_adapter *adapter)
+{
+    if (!sketh_is_sim(adapter))
+        pci_free_irq_vectors(adapter->pci_dev);
+
+    vfree(adapter->msix_entries);
+    adapter->msix_entries = NULL;
+    adapter->msix_enabled = false;
+}
+
+static void
+sketh_fetch_rx_stats(struct sketh_ring *rx_ring,
+                     struct sketh_rx_queue_stats *rx_stats)
+{
+    unsigned int start;
+
+    do {
+        start = u64_stats_fetch_begin(&rx_ring->syncp);
+        *rx_stats = rx_ring->rx_stats;
+    } while (u64_stats_fetch_retry(&rx_ring->syncp, start));
+}
+
+static void
+sketh_fetch_tx_stats(struct sketh_ring *tx_ring,
+                     struct sketh_tx_queue_stats *tx_stats,
+                     struct sketh_xmit_queue_stats *xmit_stats)
+{
+    unsigned int start;
+
+    do {
+        start = u64_stats_fetch_begin(&tx_ring->syncp);
+        *tx_stats = tx_ring->tx_stats;
+    } while (u64_stats_fetch_retry(&tx_ring->syncp, start));
+
+    do {
+        start = u64_stats_fetch_begin(&tx_ring->xmit_syncp);
+        *xmit_stats = tx_ring->xmit_stats;
+    } while (u64_stats_fetch_retry(&tx_ring->xmit_syncp, start));
+}
+
+static void
+sketh_get_stats64(struct net_device *netdev,
+                  struct rtnl_link_stats64 *stats)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    struct sketh_xmit_queue_stats xmit_stats;
+    struct sketh_tx_queue_stats tx_stats;
+    struct sketh_rx_queue_stats rx_stats;
+    int i;
+
+    /*
+     * Rings live from probe to remove and their counters survive down/up
+     * and ethtool -L, so idle queues still count towards the totals.
+     */
+    for (i = 0; i < adapter->max_queues; i++) {
+        sketh_fetch_rx_stats(&adapter->rx_ring[i], &rx_stats);
+
+        stats->rx_packets += rx_stats.packets;
+        stats->rx_bytes += rx_stats.bytes;
+        stats->rx_dropped += rx_stats.drops;
+
+        sketh_fetch_tx_stats(&adapter->tx_ring[i], &tx_stats, &xmit_stats);
+
+        stats->tx_packets += tx_stats.packets;
+        stats->tx_bytes += tx_stats.bytes;
+        stats->tx_dropped += xmit_stats.dropped;
+
+        /* XDP_TX and ndo_xdp_xmit leave through the same port */
+        sketh_fetch_tx_stats(&adapter->xdp_ring[i], &tx_stats, &xmit_stats);
+
+        stats->tx_packets += tx_stats.packets;
+        stats->tx_bytes += tx_stats.bytes;
+    }
+}
+
+static netdev_features_t
+sketh_features_check(struct sk_buff *skb, struct net_device *netdev,
+                     netdev_features_t features)
+{
+    features = vlan_features_check(skb, features);
+
+    /* Only Ethernet-over-UDP tunnels (VXLAN, GENEVE) can be offloaded */
+    return vxlan_features_check(skb, features);
+}
+
+static const struct net_device_ops sketh_netdev_ops = {
+    .ndo_open            = sketh_open,
+    .ndo_stop            = sketh_stop,
+    .ndo_start_xmit      = sketh_start_xmit,
+    .ndo_set_rx_mode     = sketh_set_rx_mode,
+    .ndo_set_mac_address = sketh_set_mac_address,
+    .ndo_change_mtu      = sketh_change_mtu,
+    .ndo_tx_timeout      = sketh_tx_timeout,
+    .ndo_get_stats64     = sketh_get_stats64,
+    .ndo_validate_addr   = eth_validate_addr,
+    .ndo_set_features    = sketh_set_features,
+    .ndo_features_check  = sketh_features_check,
+    .ndo_bpf             = sketh_bpf,
+    .ndo_xdp_xmit        = sketh_xdp_xmit,
+    .ndo_xsk_wakeup      = sketh_xsk_wakeup,
+#ifdef CONFIG_RFS_ACCEL
+    .ndo_rx_flow_steer   = sketh_rx_flow_steer,
+#endif
+    .ndo_setup_tc        = sketh_setup_tc,
+};
+
+static void
+sketh_get_drvinfo(struct net_device *netdev,
+                  struct ethtool_drvinfo *drvinfo)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+
+    strlcpy(drvinfo->driver, SKETH_DRIVER_NAME, sizeof(drvinfo->driver));
+    strlcpy(drvinfo->version, SKETH_DRIVER_VERSION, sizeof(drvinfo->version));
+    strlcpy(drvinfo->bus_info, dev_name(adapter->dev),
+            sizeof(drvinfo->bus_info));
+}
+
+static u32
+sketh_get_link(struct net_device *netdev)
+{
+    return 1;
+}
+
+struct sketh_stats {
+    char stat_string[ETH_GSTRING_LEN];
+    int stat_offset;
+};
+
+#define SKETH_STAT(_name, _stat) {                          \
+    .stat_string = _name,                                   \
+    .stat_offset = offsetof(struct sketh_adapter, _stat)    \
+}
+
+static const struct sketh_stats sketh_gstrings_stats[] = {
+    SKETH_STAT("tx_timeout_count", tx_timeout_count),
+    SKETH_STAT("queue_resets", queue_resets),
+    SKETH_STAT("tx_linearize", tx_linearize),
+    SKETH_STAT("mbx_irqs", mbx_irqs),
+};
+
+#define SKETH_GLOBAL_STATS_LEN ARRAY_SIZE(sketh_gstrings_stats)
+
+static const char sketh_gstrings_tx_queue_stats[][ETH_GSTRING_LEN] = {
+    "tx_queue_%u_packets",
+    "tx_queue_%u_bytes",
+    "tx_queue_%u_restart",
+    "tx_queue_%u_stop",
+    "tx_queue_%u_busy",
+    "tx_queue_%u_doorbell",
+    "tx_queue_%u_xmit_more",
+    "tx_queue_%u_dropped",
+    "tx_queue_%u_xdp_packets",
+    "tx_queue_%u_xdp_bytes",
+};
+
+static const char sketh_gstrings_rx_queue_stats[][ETH_GSTRING_LEN] = {
+    "rx_queue_%u_packets",
+    "rx_queue_%u_bytes",
+    "rx_queue_%u_drops",
+    "rx_queue_%u_alloc_failed",
+    "rx_queue_%u_polls",
+    "rx_queue_%u_xdp_pass",
+    "rx_queue_%u_xdp_tx",
+    "rx_queue_%u_xdp_drops",
+    "rx_queue_%u_xdp_redirect",
+    "rx_queue_%u_ft_forward",
+    "rx_queue_%u_hw_gro_packets",
+    "rx_queue_%u_hw_gro_segs",
+    "rx_queue_%u_busy_polls",
+    "rx_queue_%u_busy_poll_packets",
+    "rx_queue_%u_hdr_split",
+    "rx_queue_%u_hdr_nosplit",
+    "rx_queue_%u_irqs",
+    "rx_queue_%u_irqs_per_sec",
+};
+
+/* Per 802.1p priority, whether or not PFC is enabled for it */
+static const char sketh_gstrings_pfc_stats[][ETH_GSTRING_LEN] = {
+    "rx_prio_%u_xoff",
+    "rx_prio_%u_xon",
+    "tx_prio_%u_xoff",
+    "tx_prio_%u_xon",
+};
+
+#define SKETH_TX_QUEUE_STATS_LEN ARRAY_SIZE(sketh_gstrings_tx_queue_stats)
+#define SKETH_RX_QUEUE_STATS_LEN ARRAY_SIZE(sketh_gstrings_rx_queue_stats)
+#define SKETH_PFC_STATS_LEN      ARRAY_SIZE(sketh_gstrings_pfc_stats)
+
+/* Bit n of priv_flags is string n */
+static const char sketh_priv_flags_strings[][ETH_GSTRING_LEN] = {
+    "rx-header-split",
+};
+
+#define SKETH_PRIV_FLAGS_LEN ARRAY_SIZE(sketh_priv_flags_strings)
+
+static int
+sketh_get_sset_count(struct net_device *netdev, int sset)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    int count;
+
+    switch (sset) {
+    case ETH_SS_STATS:
+        count = SKETH_GLOBAL_STATS_LEN;
+        count += adapter->num_queues * SKETH_TX_QUEUE_STATS_LEN;
+        count += adapter->num_queues * SKETH_RX_QUEUE_STATS_LEN;
+        count += SKETH_MAX_TC * SKETH_PFC_STATS_LEN;
+#ifdef CONFIG_PAGE_POOL_STATS
+        count += page_pool_ethtool_stats_get_count();
+#endif
+        return count;
+    case ETH_SS_PRIV_FLAGS:
+        return SKETH_PRIV_FLAGS_LEN;
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+static void
+sketh_get_strings(struct net_device *netdev, u32 stringset, u8 *data)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    int i, j;
+
+    if (stringset == ETH_SS_PRIV_FLAGS) {
+        memcpy(data, sketh_priv_flags_strings,
+               sizeof(sketh_priv_flags_strings));
+        return;
+    }
+
+    if (stringset != ETH_SS_STATS)
+        return;
+
+    for (i = 0; i < SKETH_GLOBAL_STATS_LEN; i++) {
+        memcpy(data, sketh_gstrings_stats[i].stat_string, ETH_GSTRING_LEN);
+        data += ETH_GSTRING_LEN;
+    }
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        for (j = 0; j < SKETH_TX_QUEUE_STATS_LEN; j++)
+            ethtool_sprintf(&data, sketh_gstrings_tx_queue_stats[j], i);
+    }
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        for (j = 0; j < SKETH_RX_QUEUE_STATS_LEN; j++)
+            ethtool_sprintf(&data, sketh_gstrings_rx_queue_stats[j], i);
+    }
+
+    for (i = 0; i < SKETH_MAX_TC; i++) {
+        for (j = 0; j < SKETH_PFC_STATS_LEN; j++)
+            ethtool_sprintf(&data, sketh_gstrings_pfc_stats[j], i);
+    }
+
+#ifdef CONFIG_PAGE_POOL_STATS
+    page_pool_ethtool_stats_get_strings(data);
+#endif
+}
+
+static void
+sketh_update_irq_rate(struct sketh_ring *rx_ring)
+{
+    unsigned long now = jiffies;
+    unsigned long elapsed = now - rx_ring->irq_stamp;
+    u64 irqs = READ_ONCE(rx_ring->irqs);
+
+    /* Keep the previous rate for reads less than a second apart */
+    if (elapsed < HZ)
+        return;
+
+    rx_ring->irq_rate = div64_u64((irqs - rx_ring->irq_last) * HZ,
+                                           elapsed);
+    rx_ring->irq_last = irqs;
+    rx_ring->irq_stamp = now;
+}
+
+static void
+sketh_get_ethtool_stats(struct net_device *netdev,
+                        struct ethtool_stats *stats, u64 *data)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+#ifdef CONFIG_PAGE_POOL_STATS
+    struct page_pool_stats pp_stats = {};
+#endif
+    int i;
+
+    for (i = 0; i < SKETH_GLOBAL_STATS_LEN; i++) {
+        char *p = (char *)adapter + sketh_gstrings_stats[i].stat_offset;
+
+        *data++ = *(u64 *)p;
+    }
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        struct sketh_xmit_queue_stats xmit_stats, xdp_xmit_stats;
+        struct sketh_tx_queue_stats tx_stats, xdp_stats;
+
+        sketh_fetch_tx_stats(&adapter->tx_ring[i], &tx_stats, &xmit_stats);
+        sketh_fetch_tx_stats(&adapter->xdp_ring[i], &xdp_stats,
+                             &xdp_xmit_stats);
+
+        *data++ = tx_stats.packets;
+        *data++ = tx_stats.bytes;
+        *data++ = tx_stats.restart_queue + xmit_stats.restart_queue;
+        *data++ = xmit_stats.stop_queue;
+        *data++ = xmit_stats.tx_busy;
+        *data++ = xmit_stats.doorbell;
+        *data++ = xmit_stats.xmit_more;
+        *data++ = xmit_stats.dropped;
+        *data++ = xdp_stats.packets;
+        *data++ = xdp_stats.bytes;
+    }
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
+        struct sketh_rx_queue_stats rx_stats;
+
+        sketh_fetch_rx_stats(rx_ring, &rx_stats);
+        sketh_update_irq_rate(rx_ring);
+
+        *data++ = rx_stats.packets;
+        *data++ = rx_stats.bytes;
+        *data++ = rx_stats.drops;
+        *data++ = rx_stats.alloc_failed;
+        *data++ = rx_stats.polls;
+        *data++ = rx_stats.xdp_pass;
+        *data++ = rx_stats.xdp_tx;
+        *data++ = rx_stats.xdp_drops;
+        *data++ = rx_stats.xdp_redirect;
+        *data++ = rx_stats.ft_forward;
+        *data++ = rx_stats.hw_gro_packets;
+        *data++ = rx_stats.hw_gro_segs;
+        *data++ = rx_stats.busy_polls;
+        *data++ = rx_stats.busy_poll_packets;
+        *data++ = rx_stats.hdr_split;
+        *data++ = rx_stats.hdr_nosplit;
+        *data++ = READ_ONCE(rx_ring->irqs);
+        *data++ = rx_ring->irq_rate;
+    }
+
+    sketh_update_pfc_stats(adapter);
+
+    spin_lock_bh(&adapter->pfc_stats_lock);
+    for (i = 0; i < SKETH_MAX_TC; i++) {
+        *data++ = adapter->pfc_stats.rx_xoff[i];
+        *data++ = adapter->pfc_stats.rx_xon[i];
+        *data++ = adapter->pfc_stats.tx_xoff[i];
+        *data++ = adapter->pfc_stats.tx_xon[i];
+    }
+    spin_unlock_bh(&adapter->pfc_stats_lock);
+
+#ifdef CONFIG_PAGE_POOL_STATS
+    /* Pools only exist while the interface is up */
+    for (i = 0; i < adapter->num_queues; i++) {
+        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
+
+        if (rx_ring->page_pool)
+            page_pool_get_stats(rx_ring->page_pool, &pp_stats);
+    }
+
+    page_pool_ethtool_stats_get(data, &pp_stats);
+#endif
+}
+
+#ifdef HAVE_ETHTOOL_COALESCE_EXTACK
+static int
+sketh_get_coalesce(struct net_device *netdev, struct ethtool_coalesce *ec,
+                   struct kernel_ethtool_coalesce *kernel_coal,
+                   struct netlink_ext_ack *extack)
+#else
+static int
+sketh_get_coalesce(struct net_device *netdev, struct ethtool_coalesce *ec)
+#endif
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+
+    ec->rx_coalesce_usecs = adapter->rx_itr_usecs;
+    ec->rx_max_coalesced_frames = adapter->rx_itr_frames;
+    ec->tx_coalesce_usecs = adapter->tx_itr_usecs;
+    ec->tx_max_coalesced_frames = adapter->tx_itr_frames;
+    ec->use_adaptive_rx_coalesce = adapter->rx_dim_enabled;
+    ec->use_adaptive_tx_coalesce = adapter->tx_dim_enabled;
+
+    return 0;
+}
+
+#ifdef HAVE_ETHTOOL_COALESCE_EXTACK
+static int
+sketh_set_coalesce(struct net_device *netdev, struct ethtool_coalesce *ec,
+                   struct kernel_ethtool_coalesce *kernel_coal,
+                   struct netlink_ext_ack *extack)
+#else
+static int
+sketh_set_coalesce(struct net_device *netdev, struct ethtool_coalesce *ec)
+#endif
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    int i;
+
+    if (ec->rx_coalesce_usecs > SKETH_ITR_USECS_MAX ||
+        ec->tx_coalesce_usecs > SKETH_ITR_USECS_MAX ||
+        ec->rx_max_coalesced_frames > SKETH_ITR_FRAMES_MAX ||
+        ec->tx_max_coalesced_frames > SKETH_ITR_FRAMES_MAX)
+        return -EINVAL;
+
+    adapter->rx_itr_usecs = ec->rx_coalesce_usecs;
+    adapter->rx_itr_frames = ec->rx_max_coalesced_frames;
+    adapter->tx_itr_usecs = ec->tx_coalesce_usecs;
+    adapter->tx_itr_frames = ec->tx_max_coalesced_frames;
+    adapter->rx_dim_enabled = !!ec->use_adaptive_rx_coalesce;
+    adapter->tx_dim_enabled = !!ec->use_adaptive_tx_coalesce;
+
+    /* Rings and their DIM works only exist while the interface is up */
+    if (test_bit(__SKETH_STATE_DOWN, &adapter->state))
+        return 0;
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
+        struct sketh_ring *tx_ring = &adapter->tx_ring[i];
+
+        /* A pending DIM update must not overwrite the static value */
+        if (!adapter->rx_dim_enabled)
+            cancel_work_sync(&rx_ring->dim.work);
+        if (!adapter->tx_dim_enabled)
+            cancel_work_sync(&tx_ring->dim.work);
+    }
+
+    sketh_configure_itr(adapter);
+
+    return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+static void
+sketh_get_ringparam(struct net_device *netdev, struct ethtool_ringparam *ring,
+                    struct kernel_ethtool_ringparam *kernel_ring,
+                    struct netlink_ext_ack *extack)
+#else
+static void
+sketh_get_ringparam(struct net_device *netdev, struct ethtool_ringparam *ring)
+#endif
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+
+    ring->rx_max_pending = SKETH_RX_MAX_DESC;
+    ring->tx_max_pending = SKETH_TX_MAX_DESC;
+    ring->rx_pending = adapter->rx_ring_count;
+    ring->tx_pending = adapter->tx_ring_count;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+static int
+sketh_set_ringparam(struct net_device *netdev, struct ethtool_ringparam *ring,
+                    struct kernel_ethtool_ringparam *kernel_ring,
+                    struct netlink_ext_ack *extack)
+#else
+static int
+sketh_set_ringparam(struct net_device *netdev, struct ethtool_ringparam *ring)
+#endif
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    u16 old_tx = adapter->tx_ring_count;
+    u16 old_rx = adapter->rx_ring_count;
+    u32 tx_count, rx_count;
+    int err;
+
+    if (ring->rx_mini_pending || ring->rx_jumbo_pending)
+        return -EINVAL;
+
+    tx_count = clamp_t(u32, ring->tx_pending, SKETH_TX_MIN_DESC,
+                       SKETH_TX_MAX_DESC);
+    tx_count = ALIGN(tx_count, SKETH_REQ_DESC_MULTIPLE);
+
+    rx_count = clamp_t(u32, ring->rx_pending, SKETH_MIN_DESC,
+                       SKETH_RX_MAX_DESC);
+    rx_count = ALIGN(rx_count, SKETH_REQ_DESC_MULTIPLE);
+
+    if (tx_count == old_tx && rx_count == old_rx)
+        return 0;
+
+    /* Rings are freed with the size they were allocated with */
+    if (netif_running(netdev))
+        sketh_stop(netdev);
+
+    adapter->tx_ring_count = tx_count;
+    adapter->rx_ring_count = rx_count;
+    sketh_set_ring_counts(adapter);
+
+    if (!netif_running(netdev))
+        return 0;
+
+    err = sketh_open(netdev);
+    if (!err)
+        return 0;
+
+    /* Rings of the old size fitted before, bring the interface back on them */
+    sketh_err(adapter, "Unable to resize rings, keeping %u/%u\n",
+              old_rx, old_tx);
+    adapter->tx_ring_count = old_tx;
+    adapter->rx_ring_count = old_rx;
+    sketh_set_ring_counts(adapter);
+
+    if (sketh_open(netdev))
+        sketh_err(adapter, "Unable to reopen the interface\n");
+
+    return err;
+}
+
+static u32
+sketh_get_priv_flags(struct net_device *netdev)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+
+    return adapter->priv_flags;
+}
+
+static int
+sketh_set_priv_flags(struct net_device *netdev, u32 flags)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    u32 old_flags = adapter->priv_flags;
+    u32 changed = flags ^ old_flags;
+    int err;
+
+    if (flags & ~SKETH_PRIV_FLAG_HDR_SPLIT)
+        return -EINVAL;
+
+    /* Buffer sizes and the header block change, as when attaching XDP */
+    if (!(changed & SKETH_PRIV_FLAG_HDR_SPLIT) || !netif_running(netdev)) {
+        adapter->priv_flags = flags;
+        return 0;
+    }
+
+    sketh_stop(netdev);
+    adapter->priv_flags = flags;
+
+    err = sketh_open(netdev);
+    if (!err)
+        return 0;
+
+    sketh_err(adapter, "Unable to apply the private flags, keeping 0x%x\n",
+              old_flags);
+    adapter->priv_flags = old_flags;
+
+    if (sketh_open(netdev))
+        sketh_err(adapter, "Unable to reopen the interface\n");
+
+    return err;
+}
+
+static void
+sketh_get_channels(struct net_device *netdev, struct ethtool_channels *ch)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+
+    ch->max_combined = adapter->max_queues;
+    ch->combined_count = adapter->num_queues;
+}
+
+static int
+sketh_set_channels(struct net_device *netdev, struct ethtool_channels *ch)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    unsigned int count = ch->combined_count;
+    int old_count = adapter->num_queues;
+    int i, err;
+
+    if (!count || ch->rx_count || ch->tx_count || ch->other_count ||
+        count > adapter->max_queues)
+        return -EINVAL;
+
+    if (count == old_count)
+        return 0;
+
+    /* Every traffic class needs a queue of its own */
+    if (count < netdev_get_num_tc(netdev)) {
+        sketh_err(adapter, "%u traffic classes need as many queues\n",
+                  netdev_get_num_tc(netdev));
+        return -EINVAL;
+    }
+
+    /* Queues with a zero-copy socket bound must stay */
+    if (find_next_bit(adapter->af_xdp_zc_qps, adapter->max_queues,
+                      count) < adapter->max_queues) {
+        sketh_err(adapter, "AF_XDP zero-copy socket bound above queue %u\n",
+                  count - 1);
+        return -EBUSY;
+    }
+
+    /* A table the user set is kept, and must not name removed queues */
+    if (netif_is_rxfh_configured(netdev)) {
+        for (i = 0; i < SKETH_RSS_INDIR_SIZE; i++) {
+            if (adapter->rss_indir[i] >= count) {
+                sketh_err(adapter, "RSS table uses queue %u\n",
+                          adapter->rss_indir[i]);
+                return -EINVAL;
+            }
+        }
+    }
+
+    err = sketh_fltr_trim_queues(adapter, count);
+    if (err)
+        return err;
+
+    if (netif_running(netdev))
+        sketh_stop(netdev);
+
+    adapter->num_queues = count;
+    /* Ranges first, the stack drops classes that overrun the queues */
+    sketh_set_tc_queues(adapter);
+    netif_set_real_num_tx_queues(netdev, count);
+    netif_set_real_num_rx_queues(netdev, count);
+
+    /* The stack dropped the XPS maps of the queues above count */
+    for (i = count; i < old_count; i++)
+        adapter->tx_ring[i].xps_set = false;
+
+    if (!netif_is_rxfh_configured(netdev))
+        sketh_init_rss_indir(adapter);
+
+    if (!netif_running(netdev))
+        return 0;
+
+    err = sketh_open(netdev);
+    if (!err)
+        return 0;
+
+    sketh_err(adapter, "Unable to open %u queues, keeping %d\n",
+              count, old_count);
+    adapter->num_queues = old_count;
+    sketh_set_tc_queues(adapter);
+    netif_set_real_num_tx_queues(netdev, old_count);
+    netif_set_real_num_rx_queues(netdev, old_count);
+
+    if (!netif_is_rxfh_configured(netdev))
+        sketh_init_rss_indir(adapter);
+
+    if (sketh_open(netdev))
+        sketh_err(adapter, "Unable to reopen the interface\n");
+
+    return err;
+}
+
+static u32
+sketh_rss_l3_flag(u32 flow_type)
+{
+    switch (flow_type) {
+    case TCP_V4_FLOW:
+    case UDP_V4_FLOW:
+    case SCTP_V4_FLOW:
+    case AH_ESP_V4_FLOW:
+    case IPV4_FLOW:
+        return SKETH_MRQC_IPV4;
+    case TCP_V6_FLOW:
+    case UDP_V6_FLOW:
+    case SCTP_V6_FLOW:
+    case AH_ESP_V6_FLOW:
+    case IPV6_FLOW:
+        return SKETH_MRQC_IPV6;
+    default:
+        return 0;
+    }
+}
+
+static u32
+sketh_rss_l4_flag(u32 flow_type)
+{
+    switch (flow_type) {
+    case TCP_V4_FLOW:
+        return SKETH_MRQC_IPV4_TCP;
+    case UDP_V4_FLOW:
+        return SKETH_MRQC_IPV4_UDP;
+    case TCP_V6_FLOW:
+        return SKETH_MRQC_IPV6_TCP;
+    case UDP_V6_FLOW:
+        return SKETH_MRQC_IPV6_UDP;
+    default:
+        return 0;
+    }
+}
+
+static int
+sketh_get_rss_hash_opts(struct sketh_adapter *adapter, u32 flow_type,
+                        u64 *data)
+{
+    u32 l3 = sketh_rss_l3_flag(flow_type);
+    u32 l4 = sketh_rss_l4_flag(flow_type);
+
+    if (!l3)
+        return -EINVAL;
+
+    *data = 0;
+
+    if (adapter->rss_mrqc & l3)
+        *data |= RXH_IP_SRC | RXH_IP_DST;
+
+    if (adapter->rss_mrqc & l4)
+        *data |= RXH_L4_B_0_1 | RXH_L4_B_2_3;
+
+    return 0;
+}
+
+static int
+sketh_set_rss_hash_opts(struct sketh_adapter *adapter, u32 flow_type,
+                        u64 data)
+{
+    u32 l3 = sketh_rss_l3_flag(flow_type);
+    u32 l4 = sketh_rss_l4_flag(flow_type);
+
+    if (!l3)
+        return -EINVAL;
+
+    /* The address pair is always hashed, ports only for TCP and UDP */
+    if (data == (RXH_IP_SRC | RXH_IP_DST)) {
+        adapter->rss_mrqc &= ~l4;
+    } else if (l4 && data == (RXH_IP_SRC | RXH_IP_DST |
+                              RXH_L4_B_0_1 | RXH_L4_B_2_3)) {
+        adapter->rss_mrqc |= l4;
+    } else {
+        return -EINVAL;
+    }
+
+    sketh_configure_rss(adapter);
+
+    return 0;
+}
+
+/* Each match field is either compared in full or not at all */
+static int
+sketh_fltr_mask(const __be32 *mask, int words, u8 ignore_bit, u8 *ignore)
+{
+    u32 all = ~0u, any = 0;
+    int i;
+
+    for (i = 0; i < words; i++) {
+        all &= (__force u32)mask[i];
+        any |= (__force u32)mask[i];
+    }
+
+    if (!any) {
+        *ignore |= ignore_bit;
+        return 0;
+    }
+
+    return all == ~0u ? 0 : -EINVAL;
+}
+
+static int
+sketh_fltr_port_mask(__be16 mask, u8 ignore_bit, u8 *ignore)
+{
+    if (!mask) {
+        *ignore |= ignore_bit;
+        return 0;
+    }
+
+    return mask == htons(0xffff) ? 0 : -EINVAL;
+}
+
+static int
+sketh_fltr_parse(struct sketh_adapter *adapter,
+                 const struct ethtool_rx_flow_spec *fs,
+                 struct sketh_flow_rule *rule)
+{
+    struct sketh_flow_key *key = &rule->key;
+    const __be32 *src, *dst, *src_mask, *dst_mask;
+    __be16 sport, dport, sport_mask, dport_mask;
+    int words;
+    int err;
+
+    if (fs->ring_cookie == RX_CLS_FLOW_DISC) {
+        rule->drop = true;
+    } else {
+        if (ethtool_get_flow_spec_ring_vf(fs->ring_cookie))
+            return -EINVAL;
+
+        if (ethtool_get_flow_spec_ring(fs->ring_cookie) >= adapter->num_queues)
+            return -EINVAL;
+
+        rule->queue = ethtool_get_flow_spec_ring(fs->ring_cookie);
+    }
+
+    switch (fs->flow_type) {
+    case TCP_V4_FLOW:
+    case UDP_V4_FLOW:
+        if (fs->m_u.tcp_ip4_spec.tos)
+            return -EINVAL;
+
+        src = &fs->h_u.tcp_ip4_spec.ip4src;
+        dst = &fs->h_u.tcp_ip4_spec.ip4dst;
+        src_mask = &fs->m_u.tcp_ip4_spec.ip4src;
+        dst_mask = &fs->m_u.tcp_ip4_spec.ip4dst;
+        sport = fs->h_u.tcp_ip4_spec.psrc;
+        dport = fs->h_u.tcp_ip4_spec.pdst;
+        sport_mask = fs->m_u.tcp_ip4_spec.psrc;
+        dport_mask = fs->m_u.tcp_ip4_spec.pdst;
+        words = 1;
+        break;
+    case TCP_V6_FLOW:
+    case UDP_V6_FLOW:
+        if (fs->m_u.tcp_ip6_spec.tclass)
+            return -EINVAL;
+
+        src = fs->h_u.tcp_ip6_spec.ip6src;
+        dst = fs->h_u.tcp_ip6_spec.ip6dst;
+        src_mask = fs->m_u.tcp_ip6_spec.ip6src;
+        dst_mask = fs->m_u.tcp_ip6_spec.ip6dst;
+        sport = fs->h_u.tcp_ip6_spec.psrc;
+        dport = fs->h_u.tcp_ip6_spec.pdst;
+        sport_mask = fs->m_u.tcp_ip6_spec.psrc;
+        dport_mask = fs->m_u.tcp_ip6_spec.pdst;
+        words = 4;
+        key->ipv6 = 1;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (fs->flow_type == TCP_V4_FLOW || fs->flow_type == TCP_V6_FLOW)
+        key->ip_proto = IPPROTO_TCP;
+    else
+        key->ip_proto = IPPROTO_UDP;
+
+    err = sketh_fltr_mask(src_mask, words, SKETH_FLT_IGNORE_SRC_IP,
+                          &key->ignore);
+    err = err ? : sketh_fltr_mask(dst_mask, words, SKETH_FLT_IGNORE_DST_IP,
+                                  &key->ignore);
+    err = err ? : sketh_fltr_port_mask(sport_mask, SKETH_FLT_IGNORE_SRC_PORT,
+                                       &key->ignore);
+    err = err ? : sketh_fltr_port_mask(dport_mask, SKETH_FLT_IGNORE_DST_PORT,
+                                       &key->ignore);
+    if (err)
+        return err;
+
+    /* Ignored fields stay zero so equal matches hash and compare equal */
+    if (!(key->ignore & SKETH_FLT_IGNORE_SRC_IP))
+        memcpy(key->src_ip, src, words * sizeof(__be32));
+    if (!(key->ignore & SKETH_FLT_IGNORE_DST_IP))
+        memcpy(key->dst_ip, dst, words * sizeof(__be32));
+    if (!(key->ignore & SKETH_FLT_IGNORE_SRC_PORT))
+        key->src_port = sport;
+    if (!(key->ignore & SKETH_FLT_IGNORE_DST_PORT))
+        key->dst_port = dport;
+
+    return 0;
+}
+
+static int
+sketh_add_flow_rule(struct sketh_adapter *adapter, struct ethtool_rxnfc *cmd)
+{
+    struct ethtool_rx_flow_spec *fs = &cmd->fs;
+    struct sketh_flow_rule *rule, *old;
+    int err;
+
+    if (!(adapter->netdev->features & NETIF_F_NTUPLE))
+        return -EOPNOTSUPP;
+
+    if (fs->location != RX_CLS_LOC_ANY && fs->location >= SKETH_FLT_MAX)
+        return -EINVAL;
+
+    rule = kzalloc(sizeof(*rule), GFP_KERNEL);
+    if (!rule)
+        return -ENOMEM;
+
+    err = sketh_fltr_parse(adapter, fs, rule);
+    if (err)
+        goto err_free;
+
+    spin_lock_bh(&adapter->fltr_lock);
+
+    if (fs->location == RX_CLS_LOC_ANY) {
+        err = sketh_fltr_find_free(adapter);
+        if (err < 0)
+            goto err_unlock;
+
+        fs->location = err;
+        err = 0;
+    }
+
+    rule->loc = fs->location;
+
+    /* The same match in a second slot would never be hit */
+    old = sketh_fltr_find(adapter, &rule->key);
+    if (old && old->loc != rule->loc) {
+        if (!old->arfs) {
+            err = -EEXIST;
+            goto err_unlock;
+        }
+
+        sketh_fltr_remove(adapter, old);
+    }
+
+    /* An explicit rule replaces whatever held the slot, aRFS included */
+    old = adapter->fltr_rules[rule->loc];
+    if (old)
+        sketh_fltr_remove(adapter, old);
+
+    sketh_fltr_insert(adapter, rule);
+
+    spin_unlock_bh(&adapter->fltr_lock);
+
+    return 0;
+
+err_unlock:
+    spin_unlock_bh(&adapter->fltr_lock);
+err_free:
+    kfree(rule);
+    return err;
+}
+
+static int
+sketh_del_flow_rule(struct sketh_adapter *adapter, struct ethtool_rxnfc *cmd)
+{
+    struct sketh_flow_rule *rule;
+    int err = 0;
+
+    if (cmd->fs.location >= SKETH_FLT_MAX)
+        return -EINVAL;
+
+    spin_lock_bh(&adapter->fltr_lock);
+
+    rule = adapter->fltr_rules[cmd->fs.location];
+    if (rule && !rule->arfs)
+        sketh_fltr_remove(adapter, rule);
+    else
+        err = -ENOENT;
+
+    spin_unlock_bh(&adapter->fltr_lock);
+
+    return err;
+}
+
+static int
+sketh_get_flow_rule(struct sketh_adapter *adapter, struct ethtool_rxnfc *cmd)
+{
+    struct ethtool_rx_flow_spec *fs = &cmd->fs;
+    const struct sketh_flow_key *key;
+    struct sketh_flow_rule *rule;
+    __be32 *src, *dst, *src_mask, *dst_mask;
+    __be16 *sport, *dport, *sport_mask, *dport_mask;
+    int words;
+    int err = 0;
+
+    if (fs->location >= SKETH_FLT_MAX)
+        return -EINVAL;
+
+    memset(&fs->h_u, 0, sizeof(fs->h_u));
+    memset(&fs->m_u, 0, sizeof(fs->m_u));
+
+    spin_lock_bh(&adapter->fltr_lock);
+
+    rule = adapter->fltr_rules[fs->location];
+    if (!rule || rule->arfs) {
+        err = -ENOENT;
+        goto out;
+    }
+
+    key = &rule->key;
+
+    if (key->ipv6) {
+        fs->flow_type = key->ip_proto == IPPROTO_TCP ? TCP_V6_FLOW : UDP_V6_FLOW;
+        src = fs->h_u.tcp_ip6_spec.ip6src;
+        dst = fs->h_u.tcp_ip6_spec.ip6dst;
+        src_mask = fs->m_u.tcp_ip6_spec.ip6src;
+        dst_mask = fs->m_u.tcp_ip6_spec.ip6dst;
+        sport = &fs->h_u.tcp_ip6_spec.psrc;
+        dport = &fs->h_u.tcp_ip6_spec.pdst;
+        sport_mask = &fs->m_u.tcp_ip6_spec.psrc;
+        dport_mask = &fs->m_u.tcp_ip6_spec.pdst;
+        words = 4;
+    } else {
+        fs->flow_type = key->ip_proto == IPPROTO_TCP ? TCP_V4_FLOW : UDP_V4_FLOW;
+        src = &fs->h_u.tcp_ip4_spec.ip4src;
+        dst = &fs->h_u.tcp_ip4_spec.ip4dst;
+        src_mask = &fs->m_u.tcp_ip4_spec.ip4src;
+        dst_mask = &fs->m_u.tcp_ip4_spec.ip4dst;
+        sport = &fs->h_u.tcp_ip4_spec.psrc;
+        dport = &fs->h_u.tcp_ip4_spec.pdst;
+        sport_mask = &fs->m_u.tcp_ip4_spec.psrc;
+        dport_mask = &fs->m_u.tcp_ip4_spec.pdst;
+        words = 1;
+    }
+
+    if (!(key->ignore & SKETH_FLT_IGNORE_SRC_IP)) {
+        memcpy(src, key->src_ip, words * sizeof(__be32));
+        memset(src_mask, 0xff, words * sizeof(__be32));
+    }
+
+    if (!(key->ignore & SKETH_FLT_IGNORE_DST_IP)) {
+        memcpy(dst, key->dst_ip, words * sizeof(__be32));
+        memset(dst_mask, 0xff, words * sizeof(__be32));
     }
 
-    if (adapter->tx_ring) {
-        vfree(adapter->tx_ring);
-        adapter->tx_ring = NULL;
+    if (!(key->ignore & SKETH_FLT_IGNORE_SRC_PORT)) {
+        *sport = key->src_port;
+        *sport_mask = htons(0xffff);
     }
+
+    if (!(key->ignore & SKETH_FLT_IGNORE_DST_PORT)) {
+        *dport = key->dst_port;
+        *dport_mask = htons(0xffff);
+    }
+
+    fs->ring_cookie = rule->drop ? RX_CLS_FLOW_DISC : rule->queue;
+
+out:
+    spin_unlock_bh(&adapter->fltr_lock);
+
+    return err;
 }
 
-int
-sketh_xdp_setup_prog(struct sketh_adapter *adapter, struct bpf_prog *prog)
+static int
+sketh_get_flow_rule_locs(struct sketh_adapter *adapter,
+                         struct ethtool_rxnfc *cmd, u32 *rule_locs)
 {
-    struct bpf_prog *old_prog;
+    unsigned int cnt = 0;
+    int err = 0;
+    int loc;
 
-    if (!prog)
-        return 0;
+    cmd->data = SKETH_FLT_MAX;
 
-    old_prog = xchg(&adapter->xdp_info.prog, prog);
+    spin_lock_bh(&adapter->fltr_lock);
 
-    if (old_prog)
-        bpf_prog_put(old_prog);
+    for (loc = 0; loc < SKETH_FLT_MAX; loc++) {
+        struct sketh_flow_rule *rule = adapter->fltr_rules[loc];
 
-    return 0;
+        if (!rule || rule->arfs)
+            continue;
+
+        if (cnt == cmd->rule_cnt) {
+            err = -EMSGSIZE;
+            break;
+        }
+
+        rule_locs[cnt++] = loc;
+    }
+
+    spin_unlock_bh(&adapter->fltr_lock);
+
+    cmd->rule_cnt = cnt;
+
+    return err;
 }
 
-int
-sketh_xdp_tx(struct sketh_adapter *adapter, struct xdp_buff *xdp)
+static int
+sketh_get_rxnfc(struct net_device *netdev, struct ethtool_rxnfc *cmd,
+                u32 *rule_locs)
 {
-    struct sketh_ring *tx_ring;
-    struct sketh_tx_buffer *tx_buffer;
-    dma_addr_t dma;
+    struct sketh_adapter *adapter = netdev_priv(netdev);
 
-    tx_ring = &adapter->tx_ring[0];
+    switch (cmd->cmd) {
+    case ETHTOOL_GRXRINGS:
+        cmd->data = adapter->num_queues;
+        return 0;
+    case ETHTOOL_GRXCLSRLCNT:
+        /* Slots shared with aRFS, let the driver pick for loc any */
+        cmd->rule_cnt = adapter->fltr_ethtool_count;
+        cmd->data = SKETH_FLT_MAX | RX_CLS_LOC_SPECIAL;
+        return 0;
+    case ETHTOOL_GRXCLSRULE:
+        return sketh_get_flow_rule(adapter, cmd);
+    case ETHTOOL_GRXCLSRLALL:
+        return sketh_get_flow_rule_locs(adapter, cmd, rule_locs);
+#ifndef HAVE_ETHTOOL_RXFH_FIELDS
+    case ETHTOOL_GRXFH:
+        return sketh_get_rss_hash_opts(adapter, cmd->flow_type, &cmd->data);
+#endif
+    default:
+        return -EOPNOTSUPP;
+    }
+}
 
-    dma = dma_map_single(adapter->pci_dev->dev.parent,
-                        xdp->data, xdp->data_end - xdp->data,
-                        DMA_TO_DEVICE);
+static int
+sketh_set_rxnfc(struct net_device *netdev, struct ethtool_rxnfc *cmd)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
 
-    if (dma_mapping_error(adapter->pci_dev->dev.parent, dma))
-        return -ENOMEM;
+    switch (cmd->cmd) {
+    case ETHTOOL_SRXCLSRLINS:
+        return sketh_add_flow_rule(adapter, cmd);
+    case ETHTOOL_SRXCLSRLDEL:
+        return sketh_del_flow_rule(adapter, cmd);
+#ifndef HAVE_ETHTOOL_RXFH_FIELDS
+    case ETHTOOL_SRXFH:
+        return sketh_set_rss_hash_opts(adapter, cmd->flow_type, cmd->data);
+#endif
+    default:
+        return -EOPNOTSUPP;
+    }
+}
 
-    tx_buffer = &tx_ring->tx_buffer[tx_ring->next_to_use];
-    tx_buffer->dma = dma;
-    tx_buffer->bytes = xdp->data_end - xdp->data;
-    tx_buffer->mapped = 1;
+#ifdef HAVE_ETHTOOL_RXFH_FIELDS
+static int
+sketh_get_rxfh_fields(struct net_device *netdev,
+                      struct ethtool_rxfh_fields *fields)
+{
+    return sketh_get_rss_hash_opts(netdev_priv(netdev), fields->flow_type,
+                                   &fields->data);
+}
 
-    tx_ring->next_to_use = next_to_use(tx_ring->next_to_use, tx_ring->count);
+static int
+sketh_set_rxfh_fields(struct net_device *netdev,
+                      const struct ethtool_rxfh_fields *fields,
+                      struct netlink_ext_ack *extack)
+{
+    return sketh_set_rss_hash_opts(netdev_priv(netdev), fields->flow_type,
+                                   fields->data);
+}
+#endif
 
-    return 0;
+static u32
+sketh_get_rxfh_key_size(struct net_device *netdev)
+{
+    return SKETH_RSS_KEY_SIZE;
+}
+
+static u32
+sketh_get_rxfh_indir_size(struct net_device *netdev)
+{
+    return SKETH_RSS_INDIR_SIZE;
+}
+
+static void
+sketh_rss_get(struct sketh_adapter *adapter, u32 *indir, u8 *key)
+{
+    int i;
+
+    if (indir) {
+        for (i = 0; i < SKETH_RSS_INDIR_SIZE; i++)
+            indir[i] = adapter->rss_indir[i];
+    }
+
+    if (key)
+        memcpy(key, adapter->rss_key, SKETH_RSS_KEY_SIZE);
 }
 
 static int
-sketh_set_features(struct net_device *netdev, netdev_features_t features)
+sketh_rss_set(struct sketh_adapter *adapter, const u32 *indir, const u8 *key)
 {
-    struct sketh_adapter *adapter = netdev_priv(netdev);
-    netdev_features_t changed = netdev->features ^ features;
+    int i;
 
-    if (changed & NETIF_F_NTUPLE) {
+    if (indir) {
+        for (i = 0; i < SKETH_RSS_INDIR_SIZE; i++) {
+            if (indir[i] >= adapter->num_queues)
+                return -EINVAL;
+        }
+
+        for (i = 0; i < SKETH_RSS_INDIR_SIZE; i++)
+            adapter->rss_indir[i] = indir[i];
     }
 
+    if (key)
+        memcpy(adapter->rss_key, key, SKETH_RSS_KEY_SIZE);
+
+    sketh_configure_rss(adapter);
+
     return 0;
 }
 
-int
-sketh_netfilter_offload(struct sketh_adapter *adapter,
-                        struct sk_buff *skb,
-                        struct sketh_offload_info *info)
+#ifdef HAVE_ETHTOOL_RXFH_PARAM
+static int
+sketh_get_rxfh(struct net_device *netdev, struct ethtool_rxfh_param *rxfh)
 {
-    if (!info->conn)
-        return -EINVAL;
+    rxfh->hfunc = ETH_RSS_HASH_TOP;
+    sketh_rss_get(netdev_priv(netdev), rxfh->indir, rxfh->key);
 
-    if (!adapter->hw_accel)
+    return 0;
+}
+
+static int
+sketh_set_rxfh(struct net_device *netdev, struct ethtool_rxfh_param *rxfh,
+               struct netlink_ext_ack *extack)
+{
+    if (rxfh->hfunc != ETH_RSS_HASH_NO_CHANGE &&
+        rxfh->hfunc != ETH_RSS_HASH_TOP)
         return -EOPNOTSUPP;
 
+    return sketh_rss_set(netdev_priv(netdev), rxfh->indir, rxfh->key);
+}
+#else
+static int
+sketh_get_rxfh(struct net_device *netdev, u32 *indir, u8 *key, u8 *hfunc)
+{
+    if (hfunc)
+        *hfunc = ETH_RSS_HASH_TOP;
+    sketh_rss_get(netdev_priv(netdev), indir, key);
+
     return 0;
 }
 
-int
-sketh_hw_offload_enable(struct sketh_adapter *adapter)
+static int
+sketh_set_rxfh(struct net_device *netdev, const u32 *indir, const u8 *key,
+               const u8 hfunc)
 {
-    adapter->hw_accel = 1;
+    if (hfunc != ETH_RSS_HASH_NO_CHANGE && hfunc != ETH_RSS_HASH_TOP)
+        return -EOPNOTSUPP;
+
+    return sketh_rss_set(netdev_priv(netdev), indir, key);
+}
+#endif
+
+static const struct ethtool_ops sketh_ethtool_ops = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 7, 0)
+    .supported_coalesce_params = ETHTOOL_COALESCE_USECS |
+                                 ETHTOOL_COALESCE_MAX_FRAMES |
+                                 ETHTOOL_COALESCE_USE_ADAPTIVE,
+#endif
+    .get_drvinfo       = sketh_get_drvinfo,
+    .get_link          = sketh_get_link,
+    .get_sset_count    = sketh_get_sset_count,
+    .get_strings       = sketh_get_strings,
+    .get_ethtool_stats = sketh_get_ethtool_stats,
+    .get_coalesce      = sketh_get_coalesce,
+    .set_coalesce      = sketh_set_coalesce,
+    .get_ringparam     = sketh_get_ringparam,
+    .set_ringparam     = sketh_set_ringparam,
+    .get_channels      = sketh_get_channels,
+    .set_channels      = sketh_set_channels,
+    .get_priv_flags    = sketh_get_priv_flags,
+    .set_priv_flags    = sketh_set_priv_flags,
+    .get_rxnfc         = sketh_get_rxnfc,
+    .set_rxnfc         = sketh_set_rxnfc,
+    .get_rxfh_key_size = sketh_get_rxfh_key_size,
+    .get_rxfh_indir_size = sketh_get_rxfh_indir_size,
+    .get_rxfh          = sketh_get_rxfh,
+    .set_rxfh          = sketh_set_rxfh,
+#ifdef HAVE_ETHTOOL_RXFH_FIELDS
+    .get_rxfh_fields   = sketh_get_rxfh_fields,
+    .set_rxfh_fields   = sketh_set_rxfh_fields,
+#endif
+};
+
+#ifdef CONFIG_DCB
+static int
+sketh_dcbnl_ieee_getets(struct net_device *netdev, struct ieee_ets *ets)
+{
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+
+    ets->ets_cap = SKETH_MAX_TC;
+    memcpy(ets->tc_tx_bw, adapter->tc_bw, sizeof(ets->tc_tx_bw));
+    memcpy(ets->tc_tsa, adapter->tc_tsa, sizeof(ets->tc_tsa));
+    memcpy(ets->prio_tc, adapter->prio_tc, sizeof(ets->prio_tc));
+
     return 0;
 }
 
-int
-sketh_hw_offload_disable(struct sketh_adapter *adapter)
+static int
+sketh_dcbnl_ieee_setets(struct net_device *netdev, struct ieee_ets *ets)
 {
-    adapter->hw_accel = 0;
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    u8 old_bw[SKETH_MAX_TC], old_tsa[SKETH_MAX_TC];
+    int num_tc = 0, bw = 0, ets_tcs = 0;
+    int err, i;
+
+    for (i = 0; i < SKETH_MAX_TC; i++) {
+        if (ets->prio_tc[i] >= SKETH_MAX_TC)
+            return -EINVAL;
+
+        switch (ets->tc_tsa[i]) {
+        case IEEE_8021QAZ_TSA_STRICT:
+            break;
+        case IEEE_8021QAZ_TSA_ETS:
+            bw += ets->tc_tx_bw[i];
+            ets_tcs++;
+            break;
+        default:
+            return -EOPNOTSUPP;
+        }
+
+        num_tc = max_t(int, num_tc, ets->prio_tc[i] + 1);
+    }
+
+    /* ETS classes share whatever the strict ones leave, all of it */
+    if (ets_tcs && bw != 100)
+        return -EINVAL;
+
+    if (num_tc > adapter->num_queues)
+        return -EINVAL;
+
+    memcpy(old_bw, adapter->tc_bw, sizeof(old_bw));
+    memcpy(old_tsa, adapter->tc_tsa, sizeof(old_tsa));
+    memcpy(adapter->tc_bw, ets->tc_tx_bw, sizeof(adapter->tc_bw));
+    memcpy(adapter->tc_tsa, ets->tc_tsa, sizeof(adapter->tc_tsa));
+
+    /* A single class needs no queue split */
+    if (num_tc == 1)
+        num_tc = 0;
+
+    if (num_tc != netdev_get_num_tc(netdev)) {
+        err = sketh_setup_num_tc(adapter, num_tc, ets->prio_tc);
+        if (err) {
+            memcpy(adapter->tc_bw, old_bw, sizeof(adapter->tc_bw));
+            memcpy(adapter->tc_tsa, old_tsa, sizeof(adapter->tc_tsa));
+            sketh_configure_dcb(adapter);
+        }
+
+        return err;
+    }
+
+    memcpy(adapter->prio_tc, ets->prio_tc, sizeof(adapter->prio_tc));
+    sketh_set_tc_queues(adapter);
+    sketh_configure_dcb(adapter);
+    sketh_update_pfc_xoff(adapter);
+
     return 0;
 }
 
-int
-sketh_hw_flow_table_create(struct sketh_adapter *adapter, unsigned int size)
+static int
+sketh_dcbnl_ieee_getpfc(struct net_device *netdev, struct ieee_pfc *pfc)
 {
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+    int i;
+
+    pfc->pfc_cap = SKETH_MAX_TC;
+    pfc->pfc_en = adapter->pfc_en;
+
+    sketh_update_pfc_stats(adapter);
+
+    spin_lock_bh(&adapter->pfc_stats_lock);
+    for (i = 0; i < SKETH_MAX_TC; i++) {
+        pfc->requests[i] = adapter->pfc_stats.tx_xoff[i];
+        pfc->indications[i] = adapter->pfc_stats.rx_xoff[i];
+    }
+    spin_unlock_bh(&adapter->pfc_stats_lock);
+
     return 0;
 }
 
-int
-sketh_hw_flow_table_destroy(struct sketh_adapter *adapter)
+static int
+sketh_dcbnl_ieee_setpfc(struct net_device *netdev, struct ieee_pfc *pfc)
 {
+    struct sketh_adapter *adapter = netdev_priv(netdev);
+
+    adapter->pfc_en = pfc->pfc_en;
+    sketh_wr32(adapter, SKETH_REG_PFC_CTRL, adapter->pfc_en);
+
+    /* Priorities taken out of PFC must not stay paused */
+    sketh_update_pfc_xoff(adapter);
+
     return 0;
 }
 
-static unsigned int
-sketh_nf_in(void *priv,
-            struct sk_buff *skb,
-            const struct nf_hook_state *state)
+static u8
+sketh_dcbnl_getdcbx(struct net_device *netdev)
 {
-    struct sketh_adapter *adapter;
-    struct sketh_offload_info offload_info;
-    struct nf_conn *ct;
-    enum ip_conntrack_info ctinfo;
-    int ret;
+    return SKETH_DCBX_CAP;
+}
 
-    if (!priv)
-        return NF_ACCEPT;
+static u8
+sketh_dcbnl_setdcbx(struct net_device *netdev, u8 mode)
+{
+    return mode == SKETH_DCBX_CAP ? 0 : 1;
+}
 
-    adapter = (struct sketh_adapter *)priv;
+static const struct dcbnl_rtnl_ops sketh_dcbnl_ops = {
+    .ieee_getets = sketh_dcbnl_ieee_getets,
+    .ieee_setets = sketh_dcbnl_ieee_setets,
+    .ieee_getpfc = sketh_dcbnl_ieee_getpfc,
+    .ieee_setpfc = sketh_dcbnl_ieee_setpfc,
+    .getdcbx     = sketh_dcbnl_getdcbx,
+    .setdcbx     = sketh_dcbnl_setdcbx,
+};
+#endif /* CONFIG_DCB */
 
-    ct = nf_ct_get(skb, &ctinfo);
-    if (!ct)
-        return NF_ACCEPT;
+#ifdef HAVE_DEVLINK_HEALTH
+/* Back-to-back reports inside this window are left for the user to recover */
+#define SKETH_REPORTER_GRACE_MS 500
 
-    if (!test_bit(IPS_OFFLOAD_BIT, &ct->status))
-        return NF_ACCEPT;
+static void
+sketh_fmsg_ring(struct devlink_fmsg *fmsg, struct sketh_ring *ring)
+{
+    struct sketh_adapter *adapter = ring->adapter;
+    u16 reg_idx = ring->reg_idx;
+    u32 head, tail;
 
-    memset(&offload_info, 0, sizeof(offload_info));
-    offload_info.conn = ct;
-    offload_info.ctinfo = ctinfo;
-    offload_info.indev = state->in;
-    offload_info.outdev = state->out;
+    if (ring->is_tx) {
+        head = sketh_rd32(adapter, SKETH_REG_TDH(reg_idx));
+        tail = sketh_rd32(adapter, SKETH_REG_TDT(reg_idx));
+    } else {
+        head = sketh_rd32(adapter, SKETH_REG_RDH(reg_idx));
+        tail = sketh_rd32(adapter, SKETH_REG_RDT(reg_idx));
+    }
 
-    ret = sketh_netfilter_offload(adapter, skb, &offload_info);
+    devlink_fmsg_obj_nest_start(fmsg);
+    devlink_fmsg_u32_pair_put(fmsg, "queue", ring->queue_index);
+    devlink_fmsg_bool_pair_put(fmsg, "xdp", ring->is_xdp);
+    devlink_fmsg_u32_pair_put(fmsg, "head", head);
+    devlink_fmsg_u32_pair_put(fmsg, "tail", tail);
+    devlink_fmsg_u32_pair_put(fmsg, "next_to_use", ring->next_to_use);
+    devlink_fmsg_u32_pair_put(fmsg, "next_to_clean", ring->next_to_clean);
+    devlink_fmsg_u32_pair_put(fmsg, "count", ring->count);
+    devlink_fmsg_u32_pair_put(fmsg, "unused", sketh_desc_unused(ring));
+
+    if (ring->is_tx && !ring->is_xdp) {
+        devlink_fmsg_bool_pair_put(fmsg, "stopped",
+                                   netif_tx_queue_stopped(txring_txq(ring)));
+        devlink_fmsg_bool_pair_put(fmsg, "pfc_paused",
+                                   sketh_tx_pfc_paused(ring));
+    }
 
-    return ret == 0 ? NF_STOLEN : NF_ACCEPT;
+    devlink_fmsg_obj_nest_end(fmsg);
+}
+
+/* The reported ring, or every ring of the reporter's direction */
+static void
+sketh_fmsg_rings(struct sketh_adapter *adapter,
+                 struct devlink_health_reporter *reporter,
+                 struct devlink_fmsg *fmsg, struct sketh_ring *ring)
+{
+    bool tx = reporter == adapter->tx_reporter;
+    int i;
+
+    devlink_fmsg_arr_pair_nest_start(fmsg, "rings");
+
+    if (ring) {
+        sketh_fmsg_ring(fmsg, ring);
+    } else {
+        for (i = 0; i < adapter->num_queues; i++) {
+            if (!tx) {
+                sketh_fmsg_ring(fmsg, &adapter->rx_ring[i]);
+                continue;
+            }
+
+            sketh_fmsg_ring(fmsg, &adapter->tx_ring[i]);
+            if (adapter->xdp_ring[i].desc)
+                sketh_fmsg_ring(fmsg, &adapter->xdp_ring[i]);
+        }
+    }
+
+    devlink_fmsg_arr_pair_nest_end(fmsg);
+}
+
+static int
+sketh_reporter_recover(struct devlink_health_reporter *reporter,
+                       void *priv_ctx, struct netlink_ext_ack *extack)
+{
+    struct sketh_adapter *adapter = devlink_health_reporter_priv(reporter);
+    struct sketh_ring *ring = priv_ctx;
+
+    /* A recover requested from user space resets every queue pair */
+    return sketh_recover_queues(adapter, ring ? ring->queue_index : -1);
+}
+
+static int
+sketh_reporter_dump(struct devlink_health_reporter *reporter,
+                    struct devlink_fmsg *fmsg, void *priv_ctx,
+                    struct netlink_ext_ack *extack)
+{
+    struct sketh_adapter *adapter = devlink_health_reporter_priv(reporter);
+
+    sketh_fmsg_rings(adapter, reporter, fmsg, priv_ctx);
+
+    return 0;
+}
+
+static int
+sketh_reporter_diagnose(struct devlink_health_reporter *reporter,
+                        struct devlink_fmsg *fmsg,
+                        struct netlink_ext_ack *extack)
+{
+    struct sketh_adapter *adapter = devlink_health_reporter_priv(reporter);
+
+    devlink_fmsg_u64_pair_put(fmsg, "queue_resets", adapter->queue_resets);
+    devlink_fmsg_u64_pair_put(fmsg, "last_recovery_us",
+                              adapter->last_recovery_us);
+    sketh_fmsg_rings(adapter, reporter, fmsg, NULL);
+
+    return 0;
 }
 
-static struct nf_hook_ops sketh_nf_hook_ops = {
-    .hook     = sketh_nf_in,
-    .pf       = NFPROTO_INET,
-    .hooknum  = NF_INET_FORWARD,
-    .priority = NF_IP_PRI_FIRST,
+static const struct devlink_health_reporter_ops sketh_tx_reporter_ops = {
+    .name     = "tx",
+    .recover  = sketh_reporter_recover,
+    .dump     = sketh_reporter_dump,
+    .diagnose = sketh_reporter_diagnose,
+#ifdef HAVE_DEVLINK_REPORTER_OPS_GRACE
+    .default_graceful_period = SKETH_REPORTER_GRACE_MS,
+#endif
 };
 
-int
-sketh_register_netfilter(struct sketh_adapter *adapter)
+static const struct devlink_health_reporter_ops sketh_rx_reporter_ops = {
+    .name     = "rx",
+    .recover  = sketh_reporter_recover,
+    .dump     = sketh_reporter_dump,
+    .diagnose = sketh_reporter_diagnose,
+#ifdef HAVE_DEVLINK_REPORTER_OPS_GRACE
+    .default_graceful_period = SKETH_REPORTER_GRACE_MS,
+#endif
+};
+
+static const struct devlink_ops sketh_devlink_ops = {
+};
+
+static struct devlink_health_reporter *
+sketh_reporter_create(struct sketh_adapter *adapter,
+                      const struct devlink_health_reporter_ops *ops)
+{
+    struct devlink_health_reporter *reporter;
+
+#ifdef HAVE_DEVLINK_REPORTER_OPS_GRACE
+    reporter = devlink_health_reporter_create(adapter->devlink, ops, adapter);
+#else
+    reporter = devlink_health_reporter_create(adapter->devlink, ops,
+                                              SKETH_REPORTER_GRACE_MS,
+                                              adapter);
+#endif
+    if (IS_ERR(reporter)) {
+        sketh_warn(adapter, "Cannot create the %s health reporter: %ld\n",
+                   ops->name, PTR_ERR(reporter));
+        return NULL;
+    }
+
+    return reporter;
+}
+#endif /* HAVE_DEVLINK_HEALTH */
+
+/* Without devlink, or with its reporter missing, recover right away */
+static void
+sketh_report_queue(struct sketh_adapter *adapter,
+                   struct devlink_health_reporter *reporter,
+                   const char *msg, struct sketh_ring *ring)
+{
+#ifdef HAVE_DEVLINK_HEALTH
+    if (reporter) {
+        devlink_health_report(reporter, msg, ring);
+        return;
+    }
+#endif
+
+    sketh_warn(adapter, "%s on queue %u\n", msg, ring->queue_index);
+    sketh_recover_queues(adapter, ring->queue_index);
+}
+
+static void
+sketh_reset_task(struct work_struct *work)
 {
-    sketh_nf_hook_ops.priv = adapter;
-    return nf_register_net_hook(&init_net, &sketh_nf_hook_ops);
+    struct sketh_adapter *adapter = container_of(work, struct sketh_adapter, reset_task);
+    int i;
+
+    /* sketh_open() brings every ring up fresh anyway */
+    if (test_bit(__SKETH_STATE_DOWN, &adapter->state)) {
+        bitmap_zero(adapter->tx_hung_qps, SKETH_MAX_NUM_QUEUES);
+        bitmap_zero(adapter->rx_stall_qps, SKETH_MAX_NUM_QUEUES);
+        return;
+    }
+
+    for (i = 0; i < adapter->num_queues; i++) {
+        if (test_and_clear_bit(i, adapter->tx_hung_qps))
+            sketh_report_queue(adapter, adapter->tx_reporter, "TX timeout",
+                               &adapter->tx_ring[i]);
+
+        if (test_and_clear_bit(i, adapter->rx_stall_qps))
+            sketh_report_queue(adapter, adapter->rx_reporter,
+                               "RX ring starved", &adapter->rx_ring[i]);
+    }
 }
 
-void
-sketh_unregister_netfilter(struct sketh_adapter *adapter)
-{
-    nf_unregister_net_hook(&init_net, &sketh_nf_hook_ops);
+/* Health reporting is optional, the netdev works without it */
+static void
+sketh_devlink_register(struct sketh_adapter *adapter)
+{
+#ifdef HAVE_DEVLINK_HEALTH
+    struct devlink *devlink;
+
+    devlink = devlink_alloc(&sketh_devlink_ops, 0, adapter->dev);
+    if (!devlink) {
+        sketh_warn(adapter, "Cannot allocate devlink\n");
+        return;
+    }
+
+    devlink_register(devlink);
+    adapter->devlink = devlink;
+
+    adapter->tx_reporter = sketh_reporter_create(adapter,
+                                                 &sketh_tx_reporter_ops);
+    adapter->rx_reporter = sketh_reporter_create(adapter,
+                                                 &sketh_rx_reporter_ops);
+#endif
 }
 
-irqreturn_t
-sketh_msix_ring(int irq, void *data)
+static void
+sketh_devlink_unregister(struct sketh_adapter *adapter)
 {
-    struct sketh_ring *ring = (struct sketh_ring *)data;
-    struct sketh_adapter *adapter = ring->adapter;
+#ifdef HAVE_DEVLINK_HEALTH
+    if (!adapter->devlink)
+        return;
 
-    napi_schedule(&ring->napi);
+    if (adapter->rx_reporter) {
+        devlink_health_reporter_destroy(adapter->rx_reporter);
+        adapter->rx_reporter = NULL;
+    }
 
-    return IRQ_HANDLED;
-}
+    if (adapter->tx_reporter) {
+        devlink_health_reporter_destroy(adapter->tx_reporter);
+        adapter->tx_reporter = NULL;
+    }
 
-irqreturn_t
-sketh_msix_mbx(int irq, void *data)
-{
-    return IRQ_HANDLED;
+    devlink_unregister(adapter->devlink);
+    devlink_free(adapter->devlink);
+    adapter->devlink = NULL;
+#endif
 }
 
-int
-sketh_request_irqs(struct sketh_adapter *adapter)
+/*
+ * Everything past bus setup and interrupt allocation, shared by the PCI
+ * and sketh-sim probes. max_queues and num_queues must be known.
+ */
+static int
+sketh_register_adapter(struct sketh_adapter *adapter)
 {
-    int i, err;
+    struct net_device *netdev = adapter->netdev;
+    int err;
 
-    for (i = 0; i < adapter->num_queues; i++) {
-        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
-        struct msix_entry *entry = &adapter->msix_entries[i];
+    adapter->tx_ring_count = SKETH_TX_DEFAULT_DESC;
+    adapter->rx_ring_count = SKETH_RX_DEFAULT_DESC;
 
-        err = request_irq(entry->vector,
-                         sketh_msix_ring,
-                         0,
-                         adapter->netdev->name,
-                         rx_ring);
+    sketh_init_coalesce(adapter);
+    sketh_init_rss(adapter);
+    sketh_init_dcb(adapter);
 
-        if (err) {
-            sketh_err(adapter, "Request_irq failed for vector %d\n", i);
-            goto err_free_irq;
-        }
+    err = sketh_hw_flow_table_create(adapter, SKETH_FT_MAX_FLOWS);
+    if (err) {
+        sketh_err(adapter, "Unable to create the flow table\n");
+        return err;
+    }
 
-        irq_set_affinity_hint(entry->vector, &rx_ring->affinity_mask);
+    err = sketh_alloc_queues(adapter);
+    if (err) {
+        sketh_err(adapter, "Unable to allocate queues\n");
+        goto err_alloc_queues;
     }
 
-    return 0;
+    INIT_WORK(&adapter->reset_task, sketh_reset_task);
+    INIT_DELAYED_WORK(&adapter->service_task, sketh_service_task);
 
-err_free_irq:
-    while (i--) {
-        struct msix_entry *entry = &adapter->msix_entries[i];
-        struct sketh_ring *rx_ring = &adapter->rx_ring[i];
-        free_irq(entry->vector, rx_ring);
-    }
+    spin_lock_init(&adapter->fltr_lock);
+    hash_init(adapter->fltr_hash);
 
-    return err;
-}
+    netdev->netdev_ops = &sketh_netdev_ops;
+    netdev->ethtool_ops = &sketh_ethtool_ops;
+#ifdef CONFIG_DCB
+    netdev->dcbnl_ops = &sketh_dcbnl_ops;
+#endif
+    netdev->watchdog_timeo = 5 * HZ;
+    netdev->mtu = mtu;
 
-void
-sketh_free_irqs(struct sketh_adapter *adapter)
-{
-    int i;
+    netdev->hw_features = NETIF_F_SG | NETIF_F_HW_CSUM |
+                         NETIF_F_NTUPLE | NETIF_F_RXCSUM | NETIF_F_RXHASH |
+                         NETIF_F_HW_TC | NETIF_F_GRO_HW |
+                         NETIF_F_HW_VLAN_CTAG_RX | NETIF_F_HW_VLAN_CTAG_TX |
+                         NETIF_F_TSO | NETIF_F_TSO6 | NETIF_F_GSO_UDP_L4 |
+                         NETIF_F_GSO_UDP_TUNNEL | NETIF_F_GSO_UDP_TUNNEL_CSUM;
 
-    for (i = 0; i < adapter->num_queues; i++) {
-        if (adapter->msix_entries && adapter->msix_entries[i].vector) {
-            struct sketh_ring *rx_ring = &adapter->rx_ring[i];
-            free_irq(adapter->msix_entries[i].vector, rx_ring);
+    /* Driver-side TCP aggregation is opt-in: ethtool -K rx-gro-hw on */
+    netdev->features = netdev->hw_features & ~NETIF_F_GRO_HW;
+    if (netdev->features & NETIF_F_HW_TC) {
+        err = sketh_hw_offload_enable(adapter);
+        if (err) {
+            sketh_err(adapter, "Unable to enable flow offload\n");
+            goto err_register;
         }
     }
 
-    if (adapter->msix_entries) {
-        vfree(adapter->msix_entries);
-        adapter->msix_entries = NULL;
-    }
-}
-
-void
-sketh_update_stats(struct sketh_adapter *adapter)
-{
-    struct net_device *netdev = adapter->netdev;
+    netdev->vlan_features = netdev->hw_features & ~NETIF_F_HW_VLAN_CTAG_RX;
+    netdev->hw_enc_features = NETIF_F_SG | NETIF_F_HW_CSUM |
+                              NETIF_F_TSO | NETIF_F_TSO6 | NETIF_F_GSO_UDP_L4 |
+                              NETIF_F_GSO_UDP_TUNNEL |
+                              NETIF_F_GSO_UDP_TUNNEL_CSUM;
 
-    spin_lock(&adapter->stats_lock);
+#ifdef HAVE_XDP_FEATURES
+    netdev->xdp_features = NETDEV_XDP_ACT_BASIC | NETDEV_XDP_ACT_REDIRECT |
+                           NETDEV_XDP_ACT_RX_SG | NETDEV_XDP_ACT_XSK_ZEROCOPY;
+#endif
 
-    netdev->stats.rx_errors = 0;
-    netdev->stats.tx_errors = 0;
-    netdev->stats.rx_dropped = adapter->rx_drops;
-    netdev->stats.tx_dropped = adapter->tx_dropped;
+    /* Rings are allocated and filled by sketh_open() */
+    set_bit(__SKETH_STATE_DOWN, &adapter->state);
 
-    spin_unlock(&adapter->stats_lock);
-}
+    netif_set_real_num_tx_queues(netdev, adapter->num_queues);
+    netif_set_real_num_rx_queues(netdev, adapter->num_queues);
 
-static void
-sketh_get_stats64(struct net_device *netdev,
-                  struct rtnl_link_stats64 *stats)
-{
-    struct sketh_adapter *adapter = netdev_priv(netdev);
-    int i;
+    err = register_netdev(netdev);
+    if (err) {
+        sketh_err(adapter, "Cannot register net device\n");
+        goto err_register;
+    }
 
-    sketh_update_stats(adapter);
+    adapter->dev_registered = true;
 
-    stats->rx_packets = netdev->stats.rx_packets;
-    stats->rx_bytes = netdev->stats.rx_bytes;
-    stats->tx_packets = netdev->stats.tx_packets;
-    stats->tx_bytes = netdev->stats.tx_bytes;
+    /* Needs the final name, the kthreads are called napi/<ifname>-<id> */
+    if (napi_threaded) {
+        rtnl_lock();
+        err = sketh_set_threaded(netdev);
+        rtnl_unlock();
 
-    stats->rx_errors = netdev->stats.rx_errors;
-    stats->tx_errors = netdev->stats.tx_errors;
-    stats->rx_dropped = netdev->stats.rx_dropped;
-    stats->tx_dropped = netdev->stats.tx_dropped;
-}
+        if (err)
+            sketh_warn(adapter, "Cannot enable threaded NAPI: %d\n", err);
+    }
 
-static const struct net_device_ops sketh_netdev_ops = {
-    .ndo_open            = sketh_open,
-    .ndo_stop            = sketh_stop,
-    .ndo_start_xmit      = sketh_start_xmit,
-    .ndo_set_rx_mode     = sketh_set_rx_mode,
-    .ndo_set_mac_address = sketh_set_mac_address,
-    .ndo_change_mtu      = sketh_change_mtu,
-    .ndo_tx_timeout      = sketh_tx_timeout,
-    .ndo_get_stats64     = sketh_get_stats64,
-    .ndo_validate_addr   = eth_validate_addr,
-    .ndo_set_features    = sketh_set_features,
-};
+    err = sketh_register_netfilter(adapter);
+    if (err) {
+        sketh_warn(adapter, "Cannot register netfilter hooks\n");
+    }
 
-static void
-sketh_get_drvinfo(struct net_device *netdev,
-                  struct ethtool_drvinfo *drvinfo)
-{
-    struct sketh_adapter *adapter = netdev_priv(netdev);
+    sketh_devlink_register(adapter);
 
-    strlcpy(drvinfo->driver, SKETH_DRIVER_NAME, sizeof(drvinfo->driver));
-    strlcpy(drvinfo->version, SKETH_DRIVER_VERSION, sizeof(drvinfo->version));
-    strlcpy(drvinfo->bus_info, pci_name(adapter->pci_dev),
-            sizeof(drvinfo->bus_info));
-}
+    return 0;
 
-static u32
-sketh_get_link(struct net_device *netdev)
-{
-    return 1;
+err_register:
+    sketh_free_queues(adapter);
+err_alloc_queues:
+    sketh_hw_flow_table_destroy(adapter);
+    return err;
 }
 
-static const struct ethtool_ops sketh_ethtool_ops = {
-    .get_drvinfo    = sketh_get_drvinfo,
-    .get_link       = sketh_get_link,
-};
-
 static void
-sketh_reset_task(struct work_struct *work)
+sketh_unregister_adapter(struct sketh_adapter *adapter)
 {
-    struct sketh_adapter *adapter = container_of(work, struct sketh_adapter, reset_task);
     struct net_device *netdev = adapter->netdev;
 
-    if (test_bit(__SKETH_STATE_DOWN, &adapter->state))
-        return;
+    if (adapter->dev_registered) {
+        sketh_unregister_netfilter(adapter);
+        unregister_netdev(netdev);
+
+        /* Recovery takes RTNL and the reporters, neither is around after */
+        cancel_work_sync(&adapter->reset_task);
+        sketh_devlink_unregister(adapter);
+    }
+
+    sketh_free_queues(adapter);
+    sketh_fltr_flush(adapter);
+    sketh_hw_flow_table_destroy(adapter);
 
-    sketh_info(adapter, "Reset task started\n");
+    if (adapter->xdp_info.prog) {
+        bpf_prog_put(adapter->xdp_info.prog);
+        adapter->xdp_info.prog = NULL;
+    }
 }
 
 static int
@@ -1036,7 +6631,6 @@ sketh_probe(struct pci_dev *pci_dev, const struct pci_device_id *ent)
     struct net_device *netdev;
     struct sketh_adapter *adapter;
     int bars, err;
-    int i;
 
     bars = pci_select_bars(pci_dev, IORESOURCE_MEM | IORESOURCE_IO);
 
@@ -1064,70 +6658,37 @@ sketh_probe(struct pci_dev *pci_dev, const struct pci_device_id *ent)
 
     adapter = netdev_priv(netdev);
     adapter->netdev = netdev;
+    adapter->dev = &pci_dev->dev;
     adapter->pci_dev = pci_dev;
     adapter->msg_enable = (1 << debug) - 1;
     adapter->hw_accel = 0;
 
-    adapter->num_queues = num_queues;
-
-    if (adapter->num_queues > SKETH_MAX_NUM_QUEUES)
-        adapter->num_queues = SKETH_MAX_NUM_QUEUES;
-
-    err = sketh_alloc_queues(adapter);
-    if (err) {
-        sketh_err(adapter, "Unable to allocate queues\n");
-        goto err_alloc_queues;
-    }
-
-    INIT_WORK(&adapter->reset_task, sketh_reset_task);
-
-    adapter->msix_entries = vzalloc(sizeof(struct msix_entry) * adapter->num_queues);
-    if (!adapter->msix_entries) {
-        err = -ENOMEM;
-        goto err_msix;
-    }
-
-    for (i = 0; i < adapter->num_queues; i++) {
-        adapter->msix_entries[i].entry = i;
+    adapter->hw_addr = pci_iomap(pci_dev, 0, 0);
+    if (!adapter->hw_addr) {
+        err = -EIO;
+        goto err_ioremap;
     }
 
-    netdev->netdev_ops = &sketh_netdev_ops;
-    netdev->ethtool_ops = &sketh_ethtool_ops;
-    netdev->watchdog_timeo = 5 * HZ;
-    netdev->mtu = mtu;
-
-    netdev->hw_features = NETIF_F_SG | NETIF_F_HW_CSUM |
-                         NETIF_F_NTUPLE | NETIF_F_RXCSUM |
-                         NETIF_F_HW_VLAN_CTAG_RX | NETIF_F_HW_VLAN_CTAG_TX |
-                         NETIF_F_TSO | NETIF_F_TSO6;
-
-    netdev->features = netdev->hw_features;
-    netdev->vlan_features = netdev->hw_features & ~NETIF_F_HW_VLAN_CTAG_RX;
-
-    sketh_configure(adapter);
-
-    err = register_netdev(netdev);
+    /* Vectors decide how many queue pairs the rings are allocated for */
+    err = sketh_init_interrupts(adapter);
     if (err) {
-        sketh_err(adapter, "Cannot register net device\n");
-        goto err_register;
+        sketh_err(adapter, "Unable to allocate interrupt vectors\n");
+        goto err_interrupts;
     }
 
-    adapter->dev_registered = true;
-
-    err = sketh_register_netfilter(adapter);
-    if (err) {
-        sketh_warn(adapter, "Cannot register netfilter hooks\n");
-    }
+    err = sketh_register_adapter(adapter);
+    if (err)
+        goto err_register;
 
     pci_set_drvdata(pci_dev, adapter);
 
     return 0;
 
 err_register:
-    vfree(adapter->msix_entries);
-err_msix:
-    sketh_free_queues(adapter);
-err_alloc_queues:
+    sketh_clear_interrupts(adapter);
+err_interrupts:
+    pci_iounmap(pci_dev, adapter->hw_addr);
+err_ioremap:
     free_netdev(netdev);
 err_free_netdev:
     pci_release_selected_regions(pci_dev, bars);
@@ -1142,20 +6703,11 @@ sketh_remove(struct pci_dev *pci_dev)
     struct net_device *netdev = adapter->netdev;
     int bars = pci_select_bars(pci_dev, IORESOURCE_MEM | IORESOURCE_IO);
 
-    if (adapter->dev_registered) {
-        sketh_unregister_netfilter(adapter);
-        unregister_netdev(netdev);
-    }
-
-    sketh_free_queues(adapter);
+    sketh_unregister_adapter(adapter);
 
-    if (adapter->xdp_info.prog) {
-        bpf_prog_put(adapter->xdp_info.prog);
-        adapter->xdp_info.prog = NULL;
-    }
+    sketh_clear_interrupts(adapter);
 
-    if (adapter->msix_entries)
-        vfree(adapter->msix_entries);
+    pci_iounmap(pci_dev, adapter->hw_addr);
 
     free_netdev(netdev);
 
@@ -1177,17 +6729,142 @@ static struct pci_driver sketh_driver = {
     .remove   = sketh_remove,
 };
 
+#ifdef SKETH_SIM
+/* A sim device is always MSI-X like: one vector per queue pair, mailbox last */
+static int
+sketh_sim_init_interrupts(struct sketh_adapter *adapter)
+{
+    int i;
+
+    adapter->msix_entries = vzalloc(sizeof(struct msix_entry) *
+                                    SKETH_MAX_NUM_QUEUES);
+    if (!adapter->msix_entries)
+        return -ENOMEM;
+
+    adapter->msix_enabled = true;
+    adapter->max_queues = min_t(int, SKETH_MAX_NUM_QUEUES,
+                                adapter->sim->num_vectors - SKETH_NON_Q_VECTORS);
+
+    /* Vector indices handed to sketh_sim_irq(), there are no Linux IRQs */
+    for (i = 0; i < adapter->max_queues; i++) {
+        adapter->msix_entries[i].entry = i;
+        adapter->msix_entries[i].vector = i;
+    }
+
+    adapter->mbx_vector = adapter->max_queues;
+    adapter->num_queues = clamp_t(int, num_queues, 1, adapter->max_queues);
+
+    return 0;
+}
+
+static int
+sketh_sim_probe(struct platform_device *pdev)
+{
+    const struct sketh_sim_pdata *pdata = dev_get_platdata(&pdev->dev);
+    struct net_device *netdev;
+    struct sketh_adapter *adapter;
+    int err;
+
+    if (!pdata || !pdata->ops ||
+        pdata->num_vectors < 1 + SKETH_NON_Q_VECTORS)
+        return -EINVAL;
+
+    err = dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64));
+    if (err)
+        return err;
+
+    netdev = alloc_etherdev_mqs(sizeof(struct sketh_adapter),
+                                SKETH_MAX_NUM_QUEUES,
+                                SKETH_MAX_NUM_QUEUES);
+    if (!netdev)
+        return -ENOMEM;
+
+    SET_NETDEV_DEV(netdev, &pdev->dev);
+    eth_hw_addr_set(netdev, pdata->mac_addr);
+
+    adapter = netdev_priv(netdev);
+    adapter->netdev = netdev;
+    adapter->dev = &pdev->dev;
+    adapter->sim = pdata;
+    adapter->msg_enable = (1 << debug) - 1;
+    adapter->hw_accel = 0;
+
+    err = sketh_sim_init_interrupts(adapter);
+    if (err)
+        goto err_interrupts;
+
+    err = sketh_register_adapter(adapter);
+    if (err)
+        goto err_register;
+
+    platform_set_drvdata(pdev, adapter);
+
+    return 0;
+
+err_register:
+    sketh_clear_interrupts(adapter);
+err_interrupts:
+    free_netdev(netdev);
+    return err;
+}
+
+#ifdef HAVE_PLATFORM_REMOVE_VOID
+static void
+#else
+static int
+#endif
+sketh_sim_remove(struct platform_device *pdev)
+{
+    struct sketh_adapter *adapter = platform_get_drvdata(pdev);
+
+    sketh_unregister_adapter(adapter);
+    sketh_clear_interrupts(adapter);
+    free_netdev(adapter->netdev);
+
+#ifndef HAVE_PLATFORM_REMOVE_VOID
+    return 0;
+#endif
+}
+
+static struct platform_driver sketh_sim_driver = {
+    .probe    = sketh_sim_probe,
+    .remove   = sketh_sim_remove,
+    .driver   = {
+        .name  = SKETH_SIM_DRIVER_NAME,
+    },
+};
+#endif /* SKETH_SIM */
+
 static int __init
 sketh_init_module(void)
 {
+    int ret;
+
     pr_info("sketh: %s version %s\n", SKETH_DRIVER_NAME, SKETH_DRIVER_VERSION);
 
-    return pci_register_driver(&sketh_driver);
+    ret = pci_register_driver(&sketh_driver);
+    if (ret < 0)
+        return ret;
+
+#ifdef SKETH_SIM
+    ret = platform_driver_register(&sketh_sim_driver);
+    if (ret < 0) {
+        pr_err("sketh: Failed to register the %s driver\n",
+               SKETH_SIM_DRIVER_NAME);
+        pci_unregister_driver(&sketh_driver);
+        return ret;
+    }
+#endif
+
+    return 0;
 }
 
 static void __exit
 sketh_cleanup_module(void)
 {
+#ifdef SKETH_SIM
+    platform_driver_unregister(&sketh_sim_driver);
+#endif
     pci_unregister_driver(&sketh_driver);
 }
 
@@ -16,24 +16,219 @@
 #include <linux/irq.h>
 #include <linux/workqueue.h>
 #include <linux/bpf.h>
+#include <linux/dim.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/hashtable.h>
+#include <linux/rhashtable.h>
 #include <net/netfilter/nf_conntrack.h>
 #include <net/netfilter/nf_conntrack_tuple.h>
 #include <net/xdp.h>
+#include <net/flow_offload.h>
+#include <net/pkt_cls.h>
 
 #define SKETH_DRIVER_NAME        "sketh"
 #define SKETH_DRIVER_VERSION     "1.0.0"
 #define SKETH_MAX_NUM_QUEUES     16
 #define SKETH_DEFAULT_QUEUES     4
 #define SKETH_RX_BUF_SIZE        2048
-#define SKETH_TX_MAX_DESC        512
-#define SKETH_RX_MAX_DESC        512
+#define SKETH_TX_DEFAULT_DESC    512
+#define SKETH_RX_DEFAULT_DESC    512
+#define SKETH_TX_MAX_DESC        4096
+#define SKETH_RX_MAX_DESC        4096
+#define SKETH_MIN_DESC           64
+/* Ring lengths are programmed in units of one 128-byte descriptor fetch */
+#define SKETH_REQ_DESC_MULTIPLE  8
 
 #define SKETH_TX_FLAGS_TSO       0x01
 #define SKETH_TX_FLAGS_CSUM      0x02
+#define SKETH_TX_FLAGS_CSO_SHIFT 16
+
+/* TX context descriptor type bits */
+#define SKETH_TX_CTX_CSUM        0x0001
+#define SKETH_TX_CTX_TSO         0x0002
+#define SKETH_TX_CTX_UDP         0x0004
+#define SKETH_TX_CTX_IPV6        0x0008
+#define SKETH_TX_CTX_TUNNEL      0x0010
+/* Outer header of a UDP tunnel: IPv6, and a UDP checksum per segment */
+#define SKETH_TX_CTX_OUTER_IPV6  0x0020
+#define SKETH_TX_CTX_OUTER_CSUM  0x0040
+
+/* A single TX descriptor carries at most 16K, larger chunks are split */
+#define SKETH_MAX_TXD_PWR        14
+#define SKETH_MAX_DATA_PER_TXD   (1u << SKETH_MAX_TXD_PWR)
+#define TXD_USE_COUNT(S)         DIV_ROUND_UP((S), SKETH_MAX_DATA_PER_TXD)
+
+#define SKETH_TX_MAPPED_SINGLE   1
+#define SKETH_TX_MAPPED_PAGE     2
 
 #define __SKETH_STATE_DOWN       0
 #define __SKETH_STATE_IN_IRQ     1
 
+/* Per-queue RX ring registers in BAR 0, the device fills head up to tail */
+#define SKETH_REG_RDBAL(n)       (0x5000 + ((n) * 0x40))
+#define SKETH_REG_RDBAH(n)       (0x5004 + ((n) * 0x40))
+#define SKETH_REG_RDLEN(n)       (0x5008 + ((n) * 0x40))
+#define SKETH_REG_RDH(n)         (0x5010 + ((n) * 0x40))
+#define SKETH_REG_RDT(n)         (0x5018 + ((n) * 0x40))
+#define SKETH_REG_RXDCTL(n)      (0x5028 + ((n) * 0x40))
+#define SKETH_RXDCTL_ENABLE      BIT(25)
+
+/*
+ * Per-queue RX buffer layout. Packet buffers hold BSIZEPKT bytes. With
+ * HDR_SPLIT the headers of the first descriptor of a frame go to
+ * read.hdr_addr, everything after them to read.pkt_addr.
+ */
+#define SKETH_REG_SRRCTL(n)      (0x5014 + ((n) * 0x40))
+#define SKETH_SRRCTL_HDR_SPLIT   BIT(31)
+#define SKETH_SRRCTL_HDR_SIZE_MASK 0x3FF
+#define SKETH_SRRCTL_BSIZEPKT_SHIFT 10
+#define SKETH_SRRCTL_BSIZEPKT_MAX 0xFFFF
+
+/* Header buffers are carved from one coherent block per ring */
+#define SKETH_RX_HDR_SIZE        256
+
+/* Per-queue TX ring registers in BAR 0 */
+#define SKETH_REG_TDBAL(n)       (0x6000 + ((n) * 0x40))
+#define SKETH_REG_TDBAH(n)       (0x6004 + ((n) * 0x40))
+#define SKETH_REG_TDLEN(n)       (0x6008 + ((n) * 0x40))
+#define SKETH_REG_TDH(n)         (0x6010 + ((n) * 0x40))
+#define SKETH_REG_TDT(n)         (0x6018 + ((n) * 0x40))
+#define SKETH_REG_TXDCTL(n)      (0x6028 + ((n) * 0x40))
+#define SKETH_TXDCTL_ENABLE      BIT(25)
+/* Traffic class the ring is scheduled and paused in */
+#define SKETH_TXDCTL_TC_SHIFT    16
+#define SKETH_TXDCTL_TC_MASK     0x7
+
+/* TX descriptor cmd bits, CTX marks a context descriptor */
+#define SKETH_TX_DESC_CMD_EOP    0x01
+#define SKETH_TX_DESC_CMD_RS     0x02
+#define SKETH_TX_DESC_CMD_CTX    0x04
+
+/* TX status bit written back into the EOP descriptor of a chain */
+#define SKETH_TXD_STAT_DD        0x0001
+
+/* Per-vector interrupt throttling: usecs in [15:0], frame count in [31:16] */
+#define SKETH_REG_RX_ITR(n)      (0x7000 + ((n) * 0x08))
+#define SKETH_REG_TX_ITR(n)      (0x7004 + ((n) * 0x08))
+#define SKETH_ITR_FRAMES_SHIFT   16
+#define SKETH_ITR_USECS_MAX      1024
+#define SKETH_ITR_FRAMES_MAX     256
+#define SKETH_ITR_USECS_DEFAULT  50
+#define SKETH_ITR_FRAMES_DEFAULT 32
+
+/*
+ * Interrupt causes, one bit per queue pair plus the mailbox. In MSI-X
+ * mode IVAR routes each cause to its own vector, otherwise every cause
+ * raises the single MSI/INTx line and EICR tells them apart.
+ */
+#define SKETH_REG_EICR           0x7800
+#define SKETH_REG_EIMS           0x7804
+#define SKETH_REG_EIMC           0x7808
+#define SKETH_REG_GPIE           0x780C
+/* Reads the EICR causes without clearing them */
+#define SKETH_REG_EICS           0x7810
+#define SKETH_REG_IVAR(n)        (0x7900 + ((n) * 0x04))
+#define SKETH_REG_IVAR_MISC      0x7980
+
+#define SKETH_GPIE_MSIX_MODE     0x0001
+#define SKETH_IVAR_VALID         0x0080
+#define SKETH_EICR_QUEUE(n)      BIT(n)
+/* PFC_STATUS changed, raised on the mailbox vector */
+#define SKETH_EICR_PFC           BIT(30)
+#define SKETH_EICR_MBX           BIT(31)
+#define SKETH_EIMC_ALL           0xFFFFFFFF
+
+/* Vectors that serve no queue, the mailbox comes after the queue vectors */
+#define SKETH_NON_Q_VECTORS      1
+
+/*
+ * Data center bridging. UP2TC maps each 802.1p priority to a traffic class,
+ * TXDCTL puts every TX ring in one. ETS shares the link between classes,
+ * strict classes first. PFC_CTRL selects the priorities that honour and
+ * send per-priority pause, PFC_STATUS has those the link partner paused.
+ * The pause counters clear on read.
+ */
+#define SKETH_MAX_TC             8
+#define SKETH_REG_UP2TC          0x7A00
+#define SKETH_REG_ETS_TSA        0x7A04
+#define SKETH_REG_ETS_BW(tc)     (0x7A08 + ((tc) * 0x04))
+#define SKETH_REG_PFC_CTRL       0x7A30
+#define SKETH_REG_PFC_STATUS     0x7A34
+#define SKETH_REG_PXOFFRXC(p)    (0x7A40 + ((p) * 0x10))
+#define SKETH_REG_PXONRXC(p)     (0x7A44 + ((p) * 0x10))
+#define SKETH_REG_PXOFFTXC(p)    (0x7A48 + ((p) * 0x10))
+#define SKETH_REG_PXONTXC(p)     (0x7A4C + ((p) * 0x10))
+
+/* Three bits of class per priority, a set TSA bit makes the class ETS */
+#define SKETH_UP2TC_SHIFT(p)     ((p) * 3)
+#define SKETH_UP2TC_MASK         0x7
+
+/* Receive side scaling: Toeplitz key, indirection table, hash fields */
+#define SKETH_RSS_KEY_SIZE       40
+#define SKETH_RSS_INDIR_SIZE     128
+#define SKETH_REG_RSSRK(n)       (0x7400 + ((n) * 0x04))
+#define SKETH_REG_RETA(n)        (0x7500 + ((n) * 0x04))
+#define SKETH_REG_MRQC           0x7600
+
+#define SKETH_MRQC_RSS_EN        0x0001
+#define SKETH_MRQC_IPV4          0x0010
+#define SKETH_MRQC_IPV4_TCP      0x0020
+#define SKETH_MRQC_IPV6          0x0040
+#define SKETH_MRQC_IPV6_TCP      0x0080
+#define SKETH_MRQC_IPV4_UDP      0x0100
+#define SKETH_MRQC_IPV6_UDP      0x0200
+
+/*
+ * Perfect-match 5-tuple filters. Addresses and ports are written in
+ * network order, CTRL is written last and arms the slot.
+ */
+#define SKETH_FLT_MAX            128
+#define SKETH_REG_FLT_SRC(n, i)  (0x8000 + ((n) * 0x40) + ((i) * 0x04))
+#define SKETH_REG_FLT_DST(n, i)  (0x8010 + ((n) * 0x40) + ((i) * 0x04))
+#define SKETH_REG_FLT_PORTS(n)   (0x8020 + ((n) * 0x40))
+#define SKETH_REG_FLT_CTRL(n)    (0x8024 + ((n) * 0x40))
+
+#define SKETH_FLT_CTRL_VALID     BIT(31)
+#define SKETH_FLT_CTRL_IPV6      BIT(30)
+#define SKETH_FLT_CTRL_DROP      BIT(29)
+#define SKETH_FLT_CTRL_QUEUE_SHIFT 16
+#define SKETH_FLT_CTRL_MASK_SHIFT  8
+
+/* Fields a filter does not compare */
+#define SKETH_FLT_IGNORE_SRC_IP  0x1
+#define SKETH_FLT_IGNORE_DST_IP  0x2
+#define SKETH_FLT_IGNORE_SRC_PORT 0x4
+#define SKETH_FLT_IGNORE_DST_PORT 0x8
+
+#define SKETH_FLT_HASH_BITS      8
+
+/* Conntrack flowtable offload (TC_SETUP_FT) */
+#define SKETH_FT_MAX_FLOWS       65536
+#define SKETH_FT_MAX_MANGLES     16
+
+/* NETIF_F_GRO_HW aggregates, bounded by the 16-bit IP length fields */
+#define SKETH_HW_GRO_MAX_SIZE    0xFFFF
+
+/* RSS type reported in the low bits of wb.pkt_info */
+#define SKETH_RXD_RSSTYPE_MASK       0x000F
+#define SKETH_RXD_RSSTYPE_NONE       0x0
+#define SKETH_RXD_RSSTYPE_IPV4_TCP   0x1
+#define SKETH_RXD_RSSTYPE_IPV4       0x2
+#define SKETH_RXD_RSSTYPE_IPV6_TCP   0x3
+#define SKETH_RXD_RSSTYPE_IPV6       0x5
+#define SKETH_RXD_RSSTYPE_IPV4_UDP   0x7
+#define SKETH_RXD_RSSTYPE_IPV6_UDP   0x8
+
+/* RX descriptor status bits, written back together with length */
+#define SKETH_RXD_STAT_DD        0x0001
+#define SKETH_RXD_STAT_EOP       0x0002
+/* Headers were written to hdr_addr, wb.hdr_len says how many bytes */
+#define SKETH_RXD_STAT_SPH       0x0004
+#define SKETH_RXD_HDR_LEN_MASK   0x03FF
+
+/* ethtool --set-priv-flags */
+#define SKETH_PRIV_FLAG_HDR_SPLIT BIT(0)
+
 union sketh_rx_desc {
     struct {
         __le64 pkt_addr;
@@ -43,6 +238,17 @@ union sketh_rx_desc {
         __le16 status;
         __le16 errors;
     } read;
+    /* Written back over the buffer addresses together with DD */
+    struct {
+        __le32 rss;
+        __le16 pkt_info;
+        __le16 hdr_len;
+        __le64 reserved1;
+        __le16 length;
+        __le16 reserved;
+        __le16 status;
+        __le16 errors;
+    } wb;
 };
 
 union sketh_tx_desc {
@@ -59,37 +265,122 @@ union sketh_tx_desc {
         __le32 sflags;
         __le32 flags;
     } wb;
+    /* cmd shares its offset with read.cmd so the device can tell them apart */
+    struct {
+        __le16 mss;
+        __le16 hdr_len;
+        __le16 l3_offset;
+        __le16 l4_offset;
+        __le16 outer_l3_offset;
+        __u8 l4_len;
+        __u8 cmd;
+        __le16 type;
+        __le16 outer_l4_offset;
+    } ctx;
 };
 
+#define SKETH_RX_DESC(R, i)     (&(((union sketh_rx_desc *)((R)->desc))[i]))
+#define SKETH_TX_DESC(R, i)     (&(((union sketh_tx_desc *)((R)->desc))[i]))
+
+/* ethtool -G accepts any multiple of SKETH_REQ_DESC_MULTIPLE, not a mask */
 static inline u16 next_to_use(u16 index, u16 count)
 {
-    return (index + 1) & (count - 1);
+    return ++index == count ? 0 : index;
 }
 
 static inline u16 next_to_clean(u16 index, u16 count)
 {
-    return (index + count - 1) & (count - 1);
+    return index ? index - 1 : count - 1;
 }
 
+#define sketh_desc_unused(R)                                        \
+    ((((R)->next_to_clean > (R)->next_to_use) ? 0 : (R)->count) +   \
+     (R)->next_to_clean - (R)->next_to_use - 1)
+
 struct sketh_adapter;
 struct sketh_ring;
 struct sketh_rx_buffer;
 
+#define txring_txq(R)   netdev_get_tx_queue((R)->netdev, (R)->queue_index)
+
 struct sketh_rx_buffer {
-    struct sk_buff *skb;
+    struct page *page;
     dma_addr_t dma;
-    unsigned long handle;
+    unsigned int page_offset;
+    /* AF_XDP zero-copy buffer, used instead of page when xsk_pool is set */
+    struct xdp_buff *xdp;
 };
 
 struct sketh_tx_buffer {
+    union sketh_tx_desc *next_to_watch;
     struct sk_buff *skb;
+    struct xdp_frame *xdpf;
     dma_addr_t dma;
     unsigned int bytes;
+    unsigned int len;
     unsigned int mapped;
+    unsigned short gso_segs;
+};
+
+/* TX completion, written from NAPI only */
+struct sketh_tx_queue_stats {
+    u64 packets;
+    u64 bytes;
+    u64 restart_queue;
+};
+
+/* Transmit path, serialised by the TX queue lock (tx_lock on XDP rings) */
+struct sketh_xmit_queue_stats {
+    u64 restart_queue;
+    u64 stop_queue;
+    u64 tx_busy;
+    u64 doorbell;
+    u64 xmit_more;
+    u64 dropped;
+};
+
+/* RX and XDP verdicts, written from NAPI only */
+struct sketh_rx_queue_stats {
+    u64 packets;
+    u64 bytes;
+    u64 drops;
+    u64 alloc_failed;
+    u64 polls;
+    u64 xdp_pass;
+    u64 xdp_tx;
+    u64 xdp_drops;
+    u64 xdp_redirect;
+    u64 ft_forward;
+    u64 hw_gro_packets;
+    u64 hw_gro_segs;
+    u64 busy_polls;
+    u64 busy_poll_packets;
+    u64 hdr_split;
+    u64 hdr_nosplit;
+};
+
+/* Per-priority pause frames counted by the MAC, under pfc_stats_lock */
+struct sketh_pfc_stats {
+    u64 rx_xoff[SKETH_MAX_TC];
+    u64 rx_xon[SKETH_MAX_TC];
+    u64 tx_xoff[SKETH_MAX_TC];
+    u64 tx_xon[SKETH_MAX_TC];
+};
+
+/* TCP segments of one flow merged by NETIF_F_GRO_HW within a single poll */
+struct sketh_hw_gro {
+    struct sk_buff *skb;
+    struct sk_buff *last;
+    u32 next_seq;
+    u16 hlen;
+    u16 mss;
+    u16 segs;
 };
 
 struct sketh_ring {
     struct sketh_adapter *adapter;
+    struct device *dev;
+    u8 __iomem *tail;
     void *desc;
     dma_addr_t desc_dma;
     unsigned int count;
@@ -100,44 +391,200 @@ struct sketh_ring {
         struct sketh_rx_buffer *rx_buffer;
         struct sketh_tx_buffer *tx_buffer;
     };
+    struct sk_buff *skb;
+    struct xdp_buff xdp;
+    /* One writer per syncp: NAPI for syncp, the xmit path for xmit_syncp */
+    struct sketh_tx_queue_stats tx_stats;
+    struct sketh_rx_queue_stats rx_stats;
+    struct u64_stats_sync syncp;
+    struct sketh_xmit_queue_stats xmit_stats;
+    struct u64_stats_sync xmit_syncp;
     struct napi_struct napi;
+    struct sketh_hw_gro hw_gro;
+    /* RX rings moderate the RX side of the vector, TX rings the TX side */
+    struct dim dim;
+    u16 itr_usecs;
+    u16 itr_frames;
+    /* Counted in hard IRQ context, sampled by ethtool into a rate */
+    u64 irqs;
+    u64 irq_rate;
+    u64 irq_last;
+    unsigned long irq_stamp;
     struct net_device *netdev;
     struct xdp_rxq_info xdp_rxq;
+    struct sketh_ring *xdp_ring;
+    /* Serialises XDP_TX against ndo_xdp_xmit on XDP rings */
+    spinlock_t tx_lock;
+    struct page_pool *page_pool;
+    struct xsk_buff_pool *xsk_pool;
+    unsigned int rx_buf_len;
+    unsigned int rx_truesize;
+    /* SKETH_RX_HDR_SIZE bytes per descriptor while hdr_split is set */
+    void *hdr_buf;
+    dma_addr_t hdr_dma;
+    u16 rx_headroom;
     u16 queue_index;
+    u16 reg_idx;
+    bool is_xdp;
+    bool is_tx;
     bool xdp_enabled;
+    bool xdp_redirect;
+    bool rx_discard;
+    bool hdr_split;
+    bool xps_set;
+    /* Empty at the last service tick, a second one reports a stall */
+    bool rx_starved;
+    char irq_name[IFNAMSIZ + 16];
+    /* Node of the CPU servicing the queue, rings are allocated there */
+    int numa_node;
     cpumask_t affinity_mask;
 };
 
+struct sketh_flow_key {
+    __be32 src_ip[4];
+    __be32 dst_ip[4];
+    __be16 src_port;
+    __be16 dst_port;
+    u8 ip_proto;
+    u8 ipv6;
+    u8 ignore;
+};
+
+/* One hardware filter slot, owned either by ethtool -N or by aRFS */
+struct sketh_flow_rule {
+    struct hlist_node hnode;
+    struct sketh_flow_key key;
+    u32 flow_id;
+    u16 loc;
+    u16 queue;
+    bool drop;
+    bool arfs;
+};
+
+struct sketh_ft_mangle {
+    u8 htype;
+    u8 offset;
+    __be32 mask;
+    __be32 val;
+};
+
+/* One direction of an offloaded conntrack entry, ingress on this port */
+struct sketh_ft_flow {
+    struct rhash_head tuple_node;
+    struct rhash_head cookie_node;
+    struct sketh_flow_key key;
+    unsigned long cookie;
+    struct net_device *out_dev;
+    struct sketh_ft_mangle mangles[SKETH_FT_MAX_MANGLES];
+    u8 nr_mangles;
+    /* Drained by FLOW_CLS_STATS, which refreshes the conntrack timeout */
+    atomic64_t packets;
+    atomic64_t bytes;
+    unsigned long lastused;
+    struct rcu_head rcu;
+};
+
 struct sketh_xdp_info {
     struct bpf_prog *prog;
 };
 
+/*
+ * Software device model, see sketh_sim.c. It owns the register file and
+ * the rings programmed into it, and raises vector n by calling irq(ctx, n)
+ * from hard IRQ context. Vector n serves queue pair n, the mailbox comes
+ * last as on MSI-X hardware.
+ */
+#define SKETH_SIM_DRIVER_NAME    "sketh-sim"
+
+typedef void (*sketh_sim_irq_t)(void *ctx, unsigned int vector);
+
+struct sketh_sim_ops {
+    u32 (*rd32)(void *priv, u32 reg);
+    void (*wr32)(void *priv, u32 reg, u32 val);
+    /* A NULL irq detaches, waiting for a callback still running */
+    void (*set_irq)(void *priv, sketh_sim_irq_t irq, void *ctx);
+};
+
+/* platform_data of a sketh-sim device */
+struct sketh_sim_pdata {
+    const struct sketh_sim_ops *ops;
+    void *priv;
+    unsigned int num_vectors;
+    u8 mac_addr[ETH_ALEN];
+};
+
 struct sketh_adapter {
     struct net_device *netdev;
+    /* DMA device, the PCI function or the sketh-sim platform device */
+    struct device *dev;
     struct pci_dev *pci_dev;
+    void __iomem *hw_addr;
+    /* Set instead of pci_dev and hw_addr when bound to sketh-sim */
+    const struct sketh_sim_pdata *sim;
+    /* Queue vectors, with MSI or INTx only entry 0 is used */
     struct msix_entry *msix_entries;
+    int mbx_vector;
     struct sketh_ring *rx_ring;
     struct sketh_ring *tx_ring;
+    struct sketh_ring *xdp_ring;
     struct sketh_xdp_info xdp_info;
+    /* Queues with an AF_XDP zero-copy pool bound */
+    unsigned long *af_xdp_zc_qps;
+    /* Filter slots and their 5-tuple index, under fltr_lock */
+    struct sketh_flow_rule *fltr_rules[SKETH_FLT_MAX];
+    DECLARE_HASHTABLE(fltr_hash, SKETH_FLT_HASH_BITS);
+    spinlock_t fltr_lock;
+    u16 fltr_ethtool_count;
+    /* Offloaded flows by ingress 5-tuple and by flow_cls cookie */
+    struct rhashtable ft_tuples;
+    struct rhashtable ft_cookies;
+    atomic_t ft_count;
+    struct nf_hook_ops nf_hook_ops;
+    u32 ft_max;
+    bool ft_created;
     struct work_struct reset_task;
     struct work_struct watchdog_task;
     struct delayed_work service_task;
     unsigned long state;
+    /* Queue pairs sketh_reset_task() reports and resets one by one */
+    DECLARE_BITMAP(tx_hung_qps, SKETH_MAX_NUM_QUEUES);
+    DECLARE_BITMAP(rx_stall_qps, SKETH_MAX_NUM_QUEUES);
+    struct devlink *devlink;
+    struct devlink_health_reporter *tx_reporter;
+    struct devlink_health_reporter *rx_reporter;
+    u64 queue_resets;
+    u64 last_recovery_us;
     u64 tx_timeout_count;
     u64 tx_linearize;
-    u64 tx_restart;
-    u64 rx_drops;
-    u64 rx_polls;
-    u64 xdp_tx;
-    u64 xdp_drops;
-    u64 xdp_redirect;
-    u64 tx_dropped;
-    spinlock_t stats_lock;
+    u64 mbx_irqs;
     atomic_t tx_irq;
     atomic_t rx_irq;
+    /* Rings exist for max_queues, the first num_queues are in use */
     int num_queues;
     int max_queues;
+    u16 tx_ring_count;
+    u16 rx_ring_count;
+    u8 rss_key[SKETH_RSS_KEY_SIZE];
+    u8 rss_indir[SKETH_RSS_INDIR_SIZE];
+    /* SKETH_MRQC_* flow types hashed on L3/L4 */
+    u32 rss_mrqc;
+    u16 rx_itr_usecs;
+    u16 rx_itr_frames;
+    u16 tx_itr_usecs;
+    u16 tx_itr_frames;
+    bool rx_dim_enabled;
+    bool tx_dim_enabled;
+    /* DCB: class of each priority, ETS share and algorithm of each class */
+    u8 prio_tc[SKETH_MAX_TC];
+    u8 tc_bw[SKETH_MAX_TC];
+    u8 tc_tsa[SKETH_MAX_TC];
+    u8 pfc_en;
+    /* Classes with a paused priority, their TX queues stay stopped */
+    u8 pfc_xoff_tc;
+    struct sketh_pfc_stats pfc_stats;
+    spinlock_t pfc_stats_lock;
     u32 msg_enable;
+    u32 priv_flags;
     bool dev_registered;
     bool msix_enabled;
     bool netpoll_enabled;
@@ -159,10 +606,25 @@ int sketh_hw_offload_enable(struct sketh_adapter *adapter);
 int sketh_hw_offload_disable(struct sketh_adapter *adapter);
 int sketh_hw_flow_table_create(struct sketh_adapter *adapter, u32 size);
 int sketh_hw_flow_table_destroy(struct sketh_adapter *adapter);
+int sketh_setup_tc(struct net_device *netdev, enum tc_setup_type type,
+                   void *type_data);
+
+int sketh_xdp_setup_prog(struct sketh_adapter *adapter, struct bpf_prog *prog,
+                         struct netlink_ext_ack *extack);
+int sketh_bpf(struct net_device *netdev, struct netdev_bpf *bpf);
+int sketh_xdp_tx(struct sketh_ring *xdp_ring, struct xdp_buff *xdp);
+int sketh_xdp_xmit(struct net_device *netdev, int n, struct xdp_frame **frames,
+                   u32 flags);
+
+bool sketh_alloc_rx_buffers_zc(struct sketh_ring *rx_ring, int cleaned_count);
+int sketh_clean_rx_ring_zc(struct sketh_ring *rx_ring, int budget);
+bool sketh_xmit_zc(struct sketh_ring *xdp_ring, unsigned int budget);
+int sketh_xsk_pool_setup(struct sketh_adapter *adapter,
+                         struct xsk_buff_pool *pool, u16 qid);
+int sketh_xsk_wakeup(struct net_device *netdev, u32 qid, u32 flags);
 
-int sketh_xdp_setup_prog(struct sketh_adapter *adapter, struct bpf_prog *prog);
-int sketh_xdp(struct sketh_ring *rx_ring, struct sk_buff *skb);
-int sketh_xdp_tx(struct sketh_adapter *adapter, struct xdp_buff *xdp);
+int sketh_rx_flow_steer(struct net_device *netdev, const struct sk_buff *skb,
+                        u16 rxq_index, u32 flow_id);
 
 int sketh_register_netfilter(struct sketh_adapter *adapter);
 void sketh_unregister_netfilter(struct sketh_adapter *adapter);
@@ -176,15 +638,16 @@ int sketh_request_irqs(struct sketh_adapter *adapter);
 void sketh_free_irqs(struct sketh_adapter *adapter);
 irqreturn_t sketh_msix_ring(int irq, void *data);
 irqreturn_t sketh_msix_mbx(int irq, void *data);
+irqreturn_t sketh_intr(int irq, void *data);
 
 int sketh_napi_poll(struct napi_struct *napi, int budget);
-int sketh_clean_tx_ring(struct sketh_ring *tx_ring, int budget);
+bool sketh_clean_tx_ring(struct sketh_ring *tx_ring, int napi_budget);
 int sketh_clean_rx_ring(struct sketh_ring *rx_ring, int budget);
 bool sketh_alloc_rx_buffers(struct sketh_ring *rx_ring, int cleaned_count);
 
-void sketh_receive_skb(struct sketh_ring *rx_ring, struct sk_buff *skb, unsigned int length);
+void sketh_receive_skb(struct sketh_ring *rx_ring, struct sk_buff *skb);
 
-void sketh_update_stats(struct sketh_adapter *adapter);
-int sketh_xmit_desc(struct sketh_ring *tx_ring, dma_addr_t dma, unsigned int len, unsigned int tx_flags);
+int sketh_xmit_desc(struct sketh_ring *tx_ring, dma_addr_t dma, unsigned int len,
+                    unsigned int tx_flags, u8 cmd);
 
 #endif
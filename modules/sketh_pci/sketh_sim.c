@@ -0,0 +1,1254 @@
+/*
+ * sketh-sim: a software model of the sketh device.
+ *
+ * Each instance is a platform device the driver binds to when built with
+ * SKETH_SIM=y. The model owns the register file and works the descriptor
+ * rings sketh_configure() programs into it: a TX tail write sends the new
+ * frames right away, either back into the device's own RX rings or, with
+ * num_devs=2, into the other instance's. RX steering follows the RSS key,
+ * indirection table and hash types the driver wrote, completions write back
+ * DD and length, and interrupts go through the callback the driver attaches
+ * with set_irq(), paced by the per-queue ITR settings.
+ *
+ * TX offloads are done in software: checksums from a context descriptor
+ * are filled in and TSO/USO frames, VXLAN/GENEVE tunnelled ones included,
+ * are segmented with skb_gso_segment(). VLAN insertion and the ntuple
+ * filters are not modelled.
+ *
+ * Received PFC frames are consumed as a MAC would: they set PFC_STATUS
+ * for the quanta they carry, count in the pause registers and raise
+ * SKETH_EICR_PFC. Paused classes are not held back on TX, stopping their
+ * queues is left to the driver.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/dma-direct.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/etherdevice.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/version.h>
+#include <net/checksum.h>
+#include <net/ip.h>
+#include <net/ip6_checksum.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#include <net/gso.h>
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+
+#include "sketh.h"
+
+#define SKETH_SIM_MAX_DEVS       2
+/* Covers every register up to the last filter slot */
+#define SKETH_SIM_REG_SIZE       0x10000
+/* Largest frame one TX descriptor chain may carry, a full TSO burst */
+#define SKETH_SIM_MAX_FRAME      (64 * 1024 + 256)
+/* TX ring register sets: the queue pairs, then the XDP rings after them */
+#define SKETH_SIM_MAX_TX_RINGS   (2 * SKETH_MAX_NUM_QUEUES)
+
+#define SKETH_SIM_ITR_USECS_MASK 0xFFFF
+
+/* 802.1Qbb MAC control frame, one pause time per priority */
+#define SKETH_SIM_PFC_OPCODE     0x0101
+/* One pause quantum is 512 bit times, at a nominal 10 Gb/s */
+#define SKETH_SIM_PAUSE_QUANTUM_NS 51
+
+struct sketh_sim_pfc_frame {
+    struct ethhdr eth;
+    __be16 opcode;
+    __be16 class_enable;
+    __be16 time[SKETH_MAX_TC];
+} __packed;
+
+static unsigned int num_devs = 1;
+module_param(num_devs, uint, 0);
+MODULE_PARM_DESC(num_devs, "Devices to create: 1 loops frames back, 2 are cross-connected");
+
+static unsigned int num_vectors = SKETH_MAX_NUM_QUEUES + SKETH_NON_Q_VECTORS;
+module_param(num_vectors, uint, 0);
+MODULE_PARM_DESC(num_vectors, "MSI-X vectors per device, one per queue pair plus the mailbox");
+
+struct sketh_sim;
+
+/* Frame being gathered from a TX ring, a chain never spans two doorbells */
+struct sketh_sim_txq {
+    spinlock_t lock;
+    union sketh_tx_desc ctx;
+    bool has_ctx;
+    bool oversize;
+    u8 cso;
+    unsigned int len;
+    u8 *buf;
+};
+
+/* The TX ring and the XDP ring of the sender may both deliver here */
+struct sketh_sim_rxq {
+    spinlock_t lock;
+};
+
+/* Interrupt cause, of one queue pair or misc, and its throttling timer */
+struct sketh_sim_cause {
+    struct sketh_sim *sim;
+    struct hrtimer timer;
+    /* EICR bit and the IVAR routing it in MSI-X mode */
+    u32 eicr;
+    u32 ivar;
+    /* Queue causes clear as their vector fires, misc ones on EICR read */
+    bool autoclear;
+    /* Completions since the vector last fired, for the ITR frame count */
+    u32 frames;
+};
+
+struct sketh_sim {
+    struct platform_device *pdev;
+    /* Where TX frames go, the device itself in loopback */
+    struct sketh_sim *peer;
+    unsigned int num_queues;
+    u32 *regs;
+    /* EICR, EIMS and the driver callback, also taken from the timers */
+    raw_spinlock_t irq_lock;
+    u32 eicr;
+    u32 eims;
+    sketh_sim_irq_t irq;
+    void *irq_ctx;
+    struct sketh_sim_cause causes[SKETH_MAX_NUM_QUEUES];
+    struct sketh_sim_cause misc;
+    /* Priorities paused by received PFC frames and until when */
+    raw_spinlock_t pfc_lock;
+    struct hrtimer pfc_timer;
+    ktime_t pfc_until[SKETH_MAX_TC];
+    struct sketh_sim_txq txq[SKETH_SIM_MAX_TX_RINGS];
+    struct sketh_sim_rxq rxq[SKETH_MAX_NUM_QUEUES];
+    atomic64_t tx_packets;
+    atomic64_t tx_dropped;
+    atomic64_t rx_packets;
+    atomic64_t rx_missed;
+};
+
+/* Parsed L3/L4 headers of a received frame, for RSS and header split */
+struct sketh_sim_flow {
+    u8 tuple[2 * sizeof(struct in6_addr) + 2 * sizeof(__be16)];
+    unsigned int tuple_len;
+    unsigned int hlen;
+    u16 rss_type;
+};
+
+static struct sketh_sim *sketh_sims[SKETH_SIM_MAX_DEVS];
+
+static inline u32
+sketh_sim_reg(struct sketh_sim *sim, u32 reg)
+{
+    return READ_ONCE(sim->regs[reg / 4]);
+}
+
+static inline void
+sketh_sim_set_reg(struct sketh_sim *sim, u32 reg, u32 val)
+{
+    WRITE_ONCE(sim->regs[reg / 4], val);
+}
+
+/* No IOMMU sits in front of the model, bus addresses are physical */
+static inline void *
+sketh_sim_va(struct sketh_sim *sim, u64 dma)
+{
+    return phys_to_virt(dma_to_phys(&sim->pdev->dev, dma));
+}
+
+static void
+sketh_sim_arm(struct sketh_sim_cause *cause, u32 itr)
+{
+    u32 usecs = itr & SKETH_SIM_ITR_USECS_MASK;
+    u32 frames = itr >> SKETH_ITR_FRAMES_SHIFT;
+
+    if (!usecs || (frames && READ_ONCE(cause->frames) >= frames))
+        hrtimer_start(&cause->timer, 0, HRTIMER_MODE_REL_HARD);
+    else if (!hrtimer_is_queued(&cause->timer))
+        hrtimer_start(&cause->timer, us_to_ktime(usecs),
+                      HRTIMER_MODE_REL_HARD);
+}
+
+static void
+sketh_sim_raise(struct sketh_sim *sim, struct sketh_sim_cause *cause, u32 itr)
+{
+    unsigned long flags;
+    bool masked;
+
+    raw_spin_lock_irqsave(&sim->irq_lock, flags);
+    sim->eicr |= cause->eicr;
+    cause->frames++;
+    masked = !(sim->eims & cause->eicr);
+    raw_spin_unlock_irqrestore(&sim->irq_lock, flags);
+
+    /* A masked cause stays pending until EIMS unmasks it */
+    if (!masked)
+        sketh_sim_arm(cause, itr);
+}
+
+static enum hrtimer_restart
+sketh_sim_itr_expire(struct hrtimer *timer)
+{
+    struct sketh_sim_cause *cause = container_of(timer, struct sketh_sim_cause,
+                                                 timer);
+    struct sketh_sim *sim = cause->sim;
+    u32 bit = cause->eicr;
+    unsigned int vector = 0;
+    sketh_sim_irq_t irq;
+    void *ctx;
+    u32 ivar;
+
+    raw_spin_lock(&sim->irq_lock);
+
+    irq = sim->irq;
+    ctx = sim->irq_ctx;
+
+    if (!irq || !(sim->eicr & sim->eims & bit))
+        goto out_unlock;
+
+    if (sketh_sim_reg(sim, SKETH_REG_GPIE) & SKETH_GPIE_MSIX_MODE) {
+        ivar = sketh_sim_reg(sim, cause->ivar);
+        if (!(ivar & SKETH_IVAR_VALID))
+            goto out_unlock;
+
+        vector = ivar & ~SKETH_IVAR_VALID;
+
+        /* MSI-X queue causes clear when their vector fires */
+        if (cause->autoclear)
+            sim->eicr &= ~bit;
+    }
+
+    cause->frames = 0;
+    raw_spin_unlock(&sim->irq_lock);
+
+    irq(ctx, vector);
+
+    return HRTIMER_NORESTART;
+
+out_unlock:
+    raw_spin_unlock(&sim->irq_lock);
+    return HRTIMER_NORESTART;
+}
+
+static void
+sketh_sim_unmask(struct sketh_sim *sim, u32 val)
+{
+    unsigned long flags, pending;
+    unsigned int i;
+
+    raw_spin_lock_irqsave(&sim->irq_lock, flags);
+    pending = val & ~sim->eims & sim->eicr;
+    sim->eims |= val;
+    raw_spin_unlock_irqrestore(&sim->irq_lock, flags);
+
+    /* Completions that came in while masked fire now */
+    for_each_set_bit(i, &pending, sim->num_queues)
+        sketh_sim_arm(&sim->causes[i],
+                      sketh_sim_reg(sim, SKETH_REG_RX_ITR(i)));
+
+    if (pending & sim->misc.eicr)
+        sketh_sim_arm(&sim->misc, 0);
+}
+
+/* Count a pause frame in one of the clear-on-read PFC registers */
+static void
+sketh_sim_pfc_count(struct sketh_sim *sim, u32 reg)
+{
+    sketh_sim_set_reg(sim, reg, sketh_sim_reg(sim, reg) + 1);
+}
+
+static bool
+sketh_sim_is_pfc(const u8 *data, unsigned int len)
+{
+    const struct sketh_sim_pfc_frame *pfc = (const void *)data;
+
+    return len >= sizeof(*pfc) && pfc->eth.h_proto == htons(ETH_P_PAUSE) &&
+           pfc->opcode == htons(SKETH_SIM_PFC_OPCODE);
+}
+
+/* Drop the priorities whose pause ran out and rearm for the next one */
+static enum hrtimer_restart
+sketh_sim_pfc_expire(struct hrtimer *timer)
+{
+    struct sketh_sim *sim = container_of(timer, struct sketh_sim, pfc_timer);
+    ktime_t now = ktime_get(), next = KTIME_MAX;
+    u32 status, old;
+    int p;
+
+    raw_spin_lock(&sim->pfc_lock);
+
+    old = status = sketh_sim_reg(sim, SKETH_REG_PFC_STATUS);
+
+    for (p = 0; p < SKETH_MAX_TC; p++) {
+        if (!(status & BIT(p)))
+            continue;
+
+        if (ktime_compare(sim->pfc_until[p], now) <= 0)
+            status &= ~BIT(p);
+        else
+            next = min(next, sim->pfc_until[p]);
+    }
+
+    sketh_sim_set_reg(sim, SKETH_REG_PFC_STATUS, status);
+
+    if (next != KTIME_MAX)
+        hrtimer_start(&sim->pfc_timer, next, HRTIMER_MODE_ABS_HARD);
+
+    raw_spin_unlock(&sim->pfc_lock);
+
+    if (status != old)
+        sketh_sim_raise(sim, &sim->misc, 0);
+
+    return HRTIMER_NORESTART;
+}
+
+/* A received PFC frame pauses or releases the priorities PFC_CTRL enables */
+static void
+sketh_sim_rx_pfc(struct sketh_sim *sim, const u8 *data)
+{
+    const struct sketh_sim_pfc_frame *pfc = (const void *)data;
+    u16 classes = ntohs(pfc->class_enable);
+    ktime_t now = ktime_get();
+    unsigned long flags;
+    u32 enabled, status, old;
+    u16 quanta;
+    int p;
+
+    raw_spin_lock_irqsave(&sim->pfc_lock, flags);
+
+    enabled = sketh_sim_reg(sim, SKETH_REG_PFC_CTRL);
+    old = status = sketh_sim_reg(sim, SKETH_REG_PFC_STATUS);
+
+    for (p = 0; p < SKETH_MAX_TC; p++) {
+        if (!(classes & BIT(p)))
+            continue;
+
+        quanta = ntohs(pfc->time[p]);
+        sketh_sim_pfc_count(sim, quanta ? SKETH_REG_PXOFFRXC(p) :
+                                          SKETH_REG_PXONRXC(p));
+
+        if (!(enabled & BIT(p)))
+            continue;
+
+        if (quanta) {
+            sim->pfc_until[p] = ktime_add_ns(now, (u64)quanta *
+                                             SKETH_SIM_PAUSE_QUANTUM_NS);
+            status |= BIT(p);
+        } else {
+            status &= ~BIT(p);
+        }
+    }
+
+    sketh_sim_set_reg(sim, SKETH_REG_PFC_STATUS, status);
+    raw_spin_unlock_irqrestore(&sim->pfc_lock, flags);
+
+    /* The timer works out the earliest expiry itself */
+    if (status)
+        hrtimer_start(&sim->pfc_timer, 0, HRTIMER_MODE_REL_HARD);
+
+    if (status != old)
+        sketh_sim_raise(sim, &sim->misc, 0);
+}
+
+/* PFC frames the driver sent count as pause requests of this MAC */
+static void
+sketh_sim_tx_pfc(struct sketh_sim *sim, const u8 *data)
+{
+    const struct sketh_sim_pfc_frame *pfc = (const void *)data;
+    u16 classes = ntohs(pfc->class_enable);
+    unsigned long flags;
+    int p;
+
+    raw_spin_lock_irqsave(&sim->pfc_lock, flags);
+
+    for (p = 0; p < SKETH_MAX_TC; p++) {
+        if (classes & BIT(p))
+            sketh_sim_pfc_count(sim, pfc->time[p] ? SKETH_REG_PXOFFTXC(p) :
+                                                    SKETH_REG_PXONTXC(p));
+    }
+
+    raw_spin_unlock_irqrestore(&sim->pfc_lock, flags);
+}
+
+static void
+sketh_sim_parse(const u8 *data, unsigned int len, u32 mrqc,
+                struct sketh_sim_flow *flow)
+{
+    const struct ethhdr *eth = (const struct ethhdr *)data;
+    unsigned int l3 = ETH_HLEN, l4;
+    u16 type_l3, type_tcp, type_udp;
+    u32 hash_l3, hash_tcp, hash_udp;
+    u8 proto;
+
+    memset(flow, 0, sizeof(*flow));
+
+    if (len < ETH_HLEN)
+        return;
+
+    if (eth->h_proto == htons(ETH_P_IP)) {
+        const struct iphdr *iph = (const struct iphdr *)(data + l3);
+
+        if (len < l3 + sizeof(*iph) || iph->ihl < 5)
+            return;
+
+        l4 = l3 + iph->ihl * 4;
+        proto = iph->protocol;
+
+        /* Later fragments have no L4 header, hash all of them on L3 */
+        if (ip_is_fragment(iph))
+            proto = 0;
+
+        memcpy(flow->tuple, &iph->saddr, 2 * sizeof(__be32));
+        flow->tuple_len = 2 * sizeof(__be32);
+
+        type_l3 = SKETH_RXD_RSSTYPE_IPV4;
+        type_tcp = SKETH_RXD_RSSTYPE_IPV4_TCP;
+        type_udp = SKETH_RXD_RSSTYPE_IPV4_UDP;
+        hash_l3 = SKETH_MRQC_IPV4;
+        hash_tcp = SKETH_MRQC_IPV4_TCP;
+        hash_udp = SKETH_MRQC_IPV4_UDP;
+    } else if (eth->h_proto == htons(ETH_P_IPV6)) {
+        const struct ipv6hdr *ip6h = (const struct ipv6hdr *)(data + l3);
+
+        if (len < l3 + sizeof(*ip6h))
+            return;
+
+        l4 = l3 + sizeof(*ip6h);
+        proto = ip6h->nexthdr;
+
+        memcpy(flow->tuple, &ip6h->saddr, 2 * sizeof(struct in6_addr));
+        flow->tuple_len = 2 * sizeof(struct in6_addr);
+
+        type_l3 = SKETH_RXD_RSSTYPE_IPV6;
+        type_tcp = SKETH_RXD_RSSTYPE_IPV6_TCP;
+        type_udp = SKETH_RXD_RSSTYPE_IPV6_UDP;
+        hash_l3 = SKETH_MRQC_IPV6;
+        hash_tcp = SKETH_MRQC_IPV6_TCP;
+        hash_udp = SKETH_MRQC_IPV6_UDP;
+    } else {
+        return;
+    }
+
+    if (len < l4)
+        return;
+
+    flow->hlen = l4;
+
+    if (proto == IPPROTO_TCP && len >= l4 + sizeof(struct tcphdr)) {
+        const struct tcphdr *th = (const struct tcphdr *)(data + l4);
+
+        if (len >= l4 + th->doff * 4)
+            flow->hlen = l4 + th->doff * 4;
+    } else if (proto == IPPROTO_UDP && len >= l4 + sizeof(struct udphdr)) {
+        flow->hlen = l4 + sizeof(struct udphdr);
+    } else {
+        proto = 0;
+    }
+
+    /* Ports follow the addresses, both are in network order */
+    if ((proto == IPPROTO_TCP && (mrqc & hash_tcp)) ||
+        (proto == IPPROTO_UDP && (mrqc & hash_udp))) {
+        memcpy(flow->tuple + flow->tuple_len, data + l4, 2 * sizeof(__be16));
+        flow->tuple_len += 2 * sizeof(__be16);
+        flow->rss_type = proto == IPPROTO_TCP ? type_tcp : type_udp;
+    } else if (mrqc & hash_l3) {
+        flow->rss_type = type_l3;
+    } else {
+        flow->tuple_len = 0;
+    }
+}
+
+static u32
+sketh_sim_toeplitz(const u8 *key, const u8 *data, unsigned int len)
+{
+    u32 window = get_unaligned_be32(key);
+    u32 hash = 0;
+    unsigned int i, b;
+
+    for (i = 0; i < len; i++) {
+        for (b = 0; b < 8; b++) {
+            if (data[i] & (0x80 >> b))
+                hash ^= window;
+
+            window = (window << 1) | ((key[i + 4] >> (7 - b)) & 1);
+        }
+    }
+
+    return hash;
+}
+
+/* RX queue for the flow, as the RSS registers the driver wrote select it */
+static unsigned int
+sketh_sim_rss(struct sketh_sim *sim, const struct sketh_sim_flow *flow,
+              u32 *hash)
+{
+    u8 key[SKETH_RSS_KEY_SIZE];
+    unsigned int idx, q;
+    int i;
+
+    *hash = 0;
+
+    if (flow->rss_type == SKETH_RXD_RSSTYPE_NONE)
+        return 0;
+
+    for (i = 0; i < SKETH_RSS_KEY_SIZE / 4; i++)
+        put_unaligned_le32(sketh_sim_reg(sim, SKETH_REG_RSSRK(i)), key + i * 4);
+
+    *hash = sketh_sim_toeplitz(key, flow->tuple, flow->tuple_len);
+
+    if (!(sketh_sim_reg(sim, SKETH_REG_MRQC) & SKETH_MRQC_RSS_EN))
+        return 0;
+
+    idx = *hash & (SKETH_RSS_INDIR_SIZE - 1);
+    q = (sketh_sim_reg(sim, SKETH_REG_RETA(idx / 4)) >> ((idx & 3) * 8)) & 0xFF;
+
+    return q < sim->num_queues ? q : 0;
+}
+
+static void
+sketh_sim_rx(struct sketh_sim *sim, const u8 *data, unsigned int len)
+{
+    struct sketh_sim_flow flow;
+    struct sketh_sim_rxq *rxq;
+    union sketh_rx_desc *ring;
+    unsigned int count, head, tail, bsize, hlen = 0, off = 0, need, q, n;
+    unsigned long flags;
+    u32 srrctl, hash;
+    u64 base;
+
+    /* MAC control frames end in the MAC, never on a ring */
+    if (len >= ETH_HLEN &&
+        ((const struct ethhdr *)data)->h_proto == htons(ETH_P_PAUSE)) {
+        if (sketh_sim_is_pfc(data, len))
+            sketh_sim_rx_pfc(sim, data);
+        return;
+    }
+
+    sketh_sim_parse(data, len, sketh_sim_reg(sim, SKETH_REG_MRQC), &flow);
+    q = sketh_sim_rss(sim, &flow, &hash);
+    rxq = &sim->rxq[q];
+
+    spin_lock_irqsave(&rxq->lock, flags);
+
+    if (!(sketh_sim_reg(sim, SKETH_REG_RXDCTL(q)) & SKETH_RXDCTL_ENABLE))
+        goto missed;
+
+    base = sketh_sim_reg(sim, SKETH_REG_RDBAL(q)) |
+           (u64)sketh_sim_reg(sim, SKETH_REG_RDBAH(q)) << 32;
+    count = sketh_sim_reg(sim, SKETH_REG_RDLEN(q)) / sizeof(*ring);
+    head = sketh_sim_reg(sim, SKETH_REG_RDH(q));
+    tail = sketh_sim_reg(sim, SKETH_REG_RDT(q));
+    srrctl = sketh_sim_reg(sim, SKETH_REG_SRRCTL(q));
+    bsize = (srrctl >> SKETH_SRRCTL_BSIZEPKT_SHIFT) & SKETH_SRRCTL_BSIZEPKT_MAX;
+
+    if (!count || !bsize || head >= count || tail >= count)
+        goto missed;
+
+    ring = sketh_sim_va(sim, base);
+
+    /* Headers are split off only when they fit the header buffer */
+    if ((srrctl & SKETH_SRRCTL_HDR_SPLIT) && ring[head].read.hdr_addr &&
+        flow.hlen && flow.hlen <= (srrctl & SKETH_SRRCTL_HDR_SIZE_MASK))
+        hlen = flow.hlen;
+
+    /* Frames that do not fit the posted buffers are dropped whole */
+    need = max_t(unsigned int, 1, DIV_ROUND_UP(len - hlen, bsize));
+    if (need > (tail + count - head) % count)
+        goto missed;
+
+    for (n = 0; n < need; n++) {
+        union sketh_rx_desc *desc = &ring[head];
+        u64 pkt_addr = le64_to_cpu(desc->read.pkt_addr);
+        u16 status = SKETH_RXD_STAT_DD;
+        unsigned int chunk;
+
+        if (!n && hlen) {
+            memcpy(sketh_sim_va(sim, le64_to_cpu(desc->read.hdr_addr)),
+                   data, hlen);
+            off = hlen;
+            status |= SKETH_RXD_STAT_SPH;
+        }
+
+        chunk = min(bsize, len - off);
+        memcpy(sketh_sim_va(sim, pkt_addr), data + off, chunk);
+        off += chunk;
+
+        if (off == len)
+            status |= SKETH_RXD_STAT_EOP;
+
+        desc->wb.rss = cpu_to_le32(hash);
+        desc->wb.pkt_info = cpu_to_le16(flow.rss_type);
+        desc->wb.hdr_len = cpu_to_le16(n ? 0 : hlen);
+        desc->wb.reserved1 = 0;
+        desc->wb.length = cpu_to_le16(chunk);
+        desc->wb.errors = 0;
+
+        /* DD goes last, the driver reads the rest only after seeing it */
+        dma_wmb();
+        WRITE_ONCE(desc->wb.status, cpu_to_le16(status));
+
+        head = next_to_use(head, count);
+    }
+
+    sketh_sim_set_reg(sim, SKETH_REG_RDH(q), head);
+    spin_unlock_irqrestore(&rxq->lock, flags);
+
+    atomic64_inc(&sim->rx_packets);
+    sketh_sim_raise(sim, &sim->causes[q],
+                    sketh_sim_reg(sim, SKETH_REG_RX_ITR(q)));
+    return;
+
+missed:
+    spin_unlock_irqrestore(&rxq->lock, flags);
+    atomic64_inc(&sim->rx_missed);
+}
+
+static void
+sketh_sim_deliver(struct sketh_sim *sim, const u8 *data, unsigned int len)
+{
+    atomic64_inc(&sim->tx_packets);
+
+    if (sketh_sim_is_pfc(data, len))
+        sketh_sim_tx_pfc(sim, data);
+
+    sketh_sim_rx(sim->peer, data, len);
+}
+
+/* NETIF_F_HW_CSUM: sum from csum_start to the end, stored at cso */
+static int
+sketh_sim_csum(struct sketh_sim_txq *txq)
+{
+    unsigned int start = le16_to_cpu(txq->ctx.ctx.l4_offset);
+    __sum16 sum;
+
+    if (start + txq->cso + sizeof(sum) > txq->len)
+        return -EINVAL;
+
+    sum = csum_fold(csum_partial(txq->buf + start, txq->len - start, 0));
+    put_unaligned(sum ?: CSUM_MANGLED_0,
+                  (__sum16 *)(txq->buf + start + txq->cso));
+
+    return 0;
+}
+
+/* A full UDP checksum over a linear frame, for the outer tunnel header */
+static void
+sketh_sim_udp_csum(u8 *frame, unsigned int len, bool ipv6,
+                   unsigned int l3, unsigned int l4)
+{
+    struct udphdr *uh = (struct udphdr *)(frame + l4);
+    unsigned int ulen = len - l4;
+    __wsum csum;
+
+    uh->check = 0;
+    csum = csum_partial(uh, ulen, 0);
+
+    if (ipv6) {
+        struct ipv6hdr *ip6h = (struct ipv6hdr *)(frame + l3);
+
+        uh->check = csum_ipv6_magic(&ip6h->saddr, &ip6h->daddr, ulen,
+                                    IPPROTO_UDP, csum);
+    } else {
+        struct iphdr *iph = (struct iphdr *)(frame + l3);
+
+        uh->check = csum_tcpudp_magic(iph->saddr, iph->daddr, ulen,
+                                      IPPROTO_UDP, csum);
+    }
+
+    if (!uh->check)
+        uh->check = CSUM_MANGLED_0;
+}
+
+/*
+ * The inner headers are already set up, move them to the inner offsets
+ * and restore the outer lengths the driver zeroed. Only Ethernet inside
+ * UDP (VXLAN, GENEVE) is modelled. The outer UDP checksum is left for
+ * sketh_sim_udp_csum() once the segments are final.
+ */
+static void
+sketh_sim_tso_tunnel(struct sk_buff *skb, u16 type, unsigned int outer_l3,
+                     unsigned int outer_l4)
+{
+    skb_set_inner_mac_header(skb, skb_network_offset(skb) - ETH_HLEN);
+    skb_set_inner_network_header(skb, skb_network_offset(skb));
+    skb_set_inner_transport_header(skb, skb_transport_offset(skb));
+    skb_set_inner_protocol(skb, htons(ETH_P_TEB));
+    skb->encapsulation = 1;
+
+    skb_set_network_header(skb, outer_l3);
+    skb_set_transport_header(skb, outer_l4);
+
+    if (type & SKETH_TX_CTX_OUTER_IPV6) {
+        skb->protocol = htons(ETH_P_IPV6);
+        ipv6_hdr(skb)->payload_len = htons(skb->len - outer_l3 -
+                                           sizeof(struct ipv6hdr));
+    } else {
+        skb->protocol = htons(ETH_P_IP);
+        ip_hdr(skb)->tot_len = htons(skb->len - outer_l3);
+        ip_send_check(ip_hdr(skb));
+    }
+
+    udp_hdr(skb)->len = htons(skb->len - outer_l4);
+    udp_hdr(skb)->check = 0;
+
+    skb_shinfo(skb)->gso_type |= SKB_GSO_UDP_TUNNEL;
+}
+
+static void
+sketh_sim_tso(struct sketh_sim *sim, struct sketh_sim_txq *txq)
+{
+    const union sketh_tx_desc *ctx = &txq->ctx;
+    u16 type = le16_to_cpu(ctx->ctx.type);
+    unsigned int l3 = le16_to_cpu(ctx->ctx.l3_offset);
+    unsigned int l4 = le16_to_cpu(ctx->ctx.l4_offset);
+    unsigned int outer_l3 = le16_to_cpu(ctx->ctx.outer_l3_offset);
+    unsigned int outer_l4 = le16_to_cpu(ctx->ctx.outer_l4_offset);
+    bool tunnel = type & SKETH_TX_CTX_TUNNEL;
+    bool outer_csum = tunnel && (type & SKETH_TX_CTX_OUTER_CSUM);
+    bool outer_ipv6 = type & SKETH_TX_CTX_OUTER_IPV6;
+    u8 proto = type & SKETH_TX_CTX_UDP ? IPPROTO_UDP : IPPROTO_TCP;
+    unsigned int l4_min = proto == IPPROTO_UDP ? sizeof(struct udphdr) :
+                                                 sizeof(struct tcphdr);
+    struct sk_buff *skb, *segs, *seg, *next;
+    unsigned int paylen;
+    __sum16 *check;
+
+    if (l3 < ETH_HLEN || l4 <= l3 || l4 + l4_min > txq->len)
+        goto drop;
+
+    /* Room for the outer UDP header and the inner Ethernet header */
+    if (tunnel && (outer_l3 < ETH_HLEN || outer_l4 <= outer_l3 ||
+                   outer_l4 + sizeof(struct udphdr) + ETH_HLEN > l3))
+        goto drop;
+
+    skb = alloc_skb(txq->len, GFP_ATOMIC);
+    if (!skb)
+        goto drop;
+
+    skb_put_data(skb, txq->buf, txq->len);
+    skb_reset_mac_header(skb);
+    skb_set_network_header(skb, l3);
+    skb_set_transport_header(skb, l4);
+    skb->protocol = type & SKETH_TX_CTX_IPV6 ? htons(ETH_P_IPV6) :
+                                               htons(ETH_P_IP);
+
+    /*
+     * The driver zeroed the IP lengths and took the length out of the
+     * pseudo header, put both back as the stack would have them.
+     */
+    paylen = txq->len - l4;
+    check = proto == IPPROTO_UDP ? &udp_hdr(skb)->check : &tcp_hdr(skb)->check;
+
+    if (type & SKETH_TX_CTX_IPV6) {
+        ipv6_hdr(skb)->payload_len = htons(txq->len - l3 -
+                                           sizeof(struct ipv6hdr));
+        *check = ~csum_ipv6_magic(&ipv6_hdr(skb)->saddr,
+                                  &ipv6_hdr(skb)->daddr, paylen, proto, 0);
+    } else {
+        ip_hdr(skb)->tot_len = htons(txq->len - l3);
+        ip_send_check(ip_hdr(skb));
+        *check = ~csum_tcpudp_magic(ip_hdr(skb)->saddr, ip_hdr(skb)->daddr,
+                                    paylen, proto, 0);
+    }
+
+    skb->ip_summed = CHECKSUM_PARTIAL;
+    skb->csum_start = skb_transport_header(skb) - skb->head;
+    skb->csum_offset = (u8 *)check - skb_transport_header(skb);
+
+    skb_shinfo(skb)->gso_size = le16_to_cpu(ctx->ctx.mss);
+    if (proto == IPPROTO_UDP)
+        skb_shinfo(skb)->gso_type = SKB_GSO_UDP_L4;
+    else if (type & SKETH_TX_CTX_IPV6)
+        skb_shinfo(skb)->gso_type = SKB_GSO_TCPV6;
+    else
+        skb_shinfo(skb)->gso_type = SKB_GSO_TCPV4;
+
+    if (tunnel)
+        sketh_sim_tso_tunnel(skb, type, outer_l3, outer_l4);
+
+    /* No features: segments come back linear with their checksums done */
+    segs = skb_gso_segment(skb, 0);
+    if (IS_ERR(segs)) {
+        kfree_skb(skb);
+        goto drop;
+    }
+
+    /* Nothing to segment, the burst was a single MSS */
+    if (!segs) {
+        skb_shinfo(skb)->gso_size = 0;
+        skb_shinfo(skb)->gso_type = 0;
+
+        if (skb_checksum_help(skb)) {
+            kfree_skb(skb);
+            goto drop;
+        }
+
+        if (outer_csum)
+            sketh_sim_udp_csum(skb_mac_header(skb),
+                               skb_tail_pointer(skb) - skb_mac_header(skb),
+                               outer_ipv6, outer_l3, outer_l4);
+
+        sketh_sim_deliver(sim, skb_mac_header(skb),
+                          skb_tail_pointer(skb) - skb_mac_header(skb));
+        consume_skb(skb);
+        return;
+    }
+
+    consume_skb(skb);
+
+    skb_list_walk_safe(segs, seg, next) {
+        skb_mark_not_on_list(seg);
+
+        if ((seg->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(seg)) ||
+            skb_linearize(seg)) {
+            atomic64_inc(&sim->tx_dropped);
+        } else {
+            if (outer_csum)
+                sketh_sim_udp_csum(seg->data, seg->len, outer_ipv6,
+                                   outer_l3, outer_l4);
+
+            sketh_sim_deliver(sim, seg->data, seg->len);
+        }
+
+        consume_skb(seg);
+    }
+
+    return;
+
+drop:
+    atomic64_inc(&sim->tx_dropped);
+}
+
+static void
+sketh_sim_tx_frame(struct sketh_sim *sim, struct sketh_sim_txq *txq)
+{
+    u16 type = txq->has_ctx ? le16_to_cpu(txq->ctx.ctx.type) : 0;
+
+    if (txq->oversize || txq->len < ETH_HLEN)
+        atomic64_inc(&sim->tx_dropped);
+    else if (type & SKETH_TX_CTX_TSO)
+        sketh_sim_tso(sim, txq);
+    else if ((type & SKETH_TX_CTX_CSUM) && sketh_sim_csum(txq))
+        atomic64_inc(&sim->tx_dropped);
+    else
+        sketh_sim_deliver(sim, txq->buf, txq->len);
+
+    txq->len = 0;
+    txq->has_ctx = false;
+    txq->oversize = false;
+}
+
+static void
+sketh_sim_tx_gather(struct sketh_sim *sim, struct sketh_sim_txq *txq,
+                    const union sketh_tx_desc *desc)
+{
+    unsigned int len = le16_to_cpu(desc->read.length);
+
+    /* Every data descriptor of a chain carries the same offset */
+    if (!txq->len)
+        txq->cso = desc->read.cso;
+
+    if (txq->oversize || txq->len + len > SKETH_SIM_MAX_FRAME) {
+        txq->oversize = true;
+        return;
+    }
+
+    memcpy(txq->buf + txq->len,
+           sketh_sim_va(sim, le64_to_cpu(desc->read.pkt_addr)), len);
+    txq->len += len;
+}
+
+/* TX tail write: everything from head to the new tail goes out now */
+static void
+sketh_sim_tx(struct sketh_sim *sim, unsigned int r)
+{
+    struct sketh_sim_txq *txq = &sim->txq[r];
+    unsigned int count, head, tail, idx;
+    union sketh_tx_desc *ring;
+    bool sent = false;
+    unsigned long flags;
+    u64 base;
+
+    spin_lock_irqsave(&txq->lock, flags);
+
+    if (!(sketh_sim_reg(sim, SKETH_REG_TXDCTL(r)) & SKETH_TXDCTL_ENABLE))
+        goto out_unlock;
+
+    base = sketh_sim_reg(sim, SKETH_REG_TDBAL(r)) |
+           (u64)sketh_sim_reg(sim, SKETH_REG_TDBAH(r)) << 32;
+    count = sketh_sim_reg(sim, SKETH_REG_TDLEN(r)) / sizeof(*ring);
+    head = sketh_sim_reg(sim, SKETH_REG_TDH(r));
+    tail = sketh_sim_reg(sim, SKETH_REG_TDT(r));
+
+    if (!count || head >= count || tail >= count)
+        goto out_unlock;
+
+    ring = sketh_sim_va(sim, base);
+
+    while (head != tail) {
+        union sketh_tx_desc *desc = &ring[head];
+        u8 cmd = READ_ONCE(desc->read.cmd);
+
+        if (cmd & SKETH_TX_DESC_CMD_CTX) {
+            txq->ctx = *desc;
+            txq->has_ctx = true;
+        } else {
+            sketh_sim_tx_gather(sim, txq, desc);
+
+            if (cmd & SKETH_TX_DESC_CMD_EOP) {
+                sketh_sim_tx_frame(sim, txq);
+                sent = true;
+
+                /* The buffers are read, the driver may unmap them */
+                if (cmd & SKETH_TX_DESC_CMD_RS) {
+                    mb();
+                    WRITE_ONCE(desc->read.status,
+                               cpu_to_le16(SKETH_TXD_STAT_DD));
+                }
+            }
+        }
+
+        head = next_to_use(head, count);
+    }
+
+    sketh_sim_set_reg(sim, SKETH_REG_TDH(r), head);
+
+out_unlock:
+    spin_unlock_irqrestore(&txq->lock, flags);
+
+    /* XDP rings complete on the vector of their queue pair */
+    if (sent) {
+        idx = r % sim->num_queues;
+        sketh_sim_raise(sim, &sim->causes[idx],
+                        sketh_sim_reg(sim, SKETH_REG_TX_ITR(idx)));
+    }
+}
+
+static u32
+sketh_sim_rd32(void *priv, u32 reg)
+{
+    struct sketh_sim *sim = priv;
+    unsigned long flags;
+    u32 val;
+
+    if (WARN_ON_ONCE(reg >= SKETH_SIM_REG_SIZE || (reg & 3)))
+        return 0;
+
+    switch (reg) {
+    case SKETH_REG_EICR:
+        /* Read to clear */
+        raw_spin_lock_irqsave(&sim->irq_lock, flags);
+        val = sim->eicr;
+        sim->eicr = 0;
+        raw_spin_unlock_irqrestore(&sim->irq_lock, flags);
+        return val;
+    case SKETH_REG_EICS:
+        return READ_ONCE(sim->eicr);
+    case SKETH_REG_EIMS:
+        return READ_ONCE(sim->eims);
+    }
+
+    /* Pause counters clear on read */
+    if (reg >= SKETH_REG_PXOFFRXC(0) &&
+        reg < SKETH_REG_PXOFFRXC(SKETH_MAX_TC)) {
+        raw_spin_lock_irqsave(&sim->pfc_lock, flags);
+        val = sketh_sim_reg(sim, reg);
+        sketh_sim_set_reg(sim, reg, 0);
+        raw_spin_unlock_irqrestore(&sim->pfc_lock, flags);
+        return val;
+    }
+
+    return sketh_sim_reg(sim, reg);
+}
+
+static void
+sketh_sim_wr32(void *priv, u32 reg, u32 val)
+{
+    struct sketh_sim *sim = priv;
+    unsigned long flags;
+    unsigned int r;
+
+    if (WARN_ON_ONCE(reg >= SKETH_SIM_REG_SIZE || (reg & 3)))
+        return;
+
+    switch (reg) {
+    case SKETH_REG_EIMS:
+        sketh_sim_unmask(sim, val);
+        return;
+    case SKETH_REG_EIMC:
+        raw_spin_lock_irqsave(&sim->irq_lock, flags);
+        sim->eims &= ~val;
+        raw_spin_unlock_irqrestore(&sim->irq_lock, flags);
+        return;
+    case SKETH_REG_EICR:
+        /* Write one to clear */
+        raw_spin_lock_irqsave(&sim->irq_lock, flags);
+        sim->eicr &= ~val;
+        raw_spin_unlock_irqrestore(&sim->irq_lock, flags);
+        return;
+    }
+
+    sketh_sim_set_reg(sim, reg, val);
+
+    if (reg >= SKETH_REG_TDBAL(0) &&
+        reg < SKETH_REG_TDBAL(2 * sim->num_queues)) {
+        r = (reg - SKETH_REG_TDBAL(0)) / (SKETH_REG_TDBAL(1) - SKETH_REG_TDBAL(0));
+
+        if (reg == SKETH_REG_TDT(r)) {
+            sketh_sim_tx(sim, r);
+        } else if (reg == SKETH_REG_TXDCTL(r)) {
+            /* Waits for a doorbell in flight, then drops any partial chain */
+            spin_lock_irqsave(&sim->txq[r].lock, flags);
+            sim->txq[r].len = 0;
+            sim->txq[r].has_ctx = false;
+            sim->txq[r].oversize = false;
+            spin_unlock_irqrestore(&sim->txq[r].lock, flags);
+        }
+    } else if (reg >= SKETH_REG_RDBAL(0) &&
+               reg < SKETH_REG_RDBAL(sim->num_queues)) {
+        r = (reg - SKETH_REG_RDBAL(0)) / (SKETH_REG_RDBAL(1) - SKETH_REG_RDBAL(0));
+
+        /* Once this returns no delivery writes to a disabled ring */
+        if (reg == SKETH_REG_RXDCTL(r)) {
+            spin_lock_irqsave(&sim->rxq[r].lock, flags);
+            spin_unlock_irqrestore(&sim->rxq[r].lock, flags);
+        }
+    }
+}
+
+static void
+sketh_sim_set_irq(void *priv, sketh_sim_irq_t irq, void *ctx)
+{
+    struct sketh_sim *sim = priv;
+    unsigned long flags;
+    unsigned int i;
+
+    raw_spin_lock_irqsave(&sim->irq_lock, flags);
+    sim->irq = irq;
+    sim->irq_ctx = ctx;
+    raw_spin_unlock_irqrestore(&sim->irq_lock, flags);
+
+    if (irq)
+        return;
+
+    /* A callback that saw the old handler may still be running */
+    for (i = 0; i < sim->num_queues; i++)
+        hrtimer_cancel(&sim->causes[i].timer);
+
+    hrtimer_cancel(&sim->misc.timer);
+}
+
+static const struct sketh_sim_ops sketh_sim_ops = {
+    .rd32    = sketh_sim_rd32,
+    .wr32    = sketh_sim_wr32,
+    .set_irq = sketh_sim_set_irq,
+};
+
+static void
+sketh_sim_timer_init(struct hrtimer *timer,
+                     enum hrtimer_restart (*fn)(struct hrtimer *))
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(timer, fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+#else
+    hrtimer_init(timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+    timer->function = fn;
+#endif
+}
+
+static void
+sketh_sim_cause_init(struct sketh_sim *sim, struct sketh_sim_cause *cause,
+                     u32 eicr, u32 ivar, bool autoclear)
+{
+    cause->sim = sim;
+    cause->eicr = eicr;
+    cause->ivar = ivar;
+    cause->autoclear = autoclear;
+    sketh_sim_timer_init(&cause->timer, sketh_sim_itr_expire);
+}
+
+static void
+sketh_sim_free(struct sketh_sim *sim)
+{
+    unsigned int i;
+
+    for (i = 0; i < sim->num_queues; i++)
+        hrtimer_cancel(&sim->causes[i].timer);
+
+    hrtimer_cancel(&sim->misc.timer);
+    hrtimer_cancel(&sim->pfc_timer);
+
+    for (i = 0; i < SKETH_SIM_MAX_TX_RINGS; i++)
+        kvfree(sim->txq[i].buf);
+
+    kvfree(sim->regs);
+    kfree(sim);
+}
+
+static struct sketh_sim *
+sketh_sim_create(void)
+{
+    struct sketh_sim *sim;
+    unsigned int i;
+
+    sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+    if (!sim)
+        return NULL;
+
+    sim->num_queues = num_vectors - SKETH_NON_Q_VECTORS;
+    raw_spin_lock_init(&sim->irq_lock);
+    raw_spin_lock_init(&sim->pfc_lock);
+
+    for (i = 0; i < sim->num_queues; i++) {
+        sketh_sim_cause_init(sim, &sim->causes[i], SKETH_EICR_QUEUE(i),
+                             SKETH_REG_IVAR(i), true);
+        spin_lock_init(&sim->rxq[i].lock);
+    }
+
+    /* Only PFC is ever raised on the mailbox vector */
+    sketh_sim_cause_init(sim, &sim->misc, SKETH_EICR_PFC,
+                         SKETH_REG_IVAR_MISC, false);
+    sketh_sim_timer_init(&sim->pfc_timer, sketh_sim_pfc_expire);
+
+    sim->regs = kvzalloc(SKETH_SIM_REG_SIZE, GFP_KERNEL);
+    if (!sim->regs)
+        goto err_free;
+
+    for (i = 0; i < 2 * sim->num_queues; i++) {
+        spin_lock_init(&sim->txq[i].lock);
+
+        sim->txq[i].buf = kvmalloc(SKETH_SIM_MAX_FRAME, GFP_KERNEL);
+        if (!sim->txq[i].buf)
+            goto err_free;
+    }
+
+    return sim;
+
+err_free:
+    sketh_sim_free(sim);
+    return NULL;
+}
+
+static int
+sketh_sim_register(struct sketh_sim *sim, unsigned int id)
+{
+    struct sketh_sim_pdata pdata = {
+        .ops         = &sketh_sim_ops,
+        .priv        = sim,
+        .num_vectors = num_vectors,
+    };
+    struct platform_device_info info = {
+        .name      = SKETH_SIM_DRIVER_NAME,
+        .id        = id,
+        .data      = &pdata,
+        .size_data = sizeof(pdata),
+        .dma_mask  = DMA_BIT_MASK(64),
+    };
+    struct platform_device *pdev;
+
+    eth_random_addr(pdata.mac_addr);
+
+    /* The device's own copy of pdata is what the driver gets */
+    pdev = platform_device_register_full(&info);
+    if (IS_ERR(pdev))
+        return PTR_ERR(pdev);
+
+    sim->pdev = pdev;
+
+    return 0;
+}
+
+static void
+sketh_sim_destroy_all(void)
+{
+    unsigned int i;
+
+    /* Unbind every driver first, a peer may still be sending until then */
+    for (i = 0; i < num_devs; i++)
+        if (sketh_sims[i] && sketh_sims[i]->pdev)
+            platform_device_unregister(sketh_sims[i]->pdev);
+
+    for (i = 0; i < num_devs; i++) {
+        struct sketh_sim *sim = sketh_sims[i];
+
+        if (!sim)
+            continue;
+
+        pr_info("%s.%u: tx %lld dropped %lld, rx %lld missed %lld\n",
+                SKETH_SIM_DRIVER_NAME, i,
+                (s64)atomic64_read(&sim->tx_packets),
+                (s64)atomic64_read(&sim->tx_dropped),
+                (s64)atomic64_read(&sim->rx_packets),
+                (s64)atomic64_read(&sim->rx_missed));
+
+        sketh_sim_free(sim);
+        sketh_sims[i] = NULL;
+    }
+}
+
+static int __init
+sketh_sim_init(void)
+{
+    unsigned int i;
+    int err;
+
+    if (!num_devs || num_devs > SKETH_SIM_MAX_DEVS)
+        return -EINVAL;
+
+    if (num_vectors < 1 + SKETH_NON_Q_VECTORS ||
+        num_vectors > SKETH_MAX_NUM_QUEUES + SKETH_NON_Q_VECTORS)
+        return -EINVAL;
+
+    for (i = 0; i < num_devs; i++) {
+        sketh_sims[i] = sketh_sim_create();
+        if (!sketh_sims[i]) {
+            err = -ENOMEM;
+            goto err_destroy;
+        }
+    }
+
+    /* One device talks to itself, two talk to each other */
+    for (i = 0; i < num_devs; i++)
+        sketh_sims[i]->peer = sketh_sims[num_devs - 1 - i];
+
+    for (i = 0; i < num_devs; i++) {
+        err = sketh_sim_register(sketh_sims[i], i);
+        if (err)
+            goto err_destroy;
+    }
+
+    pr_info("%s: %u device(s), %s\n", SKETH_SIM_DRIVER_NAME, num_devs,
+            num_devs == 1 ? "loopback" : "cross-connected");
+
+    return 0;
+
+err_destroy:
+    sketh_sim_destroy_all();
+    return err;
+}
+
+static void __exit
+sketh_sim_exit(void)
+{
+    sketh_sim_destroy_all();
+}
+
+module_init(sketh_sim_init);
+module_exit(sketh_sim_exit);
+
+MODULE_AUTHOR("sketh Driver Author");
+MODULE_DESCRIPTION("sketh device model for running the driver without hardware");
+MODULE_LICENSE("GPL");
+MODULE_VERSION(SKETH_DRIVER_VERSION);